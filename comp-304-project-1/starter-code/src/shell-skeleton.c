@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -11,10 +12,34 @@
 #include <ctype.h>
 #include <libgen.h>
 #include <limits.h>
+#include <stdint.h>
+#include <spawn.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <linux/futex.h>
+#include <stdatomic.h>
 
 #define BUF_SIZE 4096
 
 const char *sysname = "dash";
+int last_status; // exit status of the last foreground command, what a script exits with
+
+extern char **environ;
 
 enum return_codes {
 	SUCCESS = 0,
@@ -33,936 +58,6590 @@ struct command_t {
 };
 
 
-void kuhex_dump(const char *filename, int group_size) {
-    FILE *file = fopen(filename, "rb");
-    if (!file) {
-        perror("Error opening file");
-        return;
-    }
-
-    unsigned char buffer[16];
-    size_t bytes_read;
-    unsigned int offset = 0;
-
-    while ((bytes_read = fread(buffer, 1, 16, file)) > 0) {
-        // Print offset
-        printf("%08x: ", offset);
-        offset += bytes_read;
-
-        // Print hex bytes grouped by group_size
-        for (size_t i = 0; i < bytes_read; i++) {
-            if (i > 0 && i % group_size == 0) {
-                printf(" ");
-            }
-            printf("%02x", buffer[i]);
-        }
-
-        // Pad for shorter lines
-        for (size_t i = bytes_read; i < 16; i++) {
-            if (i % group_size == 0) {
-                printf(" ");
-            }
-            printf("   ");
-        }
-
-        // Print ASCII representation
-        printf("  ");
-        for (size_t i = 0; i < bytes_read; i++) {
-            char c = buffer[i];
-            printf("%c", (c >= 32 && c <= 126) ? c : '.');
-        }
-        printf("\n");
-    }
-
-    fclose(file);
+/**
+ * kuhex formatting: lines are built from lookup tables (and SSE2 nibble
+ * expansion where available) into a large buffer that is flushed with write.
+ */
+#define KUHEX_LINE_MAX 96 // 16 hex digit offset + a full line with group size 1
+#define KUHEX_OUT_SIZE (1 << 20)
+#define KUHEX_READ_SIZE (1 << 20)
+
+static const char hex_digits[] = "0123456789abcdef";
+static char kuhex_hex[256][2]; // byte -> two hex digits
+static char kuhex_ascii[256]; // byte -> printable character or '.'
+// kuhex stages of one pipeline can start together as threads
+static pthread_once_t kuhex_tables_once = PTHREAD_ONCE_INIT;
+
+void kuhex_init_tables(void) {
+	for (int i = 0; i < 256; ++i) {
+		kuhex_hex[i][0] = hex_digits[i >> 4];
+		kuhex_hex[i][1] = hex_digits[i & 15];
+		kuhex_ascii[i] = (i >= 32 && i <= 126) ? i : '.';
+	}
 }
 
-
 /**
- * Show the command prompt
- * @return [description]
+ * Hex digits and printable characters of 16 bytes.
  */
-int show_prompt() {
-	char cwd[1024], hostname[1024];
-	gethostname(hostname, sizeof(hostname));
-	getcwd(cwd, sizeof(cwd));
-	printf("%s@%s:%s %s> ", getenv("USER"), hostname, cwd, sysname);
-	return 0;
+static inline void kuhex_encode16(char *hex, char *ascii, const unsigned char *src) {
+#ifdef __SSE2__
+	__m128i v = _mm_loadu_si128((const __m128i *)src);
+	__m128i mask = _mm_set1_epi8(0x0f);
+	__m128i nine = _mm_set1_epi8(9);
+	__m128i zero = _mm_set1_epi8('0');
+	__m128i letters = _mm_set1_epi8('a' - '0' - 10);
+	__m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+	__m128i lo = _mm_and_si128(v, mask);
+
+	// '0' + nibble, plus the distance to 'a' for nibbles above 9
+	hi = _mm_add_epi8(_mm_add_epi8(hi, zero), _mm_and_si128(_mm_cmpgt_epi8(hi, nine), letters));
+	lo = _mm_add_epi8(_mm_add_epi8(lo, zero), _mm_and_si128(_mm_cmpgt_epi8(lo, nine), letters));
+	_mm_storeu_si128((__m128i *)hex, _mm_unpacklo_epi8(hi, lo));
+	_mm_storeu_si128((__m128i *)(hex + 16), _mm_unpackhi_epi8(hi, lo));
+
+	// signed compares: bytes >= 128 are negative and fail the first test
+	__m128i printable = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(31)),
+									  _mm_cmplt_epi8(v, _mm_set1_epi8(127)));
+	__m128i dots = _mm_andnot_si128(printable, _mm_set1_epi8('.'));
+	_mm_storeu_si128((__m128i *)ascii, _mm_or_si128(_mm_and_si128(printable, v), dots));
+#else
+	for (int i = 0; i < 16; ++i) {
+		memcpy(hex + 2 * i, kuhex_hex[src[i]], 2);
+		ascii[i] = kuhex_ascii[src[i]];
+	}
+#endif
 }
 
 /**
- * Helper function to list files in the current directory.
+ * Copy 32 hex digits in groups of chars, each followed by a space. Called
+ * with constants so the copies are inlined.
  */
-void list_files(const char *prefix, char *buf, size_t *index) {
-    FILE *fp = popen("ls", "r"); // Use "ls" to list files in the current directory
-    if (fp == NULL) {
-        perror("popen");
-        return;
-    }
+static inline char *kuhex_put_groups(char *p, const char *hex, const int chars) {
+	for (int i = 0; i < 32; i += chars) {
+		memcpy(p, hex + i, chars);
+		p[chars] = ' ';
+		p += chars + 1;
+	}
+	return p;
+}
 
-    char line[1024];
-    int matches = 0;
-    char match[1024] = {0};
-
-    while (fgets(line, sizeof(line), fp)) {
-        // Remove newline character from the line
-        line[strcspn(line, "\n")] = '\0';
-
-        if (strncmp(line, prefix, strlen(prefix)) == 0) {
-            matches++;
-            if (matches == 1) {
-                strcpy(match, line);
-            } else {
-                printf("\n%s", line);
-            }
-        }
-    }
+/**
+ * Format one line of up to 16 bytes in the "%08x: " offset, grouped hex
+ * and ASCII layout. Offsets past 4 GB get more digits instead of wrapping.
+ * @return number of characters written to dst
+ */
+size_t kuhex_format_line(char *dst, unsigned long long offset,
+						 const unsigned char *src, size_t n, int group_size) {
+	char *p = dst;
+	int digits = 8;
+
+	while (digits < 16 && (offset >> (4 * digits)) != 0)
+		digits++;
+	for (int i = digits - 1; i >= 0; --i)
+		*p++ = hex_digits[(offset >> (4 * i)) & 15];
+	*p++ = ':';
+	*p++ = ' ';
+
+	if (n == 16) {
+		char hex[32], ascii[16];
+		kuhex_encode16(hex, ascii, src);
+
+		// hex bytes grouped by group_size, the space after the last group
+		// is the first of the two before the ASCII column
+		switch (group_size) {
+		case 1:
+			p = kuhex_put_groups(p, hex, 2);
+			break;
+		case 2:
+			p = kuhex_put_groups(p, hex, 4);
+			break;
+		case 4:
+			p = kuhex_put_groups(p, hex, 8);
+			break;
+		case 8:
+			p = kuhex_put_groups(p, hex, 16);
+			break;
+		default:
+			p = kuhex_put_groups(p, hex, 32);
+			break;
+		}
+		*p++ = ' ';
+		memcpy(p, ascii, 16);
+		p += 16;
+		*p++ = '\n';
+		return p - dst;
+	}
 
-    pclose(fp);
+	// short last line, same layout as the byte at a time printer
+	for (size_t i = 0; i < n; i++) {
+		if (i > 0 && i % group_size == 0)
+			*p++ = ' ';
+		memcpy(p, kuhex_hex[src[i]], 2);
+		p += 2;
+	}
 
-	
+	// Pad for shorter lines
+	for (size_t i = n; i < 16; i++) {
+		if (i % group_size == 0)
+			*p++ = ' ';
+		memcpy(p, "   ", 3);
+		p += 3;
+	}
 
-    if (matches == 1) {
-        size_t target_len = strlen(prefix);
-        snprintf(buf + *index - target_len, sizeof(buf) - *index + target_len, "%s ", match);
-        *index = strlen(buf);
-        printf("%s", match + target_len); // Print only the completed part
-    } else if (matches > 1) {
-		printf("\n");
-		show_prompt();
-        printf("%s", buf); // Reprint the buffer for the user
-		
-    } else {
-        printf("\nNo matches found\n%s", buf);
-    }
+	// Print ASCII representation
+	*p++ = ' ';
+	*p++ = ' ';
+	for (size_t i = 0; i < n; i++)
+		*p++ = kuhex_ascii[src[i]];
+	*p++ = '\n';
+	return p - dst;
 }
 
 /**
- * Helper function to list commands in PATH and built-in commands.
+ * Pipeline threads: builtin stages next to each other in a pipeline run as
+ * threads of the shell and pass data through a single producer, single
+ * consumer ring instead of a kernel pipe. The indices are lock free, a side
+ * only sleeps on a futex when the ring is full or empty and is only woken
+ * if it said it was sleeping.
  */
-void list_commands(const char *prefix, char *buf, size_t *index) {
-    const char *path = getenv("PATH");
-    char *path_copy = strdup(path);
-    char *dir = strtok(path_copy, ":");
-
-    const char *builtins[] = {"cd", "exit", NULL};
-    int matches = 0;
-    char match[1024] = {0};
-
-    // Check built-in commands
-    for (int i = 0; builtins[i] != NULL; ++i) {
-        if (strncmp(builtins[i], prefix, strlen(prefix)) == 0) {
-            matches++;
-            if (matches == 1) {
-                strcpy(match, builtins[i]);
-            } else {
-                printf("\n%s", builtins[i]);
-            }
-        }
-    }
-
-    // Check PATH directories for executable files
-    while (dir != NULL) {
-        FILE *fp;
-        char command[1024];
-        snprintf(command, sizeof(command), "ls %s", dir);
-        fp = popen(command, "r");
-        if (fp == NULL) {
-            dir = strtok(NULL, ":");
-            continue;
-        }
-
-        char line[1024];
-        while (fgets(line, sizeof(line), fp)) {
-            // Remove newline character
-            line[strcspn(line, "\n")] = '\0';
-
-            if (strncmp(line, prefix, strlen(prefix)) == 0) {
-                matches++;
-                if (matches == 1) {
-                    strcpy(match, line);
-                } else {
-                    printf("\n%s", line);
-                }
-            }
-        }
-
-        pclose(fp);
-        dir = strtok(NULL, ":");
-    }
-
-    free(path_copy);
-
-    if (matches <= 2) {
-		size_t target_len = strlen(prefix);
-		size_t match_len = strlen(match);
+#define RING_SIZE (1 << 18) // a power of two, small enough to stay in cache
+
+struct ring {
+	char *data;
+	_Alignas(64) _Atomic uint32_t head; // bytes written, stored by the producer
+	_Alignas(64) _Atomic uint32_t tail; // bytes read, stored by the consumer
+	_Alignas(64) _Atomic uint32_t data_seq; // futex words, bumped to wake the other side
+	_Atomic uint32_t space_seq;
+	_Atomic bool reader_waiting, writer_waiting;
+	_Atomic bool closed; // the producer is done
+	_Atomic bool abandoned; // the consumer is done
+};
 
-		// Append the remaining part of the match to the buffer
-		strncpy(buf + *index - target_len, match, match_len);
+struct ring *ring_new() {
+	struct ring *r = aligned_alloc(64, sizeof(struct ring));
+	memset(r, 0, sizeof(*r));
+	r->data = malloc(RING_SIZE);
+	return r;
+}
 
-		// Add a space to signify completion and null-terminate the string
-		buf[*index - target_len + match_len] = ' ';
-		buf[*index - target_len + match_len + 1] = '\0';
+void ring_free(struct ring *r) {
+	free(r->data);
+	free(r);
+}
 
-		// Update the index to reflect the new buffer length
-		*index = strlen(buf);
+static void ring_wake(_Atomic uint32_t *seq) {
+	atomic_fetch_add(seq, 1);
+	syscall(SYS_futex, seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
 
-		// Print the updated buffer
-		printf("\r%s", buf); // Reprint the prompt and the completed command
+static void ring_sleep(_Atomic uint32_t *seq, uint32_t seen) {
+	syscall(SYS_futex, seq, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+}
 
+/**
+ * Copy all of buf into the ring, sleeping while it is full.
+ * @return 0 on success, -1 with EPIPE once the consumer is gone
+ */
+int ring_write(struct ring *r, const char *buf, size_t len) {
+	uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
 
+	while (len > 0) {
+		if (atomic_load_explicit(&r->abandoned, memory_order_relaxed)) {
+			errno = EPIPE;
+			return -1;
+		}
+		uint32_t space = RING_SIZE - (head - atomic_load(&r->tail));
+		if (space == 0) {
+			uint32_t seen = atomic_load(&r->space_seq);
+			atomic_store(&r->writer_waiting, true);
+			if (RING_SIZE - (head - atomic_load(&r->tail)) == 0 && !atomic_load(&r->abandoned))
+				ring_sleep(&r->space_seq, seen);
+			continue;
+		}
 
-    } else if (matches > 2) {
-		printf("\n");
-		show_prompt();
-        printf("%s", buf); // Reprint the buffer for the user
-    } 
+		size_t n = len < space ? len : space;
+		size_t at = head & (RING_SIZE - 1);
+		size_t first = n < RING_SIZE - at ? n : RING_SIZE - at;
+		memcpy(r->data + at, buf, first);
+		memcpy(r->data, buf + first, n - first);
+		head += n;
+		atomic_store(&r->head, head);
+		if (atomic_exchange(&r->reader_waiting, false))
+			ring_wake(&r->data_seq);
+		buf += n;
+		len -= n;
+	}
+	return 0;
 }
 
 /**
- * Handles auto-completion for commands and files.
+ * Read up to len bytes, sleeping while the ring is empty.
+ * @return bytes read, 0 once the producer closed the ring and it is drained
  */
-void auto_complete(char *buf, size_t *index) {
-    char *last_token = strrchr(buf, ' '); // Find the last token
-    const char *target = last_token ? last_token + 1 : buf;
+ssize_t ring_read(struct ring *r, char *buf, size_t len) {
+	uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+	for (;;) {
+		uint32_t available = atomic_load(&r->head) - tail;
+		if (available > 0) {
+			size_t n = len < available ? len : available;
+			size_t at = tail & (RING_SIZE - 1);
+			size_t first = n < RING_SIZE - at ? n : RING_SIZE - at;
+			memcpy(buf, r->data + at, first);
+			memcpy(buf + first, r->data, n - first);
+			atomic_store(&r->tail, tail + n);
+			if (atomic_exchange(&r->writer_waiting, false))
+				ring_wake(&r->space_seq);
+			return n;
+		}
+		if (atomic_load(&r->closed)) {
+			if (atomic_load(&r->head) == tail)
+				return 0;
+			continue;
+		}
 
-    // Check if the input matches any known commands or is fully typed
-    if (strchr(buf, ' ') == NULL) {
-        // If there's no space, assume it's a command and check for matches
-        list_commands(target, buf, index);
-    } else {
-        // If there's a space, assume the command is fully typed and list files
-        list_files(target, buf, index);
-    }
+		uint32_t seen = atomic_load(&r->data_seq);
+		atomic_store(&r->reader_waiting, true);
+		if (atomic_load(&r->head) == tail && !atomic_load(&r->closed))
+			ring_sleep(&r->data_seq, seen);
+	}
+}
+
+void ring_close(struct ring *r) {
+	atomic_store(&r->closed, true);
+	ring_wake(&r->data_seq);
+}
+
+void ring_abandon(struct ring *r) {
+	atomic_store(&r->abandoned, true);
+	ring_wake(&r->space_seq);
 }
 
 /**
- * Prints a command struct
- * @param struct command_t *
+ * Where a builtin running as a pipeline thread reads and writes: a ring
+ * shared with the neighbouring thread stage, or an fd (-1 for the shell's
+ * own stdin and stdout). Builtins that can run as threads read stdin with
+ * read_input and write stdout with write_all, which look this up.
  */
-void print_command(struct command_t *command) {
-	int i = 0;
-	printf("Command: <%s>\n", command->name);
-	printf("\tIs Background: %s\n", command->background ? "yes" : "no");
-	printf("\tNeeds Auto-complete: %s\n",
-		   command->auto_complete ? "yes" : "no");
-	printf("\tRedirects:\n");
+struct stage_io {
+	struct ring *in, *out;
+	int in_fd, out_fd;
+};
 
-	for (i = 0; i < 3; i++) {
-		printf("\t\t%d: %s\n", i,
-			   command->redirects[i] ? command->redirects[i] : "N/A");
-	}
+static __thread struct stage_io *stage_io; // set on pipeline threads
 
-	printf("\tArguments (%d):\n", command->arg_count);
+#define STAGE_RING -2 // stage_fd of a side that is a ring
 
-	for (i = 0; i < command->arg_count; ++i) {
-		printf("\t\tArg %d: %s\n", i, command->args[i]);
-	}
+/**
+ * The fd behind stdin or stdout for the calling thread, STAGE_RING if it
+ * is a ring. Other fds are returned as they are.
+ */
+int stage_fd(int fd) {
+	if (stage_io == NULL)
+		return fd;
+	if (fd == STDIN_FILENO)
+		return stage_io->in != NULL ? STAGE_RING : stage_io->in_fd != -1 ? stage_io->in_fd : fd;
+	if (fd == STDOUT_FILENO)
+		return stage_io->out != NULL ? STAGE_RING : stage_io->out_fd != -1 ? stage_io->out_fd : fd;
+	return fd;
+}
 
-	if (command->next) {
-		printf("\tPiped to:\n");
-		print_command(command->next);
-	}
+ssize_t read_input(int fd, void *buf, size_t len) {
+	fd = stage_fd(fd);
+	if (fd == STAGE_RING)
+		return ring_read(stage_io->in, buf, len);
+	return read(fd, buf, len);
 }
 
 /**
- * Release allocated memory of a command
- * @param  command [description]
- * @return         [description]
+ * Write all of buf to fd.
+ * @return 0 on success
  */
-int free_command(struct command_t *command) {
-	if (command->arg_count) {
-		for (int i = 0; i < command->arg_count; ++i)
-			free(command->args[i]);
-		free(command->args);
+int write_all(int fd, const char *buf, size_t len) {
+	fd = stage_fd(fd);
+	if (fd == STAGE_RING)
+		return ring_write(stage_io->out, buf, len);
+	while (len > 0) {
+		ssize_t written = write(fd, buf, len);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += written;
+		len -= written;
 	}
+	return 0;
+}
 
-	for (int i = 0; i < 3; ++i) {
-		if (command->redirects[i])
-			free(command->redirects[i]);
-	}
+struct kuhex_options {
+	int group_size;
+	unsigned long long offset;
+	unsigned long long length; // ULLONG_MAX for the rest of the file
+	int threads; // formatting threads for mapped files
+	int out_fd;
+};
 
-	if (command->next) {
-		free_command(command->next);
-		command->next = NULL;
+/**
+ * Format len bytes starting at file offset into fd, flushing the output
+ * buffer whenever it fills up.
+ * @return 0 on success
+ */
+int kuhex_format(int fd, char *out, size_t *used, const unsigned char *data,
+				 size_t len, unsigned long long offset, int group_size) {
+	for (size_t i = 0; i < len; i += 16) {
+		if (*used + KUHEX_LINE_MAX > KUHEX_OUT_SIZE) {
+			if (write_all(fd, out, *used) != 0)
+				return -1;
+			*used = 0;
+		}
+		size_t n = len - i < 16 ? len - i : 16;
+		*used += kuhex_format_line(out + *used, offset + i, data + i, n, group_size);
 	}
-
-	free(command->name);
-	free(command);
 	return 0;
 }
 
-
-
 /**
- * Parse a command string into a command struct
- * @param  buf     [description]
- * @param  command [description]
- * @return         0
+ * Write all buffers of an iovec array to fd.
+ * @return 0 on success
  */
-int parse_command(char *buf, struct command_t *command) {
-	const char *splitters = " \t"; // split at whitespace
-	int index, len;
-	len = strlen(buf);
-
-	// trim left whitespace
-	while (len > 0 && strchr(splitters, buf[0]) != NULL) {
-		buf++;
-		len--;
+int writev_all(int fd, struct iovec *iov, int count) {
+	fd = stage_fd(fd);
+	if (fd == STAGE_RING) {
+		for (int i = 0; i < count; ++i)
+			if (ring_write(stage_io->out, iov[i].iov_base, iov[i].iov_len) != 0)
+				return -1;
+		return 0;
 	}
-
-	while (len > 0 && strchr(splitters, buf[len - 1]) != NULL) {
-		// trim right whitespace
-		buf[--len] = 0;
+	while (count > 0) {
+		ssize_t written = writev(fd, iov, count);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		while (count > 0 && (size_t)written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = (char *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
 	}
+	return 0;
+}
 
-	// auto-complete
-	if (len > 0 && buf[len - 1] == '?') {
-		command->auto_complete = true;
-	}
+/**
+ * Parallel formatting of a mapped file: the input is cut into line aligned
+ * chunks, workers format chunks into a ring of output slots and the calling
+ * thread writes the slots in chunk order, so the output is the same as the
+ * serial one.
+ */
+#define KUHEX_CHUNK_SIZE (256 << 10) // a multiple of 16
+
+struct kuhex_job {
+	const unsigned char *data;
+	unsigned long long length;
+	const struct kuhex_options *options;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	unsigned long long chunk_count;
+	unsigned long long next_chunk; // next chunk to format
+	unsigned long long written; // chunks written so far
+	int slot_count;
+	char **slots; // chunk c is formatted into slots[c % slot_count]
+	size_t *used; // formatted size of a slot, 0 while it is not ready
+	bool failed;
+};
 
-	// background
-	if (len > 0 && buf[len - 1] == '&') {
-		command->background = true;
-	}
+void *kuhex_worker(void *arg) {
+	struct kuhex_job *job = arg;
 
-	char *pch = strtok(buf, splitters);
-	if (pch == NULL) {
-		command->name = (char *)malloc(1);
-		command->name[0] = 0;
-	} else {
-		command->name = (char *)malloc(strlen(pch) + 1);
-		strcpy(command->name, pch);
-	}
+	pthread_mutex_lock(&job->lock);
+	while (!job->failed && job->next_chunk < job->chunk_count) {
+		unsigned long long chunk = job->next_chunk++;
+		int slot = chunk % job->slot_count;
 
-	command->args = (char **)malloc(sizeof(char *));
+		// the slot is free once the chunk that used it before has been written
+		while (!job->failed && job->written + job->slot_count <= chunk)
+			pthread_cond_wait(&job->changed, &job->lock);
+		if (job->failed)
+			break;
+		pthread_mutex_unlock(&job->lock);
+
+		unsigned long long start = chunk * KUHEX_CHUNK_SIZE;
+		unsigned long long len = job->length - start;
+		size_t used = 0;
+		if (len > KUHEX_CHUNK_SIZE)
+			len = KUHEX_CHUNK_SIZE;
+		for (unsigned long long i = 0; i < len; i += 16) {
+			size_t n = len - i < 16 ? len - i : 16;
+			used += kuhex_format_line(job->slots[slot] + used,
+									  job->options->offset + start + i,
+									  job->data + start + i, n,
+									  job->options->group_size);
+		}
 
-	int redirect_index;
-	int arg_index = 0;
-	char temp_buf[1024], *arg;
+		pthread_mutex_lock(&job->lock);
+		job->used[slot] = used;
+		pthread_cond_broadcast(&job->changed);
+	}
+	pthread_mutex_unlock(&job->lock);
+	return NULL;
+}
 
-	while (1) {
-		// tokenize input on splitters
-		pch = strtok(NULL, splitters);
-		if (!pch)
+/**
+ * Format length bytes of mapped data with options->threads workers.
+ * @return 0 on success
+ */
+int kuhex_parallel(const unsigned char *data, unsigned long long length,
+				   const struct kuhex_options *options) {
+	struct kuhex_job job;
+	int threads = options->threads;
+	int result = 0;
+
+	memset(&job, 0, sizeof(job));
+	job.data = data;
+	job.length = length;
+	job.options = options;
+	job.chunk_count = (length + KUHEX_CHUNK_SIZE - 1) / KUHEX_CHUNK_SIZE;
+	if ((unsigned long long)threads > job.chunk_count)
+		threads = job.chunk_count;
+	job.slot_count = 2 * threads;
+	job.slots = malloc(sizeof(char *) * job.slot_count);
+	job.used = calloc(job.slot_count, sizeof(size_t));
+	for (int i = 0; i < job.slot_count; ++i)
+		job.slots[i] = malloc(KUHEX_CHUNK_SIZE / 16 * KUHEX_LINE_MAX);
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_cond_init(&job.changed, NULL);
+
+	pthread_t workers[threads];
+	int started = 0;
+	for (; started < threads; ++started) {
+		if (pthread_create(&workers[started], NULL, kuhex_worker, &job) != 0)
 			break;
-		arg = temp_buf;
-		strcpy(arg, pch);
-		len = strlen(arg);
-
-		// empty arg, go for next
-		if (len == 0) {
-			continue;
+	}
+	if (started == 0)
+		job.failed = true;
+
+	// write the ready slots in order, as many at once as are ready
+	pthread_mutex_lock(&job.lock);
+	while (!job.failed && job.written < job.chunk_count) {
+		struct iovec iov[job.slot_count];
+		int count = 0;
+
+		while (job.used[job.written % job.slot_count] == 0)
+			pthread_cond_wait(&job.changed, &job.lock);
+		while (count < job.slot_count && job.written + count < job.chunk_count) {
+			int slot = (job.written + count) % job.slot_count;
+			if (job.used[slot] == 0)
+				break;
+			iov[count].iov_base = job.slots[slot];
+			iov[count].iov_len = job.used[slot];
+			count++;
 		}
+		pthread_mutex_unlock(&job.lock);
+
+		if (writev_all(options->out_fd, iov, count) != 0)
+			result = -1;
+
+		pthread_mutex_lock(&job.lock);
+		for (int i = 0; i < count; ++i)
+			job.used[(job.written + i) % job.slot_count] = 0;
+		job.written += count;
+		if (result != 0)
+			job.failed = true;
+		pthread_cond_broadcast(&job.changed);
+	}
+	pthread_mutex_unlock(&job.lock);
+
+	for (int i = 0; i < started; ++i)
+		pthread_join(workers[i], NULL);
+	if (started == 0)
+		result = -1;
+
+	for (int i = 0; i < job.slot_count; ++i)
+		free(job.slots[i]);
+	free(job.slots);
+	free(job.used);
+	pthread_mutex_destroy(&job.lock);
+	pthread_cond_destroy(&job.changed);
+	return result;
+}
 
-		// trim left whitespace
-		while (len > 0 && strchr(splitters, arg[0]) != NULL) {
-			arg++;
-			len--;
-		}
+/**
+ * Open a kuhex input, - for stdin. Stdin is read through read_input so it
+ * can be a pipeline ring.
+ */
+int kuhex_open(const char *filename) {
+	return strcmp(filename, "-") == 0 ? STDIN_FILENO : open(filename, O_RDONLY);
+}
 
-		// trim right whitespace
-		while (len > 0 && strchr(splitters, arg[len - 1]) != NULL) {
-			arg[--len] = 0;
-		}
+void kuhex_close(int fd) {
+	if (fd != STDIN_FILENO)
+		close(fd);
+}
 
-		// empty arg, go for next
-		if (len == 0) {
-			continue;
-		}
+/**
+ * Dump part of a file as described by options. Regular files are mmap'ed
+ * and big ones are formatted in parallel, anything else is read in large
+ * blocks.
+ * @return 0 on success
+ */
+int kuhex_dump(const char *filename, const struct kuhex_options *options) {
+	int group_size = options->group_size;
+	unsigned long long offset = options->offset;
+	unsigned long long length = options->length;
+	int fd = options->out_fd;
+	char *out;
+	size_t used = 0;
+	int result = 0;
+	struct stat st;
+
+	int in = kuhex_open(filename);
+	if (in == -1) {
+		perror("Error opening file");
+		return -1;
+	}
 
-		// piping to another command
-		if (strcmp(arg, "|") == 0) {
-			struct command_t *c = malloc(sizeof(struct command_t));
-			int l = strlen(pch);
-			pch[l] = splitters[0]; // restore strtok termination
-			index = 1;
-			while (pch[index] == ' ' || pch[index] == '\t')
-				index++; // skip whitespaces
+	pthread_once(&kuhex_tables_once, kuhex_init_tables);
+	fflush(stdout);
+	out = malloc(KUHEX_OUT_SIZE);
 
-			parse_command(pch + index, c);
-			pch[l] = 0; // put back strtok termination
-			command->next = c;
-			continue;
+	if (fstat(stage_fd(in), &st) == 0 && S_ISREG(st.st_mode)) {
+		unsigned long long size = st.st_size;
+		if (offset >= size) {
+			free(out);
+			kuhex_close(in);
+			return 0;
 		}
-
-		// background process
-		if (strcmp(arg, "&") == 0) {
-			// handled before
-			continue;
+		if (length > size - offset)
+			length = size - offset;
+
+		unsigned char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, stage_fd(in), 0);
+		if (data == MAP_FAILED) {
+			perror("Error mapping file");
+			free(out);
+			kuhex_close(in);
+			return -1;
 		}
+		madvise(data, size, MADV_SEQUENTIAL);
+		if (options->threads > 1 && length > 2 * KUHEX_CHUNK_SIZE)
+			result = kuhex_parallel(data + offset, length, options);
+		else
+			result = kuhex_format(fd, out, &used, data + offset, length, offset,
+								  group_size);
+		munmap(data, size);
+	} else {
+		// pipes and devices: skip to offset, then format whole lines per block
+		unsigned char *block = malloc(KUHEX_READ_SIZE);
+		unsigned long long skipped = 0, position = offset, remaining = length;
+		size_t pending = 0;
+
+		while (result == 0) {
+			size_t want = KUHEX_READ_SIZE - pending;
+			if (skipped == offset && remaining - pending < want)
+				want = remaining - pending;
+			if (want == 0)
+				break;
 
-		// handle input redirection
-		redirect_index = -1;
-		if (arg[0] == '<') {
-			redirect_index = 0;
-		}
+			ssize_t got = read_input(in, block + pending, want);
+			if (got < 0 && errno == EINTR)
+				continue;
+			if (got <= 0)
+				break;
 
-		if (arg[0] == '>') {
-			if (len > 1 && arg[1] == '>') {
-				redirect_index = 2;
-				arg++;
-				len--;
-			} else {
-				redirect_index = 1;
+			if (skipped < offset) {
+				unsigned long long skip = offset - skipped;
+				if (skip > (unsigned long long)got)
+					skip = got;
+				skipped += skip;
+				memmove(block, block + skip, got - skip);
+				got -= skip;
 			}
+			pending += got;
+			if (pending > remaining)
+				pending = remaining;
+
+			size_t whole = pending - pending % 16;
+			result = kuhex_format(fd, out, &used, block, whole, position, group_size);
+			position += whole;
+			remaining -= whole;
+			memmove(block, block + whole, pending - whole);
+			pending -= whole;
 		}
+		if (result == 0)
+			result = kuhex_format(fd, out, &used, block, pending, position, group_size);
+		free(block);
+	}
 
-		if (redirect_index != -1) {
-			command->redirects[redirect_index] = malloc(len);
-			strcpy(command->redirects[redirect_index], arg + 1);
-			continue;
-		}
-
-		// normal arguments
-		if (len > 2 &&
-			((arg[0] == '"' && arg[len - 1] == '"') ||
-			 (arg[0] == '\'' && arg[len - 1] == '\''))) // quote wrapped arg
-		{
-			arg[--len] = 0;
-			arg++;
-		}
+	if (result == 0 && used > 0)
+		result = write_all(fd, out, used);
+	free(out);
+	kuhex_close(in);
+	return result;
+}
 
-		command->args =
-			(char **)realloc(command->args, sizeof(char *) * (arg_index + 1));
 
-		command->args[arg_index] = (char *)malloc(len + 1);
-		strcpy(command->args[arg_index++], arg);
+/**
+ * kuhex -r: rebuild binary data from a dump. Each line is "offset: " followed
+ * by hex digits in groups of any size and the ASCII column, which is ignored.
+ * Full lines are gathered into 32 digits and decoded with SSE2, other lines
+ * byte by byte. Output goes through a buffer that is written with pwrite at
+ * the dumped offsets, counted from the output's current position, so
+ * skipped regions cost nothing on seekable outputs.
+ */
+static signed char kuhex_unhex[256]; // hex digit -> value, -1 otherwise
+static pthread_once_t kuhex_unhex_once = PTHREAD_ONCE_INIT;
+
+void kuhex_init_unhex(void) {
+	memset(kuhex_unhex, -1, sizeof(kuhex_unhex));
+	for (int i = 0; i < 10; ++i)
+		kuhex_unhex['0' + i] = i;
+	for (int i = 0; i < 6; ++i) {
+		kuhex_unhex['a' + i] = 10 + i;
+		kuhex_unhex['A' + i] = 10 + i;
 	}
-	command->arg_count = arg_index;
-
-	// increase args size by 2
-	command->args = (char **)realloc(
-		command->args, sizeof(char *) * (command->arg_count += 2));
+}
 
-	// shift everything forward by 1
-	for (int i = command->arg_count - 2; i > 0; --i) {
-		command->args[i] = command->args[i - 1];
+/**
+ * Decode 32 hex digits into 16 bytes.
+ * @return 0 if all digits were valid
+ */
+static inline int kuhex_decode32(unsigned char *dst, const char *hex) {
+#ifdef __SSE2__
+	__m128i words[2];
+	int valid = 0xffff;
+
+	for (int half = 0; half < 2; ++half) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(hex + 16 * half));
+		__m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+		__m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+										 _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+		__m128i is_letter =
+			_mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+						  _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+		__m128i digits = _mm_and_si128(is_digit, _mm_sub_epi8(v, _mm_set1_epi8('0')));
+		__m128i letters =
+			_mm_and_si128(is_letter, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10)));
+		__m128i nibbles = _mm_or_si128(digits, letters);
+
+		valid &= _mm_movemask_epi8(_mm_or_si128(is_digit, is_letter));
+
+		// each 16 bit word holds the high nibble in its low byte and the low nibble above it
+		words[half] = _mm_or_si128(
+			_mm_slli_epi16(_mm_and_si128(nibbles, _mm_set1_epi16(0x00ff)), 4),
+			_mm_srli_epi16(nibbles, 8));
+	}
+	if (valid != 0xffff)
+		return -1;
+	_mm_storeu_si128((__m128i *)dst, _mm_packus_epi16(words[0], words[1]));
+	return 0;
+#else
+	for (int i = 0; i < 16; ++i) {
+		int hi = kuhex_unhex[(unsigned char)hex[2 * i]];
+		int lo = kuhex_unhex[(unsigned char)hex[2 * i + 1]];
+		if (hi < 0 || lo < 0)
+			return -1;
+		dst[i] = hi << 4 | lo;
 	}
-
-	// set args[0] as a copy of name
-	command->args[0] = strdup(command->name);
-
-	// set args[arg_count-1] (last) to NULL
-	command->args[command->arg_count - 1] = NULL;
-
 	return 0;
+#endif
 }
 
-void prompt_backspace() {
-	putchar(8); // go back 1
-	putchar(' '); // write empty over
-	putchar(8); // go back 1 again
+struct kuhex_writer {
+	int fd;
+	bool seekable;
+	char *buf;
+	size_t used;
+	unsigned long long base; // output offset of buf[0]
+	unsigned long long position; // bytes written so far to an unseekable output
+	off_t origin; // file offset of output offset 0 on a seekable output
+	unsigned long long end; // highest output offset written, the fd is left there
+};
+
+int kuhex_writer_flush(struct kuhex_writer *w) {
+	size_t done = 0;
+
+	while (w->seekable && done < w->used) {
+		ssize_t written =
+			pwrite(w->fd, w->buf + done, w->used - done, w->origin + w->base + done);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("kuhex");
+			return -1;
+		}
+		done += written;
+	}
+	if (!w->seekable) {
+		if (write_all(w->fd, w->buf, w->used) != 0) {
+			if (errno != EPIPE) // the reader is gone, as quiet as SIGPIPE
+				perror("kuhex");
+			return -1;
+		}
+		w->position += w->used;
+	}
+	if (w->base + w->used > w->end)
+		w->end = w->base + w->used;
+	w->base += w->used;
+	w->used = 0;
+	return 0;
 }
 
 /**
- * Prompt a command from the user
- * @param  buf      [description]
- * @param  buf_size [description]
- * @return          [description]
+ * Queue n bytes for output offset offset.
+ * @return 0 on success
  */
-int prompt(struct command_t *command) {
-	size_t index = 0;
-	char c;
-	char buf[4096];
-	static char oldbuf[4096];
-
-	// tcgetattr gets the parameters of the current terminal
-	// STDIN_FILENO will tell tcgetattr that it should write the settings
-	// of stdin to oldt
-	static struct termios backup_termios, new_termios;
-	tcgetattr(STDIN_FILENO, &backup_termios);
-	new_termios = backup_termios;
-	// ICANON normally takes care that one line at a time will be processed
-	// that means it will return if it sees a "\n" or an EOF or an EOL
-	new_termios.c_lflag &=
-		~(ICANON |
-		  ECHO); // Also disable automatic echo. We manually echo each char.
-	// Those new settings will be set to STDIN
-	// TCSANOW tells tcsetattr to change attributes immediately.
-	tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
-
-	show_prompt();
-	buf[0] = 0;
-
-	while (1) {
-		c = getchar();
-		// printf("Keycode: %u\n", c); // DEBUG: uncomment for debugging
-
-		// handle tab
-		if (c == 9) {
-			//buf[index++] = '?'; // autocomplete
-			//break;
-			
-            auto_complete(buf, &index);
-            continue;
+int kuhex_writer_put(struct kuhex_writer *w, unsigned long long offset,
+					 const unsigned char *bytes, size_t n) {
+	if (offset != w->base + w->used || w->used + n > KUHEX_OUT_SIZE) {
+		if (kuhex_writer_flush(w) != 0)
+			return -1;
+		if (!w->seekable) {
+			// a pipe cannot seek, gaps are written out as zeros
+			if (offset < w->position) {
+				fprintf(stderr, "kuhex: offset %llx goes backwards on an unseekable output\n",
+						offset);
+				return -1;
+			}
+			while (w->position < offset) {
+				size_t gap = offset - w->position;
+				if (gap > KUHEX_OUT_SIZE)
+					gap = KUHEX_OUT_SIZE;
+				memset(w->buf, 0, gap);
+				w->used = gap;
+				if (kuhex_writer_flush(w) != 0)
+					return -1;
+			}
 		}
+		w->base = offset;
+	}
+	memcpy(w->buf + w->used, bytes, n);
+	w->used += n;
+	return 0;
+}
 
-		// handle backspace
-		if (c == 127) {
-			if (index > 0) {
-				prompt_backspace();
-				index--;
+/**
+ * Parse one dump line in [p, end) and queue its bytes.
+ * @return 0 on success, lines without an offset are skipped
+ */
+int kuhex_reverse_line(struct kuhex_writer *w, const char *p, const char *end) {
+	unsigned long long offset = 0;
+	unsigned char bytes[16];
+	const char *start = p;
+	size_t n = 0;
+
+	while (p < end && kuhex_unhex[(unsigned char)*p] >= 0)
+		offset = offset << 4 | kuhex_unhex[(unsigned char)*p++];
+	if (p == start || p + 1 >= end || p[0] != ':' || p[1] != ' ')
+		return 0;
+	p += 2;
+
+	// full line: 16 groups of digits separated by single spaces, the group
+	// size is read off the first group and must end in two spaces
+	const char *space = memchr(p, ' ', end - p < 33 ? end - p : 33);
+	if (space != NULL) {
+		size_t group = space - p;
+		size_t width = 32 + 32 / (group ? group : 1) - 1;
+		if ((group == 2 || group == 4 || group == 8 || group == 16 || group == 32) &&
+			p + width + 2 <= end && p[width] == ' ' && p[width + 1] == ' ') {
+			char hex[32];
+			bool layout = true;
+			for (size_t i = 0, j = 0; i < 32; i += group, j += group + 1) {
+				if (j > 0 && p[j - 1] != ' ')
+					layout = false;
+				memcpy(hex + i, p + j, group);
 			}
-			continue;
+			if (layout && kuhex_decode32(bytes, hex) == 0)
+				return kuhex_writer_put(w, offset, bytes, 16);
 		}
+	}
 
-		if (c == 27 || c == 91) {
-			continue;
-		}
+	// short or unusual line: pairs of digits, a single space may separate groups
+	while (n < 16 && p + 1 < end && kuhex_unhex[(unsigned char)p[0]] >= 0 &&
+		   kuhex_unhex[(unsigned char)p[1]] >= 0) {
+		bytes[n++] = kuhex_unhex[(unsigned char)p[0]] << 4 | kuhex_unhex[(unsigned char)p[1]];
+		p += 2;
+		if (p + 1 < end && p[0] == ' ' && kuhex_unhex[(unsigned char)p[1]] >= 0)
+			p++;
+	}
+	return n > 0 ? kuhex_writer_put(w, offset, bytes, n) : 0;
+}
 
-		// up arrow
-		if (c == 65) {
-			while (index > 0) {
-				prompt_backspace();
-				index--;
+/**
+ * Rebuild the binary of a kuhex dump into out_fd. Existing bytes of a
+ * seekable output outside the dumped offsets are left alone, so a dump
+ * of a few lines patches a file in place.
+ * @return 0 on success
+ */
+int kuhex_reverse(const char *filename, int out_fd) {
+	struct kuhex_writer w = { stage_fd(out_fd), false, NULL, 0, 0, 0, 0, 0 };
+	struct stat st;
+	int result = 0;
+
+	int in = kuhex_open(filename);
+	if (in == -1) {
+		perror("Error opening file");
+		return -1;
+	}
+	pthread_once(&kuhex_unhex_once, kuhex_init_unhex);
+	fflush(stdout);
+
+	// offsets count from where the fd is; O_APPEND ignores pwrite offsets, so an
+	// appending output is written in order like a pipe
+	w.origin = lseek(w.fd, 0, SEEK_CUR);
+	int flags = fcntl(w.fd, F_GETFL);
+	w.seekable = w.origin != -1 && flags != -1 && !(flags & O_APPEND);
+	w.buf = malloc(KUHEX_OUT_SIZE);
+
+	if (fstat(stage_fd(in), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, stage_fd(in), 0);
+		if (data == MAP_FAILED) {
+			perror("Error mapping file");
+			result = -1;
+		} else {
+			madvise(data, st.st_size, MADV_SEQUENTIAL);
+			const char *p = data, *end = data + st.st_size;
+			while (result == 0 && p < end) {
+				const char *eol = memchr(p, '\n', end - p);
+				if (eol == NULL)
+					eol = end;
+				result = kuhex_reverse_line(&w, p, eol);
+				p = eol + 1;
 			}
-
-			char tmpbuf[4096];
-			printf("%s", oldbuf);
-			strcpy(tmpbuf, buf);
-			strcpy(buf, oldbuf);
-			strcpy(oldbuf, tmpbuf);
-			index += strlen(buf);
-			continue;
+			munmap(data, st.st_size);
 		}
+	} else {
+		// pipes: read blocks and keep the partial last line for the next one
+		char *block = malloc(KUHEX_READ_SIZE);
+		size_t pending = 0;
+
+		while (result == 0) {
+			ssize_t got = read_input(in, block + pending, KUHEX_READ_SIZE - pending);
+			if (got < 0 && errno == EINTR)
+				continue;
+			if (got <= 0)
+				break;
+			pending += got;
 
-		putchar(c); // echo the character
-		buf[index++] = c;
-		if (index >= sizeof(buf) - 1)
-			break;
-		if (c == '\n') // enter key
-			break;
-		if (c == 4) // Ctrl+D
-			return EXIT;
+			char *p = block, *end = block + pending, *eol;
+			while (result == 0 && (eol = memchr(p, '\n', end - p)) != NULL) {
+				result = kuhex_reverse_line(&w, p, eol);
+				p = eol + 1;
+			}
+			pending = end - p;
+			memmove(block, p, pending);
+			if (pending == KUHEX_READ_SIZE)
+				pending = 0; // no line is this long, drop it
+		}
+		if (result == 0 && pending > 0)
+			result = kuhex_reverse_line(&w, block, block + pending);
+		free(block);
 	}
 
-	// trim newline from the end
-	if (index > 0 && buf[index - 1] == '\n') {
-		index--;
-	}
+	if (result == 0)
+		result = kuhex_writer_flush(&w);
+	if (result == 0 && w.seekable) // pwrite leaves the offset, move it past the output
+		lseek(w.fd, w.origin + w.end, SEEK_SET);
+	free(w.buf);
+	kuhex_close(in);
+	return result;
+}
 
-	// null terminate string
-	buf[index++] = '\0';
 
-	strcpy(oldbuf, buf);
+/**
+ * kuhex -d: compare two files. Identical 64 KB blocks are skipped with one
+ * memcmp, so the time spent depends on how much differs rather than on the
+ * file sizes. Differing 16 byte rows are printed side by side and the
+ * differing bytes are highlighted when the output is a terminal, or marked
+ * with ^^ on a line below otherwise.
+ */
+#define KUHEX_DIFF_BLOCK (64 << 10) // a multiple of 16
+#define KUHEX_DIFF_LINE_MAX 512 // a row with every byte highlighted, or a row and its marks
 
-	parse_command(buf, command);
+struct kuhex_range {
+	unsigned long long start, end; // [start, end)
+};
 
-	// print_command(command); // DEBUG: uncomment for debugging
+struct kuhex_diff {
+	int fd;
+	bool color;
+	char *out;
+	size_t used;
+	struct kuhex_range *ranges;
+	size_t range_count, range_capacity;
+	unsigned long long differing;
+};
 
-	// restore the old settings
-	tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
-	return SUCCESS;
+/**
+ * Bitmask of the bytes that differ between two 16 byte rows.
+ */
+static inline unsigned kuhex_diff_mask(const unsigned char *a, const unsigned char *b) {
+#ifdef __SSE2__
+	__m128i equal = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)a),
+								   _mm_loadu_si128((const __m128i *)b));
+	return ~_mm_movemask_epi8(equal) & 0xffff;
+#else
+	unsigned mask = 0;
+	for (int i = 0; i < 16; ++i)
+		if (a[i] != b[i])
+			mask |= 1u << i;
+	return mask;
+#endif
 }
 
-int process_command(struct command_t *command);
-
-int main() {
-	while (1) {
-		struct command_t *command = malloc(sizeof(struct command_t));
-
-		// set all bytes to 0
-		memset(command, 0, sizeof(struct command_t));
+void kuhex_diff_side(struct kuhex_diff *d, const unsigned char *row, size_t n,
+					 unsigned mask) {
+	char *p = d->out + d->used;
 
-		int code;
-		code = prompt(command);
-		if (code == EXIT) {
-			break;
+	for (size_t i = 0; i < 16; ++i) {
+		if (i >= n) {
+			memcpy(p, "   ", 3);
+			p += 3;
+			continue;
 		}
-
-		code = process_command(command);
-		if (code == EXIT) {
+		bool highlight = d->color && (mask >> i & 1);
+		if (highlight) {
+			memcpy(p, "\033[1;31m", 7);
+			p += 7;
+		}
+		memcpy(p, kuhex_hex[row[i]], 2);
+		p += 2;
+		if (highlight) {
+			memcpy(p, "\033[0m", 4);
+			p += 4;
+		}
+		*p++ = ' ';
+	}
+	d->used = p - d->out;
+}
+
+/**
+ * Print one differing row and add its differing bytes to the ranges.
+ * @return 0 on success
+ */
+int kuhex_diff_row(struct kuhex_diff *d, unsigned long long offset,
+				   const unsigned char *a, const unsigned char *b, size_t n,
+				   unsigned mask) {
+	if (d->used + KUHEX_DIFF_LINE_MAX > KUHEX_OUT_SIZE) {
+		if (write_all(d->fd, d->out, d->used) != 0)
+			return -1;
+		d->used = 0;
+	}
+	d->used += snprintf(d->out + d->used, 32, "%08llx: ", offset);
+	kuhex_diff_side(d, a, n, mask);
+	memcpy(d->out + d->used, "| ", 2);
+	d->used += 2;
+	kuhex_diff_side(d, b, n, mask);
+	while (d->out[d->used - 1] == ' ')
+		d->used--;
+	d->out[d->used++] = '\n';
+
+	if (!d->color) {
+		// same columns as the row: 10 for the offset, 3 per byte, 2 for "| "
+		char *p = d->out + d->used;
+		memset(p, ' ', 10 + 2 * 16 * 3 + 2);
+		for (size_t i = 0; i < n; ++i) {
+			if (mask >> i & 1) {
+				memcpy(p + 10 + 3 * i, "^^", 2);
+				memcpy(p + 10 + 16 * 3 + 2 + 3 * i, "^^", 2);
+			}
+		}
+		p += 10 + 16 * 3 + 2 + 3 * (31 - __builtin_clz(mask)) + 2;
+		*p++ = '\n';
+		d->used = p - d->out;
+	}
+
+	for (size_t i = 0; i < n; ++i) {
+		if (!(mask >> i & 1))
+			continue;
+		d->differing++;
+		struct kuhex_range *last = d->range_count ? &d->ranges[d->range_count - 1] : NULL;
+		if (last != NULL && last->end == offset + i) {
+			last->end++;
+			continue;
+		}
+		if (d->range_count == d->range_capacity) {
+			d->range_capacity = d->range_capacity ? 2 * d->range_capacity : 64;
+			d->ranges = realloc(d->ranges, d->range_capacity * sizeof(*d->ranges));
+		}
+		d->ranges[d->range_count++] = (struct kuhex_range){ offset + i, offset + i + 1 };
+	}
+	return 0;
+}
+
+/**
+ * Map a whole file read only. Empty files map to NULL.
+ * @return 0 on success
+ */
+int kuhex_map(const char *filename, unsigned char **data, unsigned long long *size) {
+	struct stat st;
+	int in = open(filename, O_RDONLY);
+
+	if (in == -1) {
+		fprintf(stderr, "kuhex: %s: %s\n", filename, strerror(errno));
+		return -1;
+	}
+	if (fstat(in, &st) != 0 || !S_ISREG(st.st_mode)) {
+		fprintf(stderr, "kuhex: %s: not a regular file\n", filename);
+		close(in);
+		return -1;
+	}
+	*size = st.st_size;
+	*data = NULL;
+	if (*size > 0) {
+		*data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, in, 0);
+		if (*data == MAP_FAILED) {
+			fprintf(stderr, "kuhex: %s: %s\n", filename, strerror(errno));
+			close(in);
+			return -1;
+		}
+		madvise(*data, *size, MADV_SEQUENTIAL);
+	}
+	close(in);
+	return 0;
+}
+
+/**
+ * Print the rows that differ between two files followed by a summary of
+ * the differing byte ranges.
+ * @return 0 if the files are the same, 1 if they differ, -1 on errors
+ */
+int kuhex_diff(const char *first, const char *second, int out_fd) {
+	struct kuhex_diff d = { out_fd, isatty(stage_fd(out_fd)), NULL, 0, NULL, 0, 0, 0 };
+	unsigned char *a, *b;
+	unsigned long long size_a, size_b;
+	int result = 0;
+
+	if (kuhex_map(first, &a, &size_a) != 0)
+		return -1;
+	if (kuhex_map(second, &b, &size_b) != 0) {
+		if (a != NULL)
+			munmap(a, size_a);
+		return -1;
+	}
+	pthread_once(&kuhex_tables_once, kuhex_init_tables);
+	fflush(stdout);
+	d.out = malloc(KUHEX_OUT_SIZE);
+
+	unsigned long long common = size_a < size_b ? size_a : size_b;
+	for (unsigned long long block = 0; result == 0 && block < common;
+		 block += KUHEX_DIFF_BLOCK) {
+		size_t len = common - block < KUHEX_DIFF_BLOCK ? common - block : KUHEX_DIFF_BLOCK;
+		if (memcmp(a + block, b + block, len) == 0)
+			continue;
+
+		for (size_t i = 0; result == 0 && i < len; i += 16) {
+			size_t n = len - i < 16 ? len - i : 16;
+			unsigned mask = 0;
+			if (n == 16) {
+				mask = kuhex_diff_mask(a + block + i, b + block + i);
+			} else {
+				for (size_t j = 0; j < n; ++j)
+					if (a[block + i + j] != b[block + i + j])
+						mask |= 1u << j;
+			}
+			if (mask != 0)
+				result = kuhex_diff_row(&d, block + i, a + block + i, b + block + i, n, mask);
+		}
+	}
+
+	if (result == 0) {
+		char line[128];
+		for (size_t i = 0; result == 0 && i <= d.range_count; ++i) {
+			int len;
+			if (i < d.range_count)
+				len = snprintf(line, sizeof(line), "differ: 0x%llx-0x%llx (%llu byte%s)\n",
+							   d.ranges[i].start, d.ranges[i].end - 1,
+							   d.ranges[i].end - d.ranges[i].start,
+							   d.ranges[i].end - d.ranges[i].start == 1 ? "" : "s");
+			else
+				len = snprintf(line, sizeof(line), "%llu bytes differ in %zu range%s\n",
+							   d.differing, d.range_count, d.range_count == 1 ? "" : "s");
+			if (d.used + len > KUHEX_OUT_SIZE) {
+				result = write_all(out_fd, d.out, d.used);
+				d.used = 0;
+			}
+			memcpy(d.out + d.used, line, len);
+			d.used += len;
+		}
+		if (size_a != size_b) {
+			int len = snprintf(line, sizeof(line), "only in %s: 0x%llx-0x%llx (%llu bytes)\n",
+							   size_a > size_b ? first : second, common,
+							   (size_a > size_b ? size_a : size_b) - 1,
+							   (size_a > size_b ? size_a : size_b) - common);
+			if (len >= (int)sizeof(line))
+				len = sizeof(line) - 1;
+			if (d.used + len > KUHEX_OUT_SIZE) {
+				result = write_all(out_fd, d.out, d.used);
+				d.used = 0;
+			}
+			memcpy(d.out + d.used, line, len);
+			d.used += len;
+		}
+		if (result == 0)
+			result = write_all(out_fd, d.out, d.used);
+	}
+
+	free(d.ranges);
+	free(d.out);
+	if (a != NULL)
+		munmap(a, size_a);
+	if (b != NULL)
+		munmap(b, size_b);
+	if (result == 0 && (d.differing > 0 || size_a != size_b))
+		result = 1;
+	return result;
+}
+
+
+/**
+ * Show the command prompt
+ * @return [description]
+ */
+int show_prompt() {
+	char cwd[1024], hostname[1024];
+	gethostname(hostname, sizeof(hostname));
+	getcwd(cwd, sizeof(cwd));
+	printf("%s@%s:%s %s> ", getenv("USER"), hostname, cwd, sysname);
+	return 0;
+}
+
+/**
+ * Replace the word being completed at the end of buf with completion,
+ * followed by a space if the word is finished, and echo the added part.
+ */
+void complete_word(char *buf, size_t *index, const char *prefix,
+				   const char *completion, size_t completion_len, bool finished) {
+	size_t prefix_len = strlen(prefix);
+	size_t start = *index - prefix_len;
+
+	if (start + completion_len + 2 > BUF_SIZE)
+		return;
+
+	memcpy(buf + start, completion, completion_len);
+	*index = start + completion_len;
+	if (finished)
+		buf[(*index)++] = ' ';
+	buf[*index] = '\0';
+
+	printf("%s", buf + start + prefix_len); // print only the completed part
+}
+
+/**
+ * Length of the common prefix of two strings.
+ */
+size_t common_prefix(const char *a, const char *b, size_t limit) {
+	size_t i = 0;
+	while (i < limit && a[i] && a[i] == b[i])
+		i++;
+	return i;
+}
+
+/**
+ * Builtins run in the shell process with their redirections applied to
+ * saved and restored fds. Piped or in the background they run in a forked
+ * child like any other stage.
+ */
+struct builtin {
+	const char *name;
+	int (*run)(struct command_t *command); // NULL for the time prefix
+	bool threaded; // streams through read_input and write_all, can be a pipeline thread
+	bool (*handles)(struct command_t *command); // NULL for all forms, else false runs PATH's
+};
+
+extern const struct builtin builtins[];
+
+/**
+ * In-memory index of the executables in PATH, so Tab does not fork `ls`.
+ * Each PATH directory keeps the names it held at its last mtime; the merged
+ * sorted array is rebuilt only when PATH or a directory's mtime changes.
+ */
+struct path_dir {
+	char *path;
+	struct timespec mtime; // mtime of the directory when it was read
+	char **names;
+	int name_count;
+};
+
+struct command_index {
+	pthread_mutex_t lock;
+	char *path_env; // PATH the index was built for
+	struct path_dir *dirs;
+	int dir_count;
+	char **names; // sorted, unique names of all dirs and builtins
+	int name_count;
+};
+
+static struct command_index cmd_index = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+int compare_names(const void *a, const void *b) {
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * Read the executables of one PATH directory.
+ */
+void path_dir_scan(struct path_dir *dir) {
+	for (int i = 0; i < dir->name_count; ++i)
+		free(dir->names[i]);
+	free(dir->names);
+	dir->names = NULL;
+	dir->name_count = 0;
+
+	DIR *d = opendir(dir->path);
+	if (d == NULL)
+		return;
+
+	int capacity = 0;
+	struct dirent *entry;
+	while ((entry = readdir(d)) != NULL) {
+		if (entry->d_name[0] == '.')
+			continue;
+		if (entry->d_type != DT_REG && entry->d_type != DT_LNK &&
+			entry->d_type != DT_UNKNOWN)
+			continue;
+
+		struct stat st;
+		if (fstatat(dirfd(d), entry->d_name, &st, 0) != 0 ||
+			!S_ISREG(st.st_mode) || !(st.st_mode & 0111))
+			continue;
+
+		if (dir->name_count == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			dir->names = realloc(dir->names, sizeof(char *) * capacity);
+		}
+		dir->names[dir->name_count++] = strdup(entry->d_name);
+	}
+	closedir(d);
+}
+
+/**
+ * Bring the index up to date with PATH and the directory mtimes.
+ * Must be called with cmd_index.lock held.
+ */
+void command_index_refresh() {
+	const char *path = getenv("PATH");
+	bool changed = false;
+
+	if (path == NULL)
+		path = "";
+
+	// PATH itself changed, start over with the new directory list
+	if (cmd_index.path_env == NULL || strcmp(cmd_index.path_env, path) != 0) {
+		for (int i = 0; i < cmd_index.dir_count; ++i) {
+			for (int j = 0; j < cmd_index.dirs[i].name_count; ++j)
+				free(cmd_index.dirs[i].names[j]);
+			free(cmd_index.dirs[i].names);
+			free(cmd_index.dirs[i].path);
+		}
+		free(cmd_index.dirs);
+		free(cmd_index.path_env);
+		cmd_index.dirs = NULL;
+		cmd_index.dir_count = 0;
+		cmd_index.path_env = strdup(path);
+
+		char *path_copy = strdup(path);
+		char *saveptr;
+		for (char *dir = strtok_r(path_copy, ":", &saveptr); dir != NULL;
+			 dir = strtok_r(NULL, ":", &saveptr)) {
+			cmd_index.dirs = realloc(cmd_index.dirs, sizeof(struct path_dir) *
+														 (cmd_index.dir_count + 1));
+			struct path_dir *d = &cmd_index.dirs[cmd_index.dir_count++];
+			memset(d, 0, sizeof(*d));
+			d->path = strdup(dir);
+			d->mtime.tv_sec = -1; // never read
+		}
+		free(path_copy);
+		changed = true;
+	}
+
+	// rescan only the directories whose mtime moved
+	for (int i = 0; i < cmd_index.dir_count; ++i) {
+		struct path_dir *d = &cmd_index.dirs[i];
+		struct stat st;
+		struct timespec mtime = { 0, 0 };
+
+		if (stat(d->path, &st) == 0)
+			mtime = st.st_mtim;
+		if (mtime.tv_sec == d->mtime.tv_sec && mtime.tv_nsec == d->mtime.tv_nsec)
+			continue;
+
+		d->mtime = mtime;
+		path_dir_scan(d);
+		changed = true;
+	}
+
+	if (!changed)
+		return;
+
+	// merge all directories and the builtins into one sorted array
+	int total = 0;
+	for (int i = 0; builtins[i].name != NULL; ++i)
+		total++;
+	for (int i = 0; i < cmd_index.dir_count; ++i)
+		total += cmd_index.dirs[i].name_count;
+
+	free(cmd_index.names);
+	cmd_index.names = malloc(sizeof(char *) * (total + 1));
+	cmd_index.name_count = 0;
+	for (int i = 0; builtins[i].name != NULL; ++i)
+		cmd_index.names[cmd_index.name_count++] = (char *)builtins[i].name;
+	for (int i = 0; i < cmd_index.dir_count; ++i) {
+		memcpy(cmd_index.names + cmd_index.name_count, cmd_index.dirs[i].names,
+			   sizeof(char *) * cmd_index.dirs[i].name_count);
+		cmd_index.name_count += cmd_index.dirs[i].name_count;
+	}
+
+	qsort(cmd_index.names, cmd_index.name_count, sizeof(char *), compare_names);
+
+	int unique = 0;
+	for (int i = 0; i < cmd_index.name_count; ++i) {
+		if (unique == 0 || strcmp(cmd_index.names[unique - 1], cmd_index.names[i]) != 0)
+			cmd_index.names[unique++] = cmd_index.names[i];
+	}
+	cmd_index.name_count = unique;
+}
+
+void *command_index_thread(void *arg) {
+	(void)arg;
+	pthread_mutex_lock(&cmd_index.lock);
+	command_index_refresh();
+	pthread_mutex_unlock(&cmd_index.lock);
+	return NULL;
+}
+
+/**
+ * Build the command index in the background at startup.
+ */
+void command_index_start() {
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, command_index_thread, NULL) == 0)
+		pthread_detach(thread);
+}
+
+/**
+ * First position in a sorted name array not smaller than prefix.
+ */
+int lower_bound_names(char **names, int count, const char *prefix) {
+	int low = 0, high = count;
+	while (low < high) {
+		int mid = (low + high) / 2;
+		if (strcmp(names[mid], prefix) < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+#define MAX_LISTED_MATCHES 100
+
+/**
+ * Complete prefix from the names in [first, last) of a sorted array that all
+ * start with it. A unique match is completed, several matches are completed
+ * to their longest common prefix or listed if that adds nothing.
+ * Names ending in '/' are directories and are not finished with a space.
+ */
+void complete_matches(char **names, int first, int last, const char *prefix,
+					  char *buf, size_t *index) {
+	size_t prefix_len = strlen(prefix);
+	bool show_hidden = prefix[0] == '.';
+	int count = 0, first_visible = -1, last_visible = -1;
+
+	for (int i = first; i < last; ++i) {
+		if (!show_hidden && names[i][0] == '.')
+			continue;
+		if (first_visible < 0)
+			first_visible = i;
+		last_visible = i;
+		count++;
+	}
+
+	if (count == 1) {
+		const char *match = names[first_visible];
+		size_t match_len = strlen(match);
+		complete_word(buf, index, prefix, match, match_len,
+					  match[match_len - 1] != '/');
+	} else if (count > 1) {
+		// all matches share the prefix of the first and the last one
+		size_t lcp = common_prefix(names[first_visible], names[last_visible], SIZE_MAX);
+		if (lcp > prefix_len) {
+			complete_word(buf, index, prefix, names[first_visible], lcp, false);
+		} else {
+			int listed = 0;
+			for (int i = first_visible; i <= last_visible && listed < MAX_LISTED_MATCHES; ++i) {
+				if (!show_hidden && names[i][0] == '.')
+					continue;
+				printf("\n%s", names[i]);
+				listed++;
+			}
+			if (count > listed)
+				printf("\n... and %d more", count - listed);
+			printf("\n");
+			show_prompt();
+			printf("%s", buf); // Reprint the buffer for the user
+		}
+	}
+	fflush(stdout);
+}
+
+/**
+ * Range [*first, *last) of the names starting with prefix in a sorted array.
+ */
+void prefix_range(char **names, int count, const char *prefix, int *first, int *last) {
+	size_t prefix_len = strlen(prefix);
+
+	*first = lower_bound_names(names, count, prefix);
+	*last = *first;
+	while (*last < count && strncmp(names[*last], prefix, prefix_len) == 0)
+		(*last)++;
+}
+
+/**
+ * Helper function to list commands in PATH and built-in commands.
+ */
+void list_commands(const char *prefix, char *buf, size_t *index) {
+	int first, last;
+
+	pthread_mutex_lock(&cmd_index.lock);
+	command_index_refresh();
+	prefix_range(cmd_index.names, cmd_index.name_count, prefix, &first, &last);
+	complete_matches(cmd_index.names, first, last, prefix, buf, index);
+	pthread_mutex_unlock(&cmd_index.lock);
+}
+
+/**
+ * Cache of directory listings, keyed by device and inode and dropped when the
+ * directory's mtime changes. Names are sorted and directories carry a
+ * trailing '/', so big directories are read once and then prefix-searched.
+ */
+#define DIR_CACHE_SIZE 16
+
+struct dir_listing {
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	char **names;
+	int name_count;
+	char *storage; // all names, NUL separated
+	unsigned long last_used;
+};
+
+static struct dir_listing dir_cache[DIR_CACHE_SIZE];
+static unsigned long dir_cache_clock;
+
+void dir_listing_read(struct dir_listing *listing, const char *path) {
+	free(listing->names);
+	free(listing->storage);
+	listing->names = NULL;
+	listing->storage = NULL;
+	listing->name_count = 0;
+
+	DIR *d = opendir(path);
+	if (d == NULL)
+		return;
+
+	size_t used = 0, capacity = 0;
+	struct dirent *entry;
+	while ((entry = readdir(d)) != NULL) {
+		const char *name = entry->d_name;
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+			continue;
+
+		bool is_dir = entry->d_type == DT_DIR;
+		if (entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) {
+			struct stat st;
+			is_dir = fstatat(dirfd(d), name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+		}
+
+		size_t len = strlen(name);
+		if (used + len + 2 > capacity) {
+			capacity = capacity ? capacity * 2 : 4096;
+			if (capacity < used + len + 2)
+				capacity = used + len + 2;
+			listing->storage = realloc(listing->storage, capacity);
+		}
+		memcpy(listing->storage + used, name, len);
+		used += len;
+		if (is_dir)
+			listing->storage[used++] = '/';
+		listing->storage[used++] = '\0';
+		listing->name_count++;
+	}
+	closedir(d);
+
+	// point into storage only once it stopped moving
+	listing->names = malloc(sizeof(char *) * (listing->name_count + 1));
+	char *name = listing->storage;
+	for (int i = 0; i < listing->name_count; ++i) {
+		listing->names[i] = name;
+		name += strlen(name) + 1;
+	}
+	qsort(listing->names, listing->name_count, sizeof(char *), compare_names);
+}
+
+/**
+ * Cached sorted listing of a directory, NULL if it cannot be read.
+ * The listing stays valid until the next call.
+ */
+struct dir_listing *dir_cache_lookup(const char *path) {
+	struct stat st;
+	struct dir_listing *listing = NULL;
+
+	if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode))
+		return NULL;
+
+	for (int i = 0; i < DIR_CACHE_SIZE; ++i) {
+		if (dir_cache[i].last_used && dir_cache[i].dev == st.st_dev &&
+			dir_cache[i].ino == st.st_ino) {
+			listing = &dir_cache[i];
+			break;
+		}
+	}
+
+	if (listing == NULL) {
+		// evict the least recently used entry
+		listing = &dir_cache[0];
+		for (int i = 1; i < DIR_CACHE_SIZE; ++i) {
+			if (dir_cache[i].last_used < listing->last_used)
+				listing = &dir_cache[i];
+		}
+		listing->dev = st.st_dev;
+		listing->ino = st.st_ino;
+		listing->mtime.tv_sec = -1; // force a read
+	}
+
+	if (listing->mtime.tv_sec != st.st_mtim.tv_sec ||
+		listing->mtime.tv_nsec != st.st_mtim.tv_nsec) {
+		listing->mtime = st.st_mtim;
+		dir_listing_read(listing, path);
+	}
+
+	listing->last_used = ++dir_cache_clock;
+	return listing;
+}
+
+/**
+ * Helper function to list files, the directory part of the word selects
+ * the directory and the rest is matched as a prefix of its entries.
+ */
+void list_files(const char *word, char *buf, size_t *index) {
+	const char *slash = strrchr(word, '/');
+	const char *prefix = slash ? slash + 1 : word;
+	char dir[PATH_MAX];
+
+	if (slash == NULL) {
+		strcpy(dir, ".");
+	} else if (slash == word) {
+		strcpy(dir, "/");
+	} else {
+		if ((size_t)(slash - word) >= sizeof(dir))
+			return;
+		memcpy(dir, word, slash - word);
+		dir[slash - word] = '\0';
+	}
+
+	struct dir_listing *listing = dir_cache_lookup(dir);
+	if (listing == NULL)
+		return;
+
+	int first, last;
+	prefix_range(listing->names, listing->name_count, prefix, &first, &last);
+	complete_matches(listing->names, first, last, prefix, buf, index);
+}
+
+/**
+ * Handles auto-completion for commands and files.
+ */
+void auto_complete(char *buf, size_t *index) {
+    char *last_token = strrchr(buf, ' '); // Find the last token
+    const char *target = last_token ? last_token + 1 : buf;
+
+    // Check if the input matches any known commands or is fully typed
+    if (strchr(buf, ' ') == NULL) {
+        // If there's no space, assume it's a command and check for matches
+        list_commands(target, buf, index);
+    } else {
+        // If there's a space, assume the command is fully typed and list files
+        list_files(target, buf, index);
+    }
+}
+
+/**
+ * Prints a command struct
+ * @param struct command_t *
+ */
+void print_command(struct command_t *command) {
+	int i = 0;
+	printf("Command: <%s>\n", command->name);
+	printf("\tIs Background: %s\n", command->background ? "yes" : "no");
+	printf("\tNeeds Auto-complete: %s\n",
+		   command->auto_complete ? "yes" : "no");
+	printf("\tRedirects:\n");
+
+	for (i = 0; i < 3; i++) {
+		printf("\t\t%d: %s\n", i,
+			   command->redirects[i] ? command->redirects[i] : "N/A");
+	}
+
+	printf("\tArguments (%d):\n", command->arg_count);
+
+	for (i = 0; i < command->arg_count; ++i) {
+		printf("\t\tArg %d: %s\n", i, command->args[i]);
+	}
+
+	if (command->next) {
+		printf("\tPiped to:\n");
+		print_command(command->next);
+	}
+}
+
+/**
+ * Bump allocator for everything parsed from one command line. Nothing is
+ * freed on its own, arena_reset releases it all at once.
+ */
+#define ARENA_BLOCK_SIZE (64 << 10)
+
+struct arena_block {
+	struct arena_block *next; // older blocks
+	size_t used, capacity;
+	char data[];
+};
+
+struct arena {
+	struct arena_block *head;
+};
+
+void *arena_alloc(struct arena *arena, size_t size) {
+	struct arena_block *block = arena->head;
+
+	size = (size + 7) & ~(size_t)7;
+	if (block == NULL || block->capacity - block->used < size) {
+		size_t capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+		block = malloc(sizeof(struct arena_block) + capacity);
+		block->next = arena->head;
+		block->used = 0;
+		block->capacity = capacity;
+		arena->head = block;
+	}
+	void *p = block->data + block->used;
+	block->used += size;
+	return p;
+}
+
+/**
+ * Release everything, keeping the first block for the next line.
+ */
+void arena_reset(struct arena *arena) {
+	struct arena_block *block = arena->head;
+
+	if (block == NULL)
+		return;
+	while (block->next != NULL) {
+		struct arena_block *next = block->next;
+		free(block);
+		block = next;
+	}
+	block->used = 0;
+	arena->head = block;
+}
+
+/**
+ * Glob expansion of *, ?, [...] and ** in arguments. Every path component
+ * of a pattern is compiled once into steps of one character each, the
+ * directories come from dir_cache_lookup so only changed ones are read
+ * again, and the literal prefix of a component narrows the sorted listing
+ * before anything is matched. ** matches any number of directories without
+ * following symlinks. Matches are sorted, a pattern that matches nothing
+ * is kept as it is.
+ */
+enum glob_op { GLOB_CHAR, GLOB_ANY, GLOB_STAR, GLOB_CLASS };
+
+struct glob_step {
+	enum glob_op op;
+	unsigned char c;
+	uint64_t set[4]; // the bytes a GLOB_CLASS matches
+};
+
+struct glob_component {
+	const char *text;
+	struct glob_step *steps;
+	int step_count;
+	char *prefix; // literal characters before the first wildcard
+	bool literal; // no wildcards at all
+	bool recursive; // "**"
+};
+
+struct glob_state {
+	struct glob_component *components;
+	int count;
+	bool dirs_only; // the pattern ended with '/'
+	char path[PATH_MAX];
+	char **matches;
+	size_t match_count, capacity;
+	struct arena *arena;
+};
+
+static void glob_class_add(struct glob_step *step, unsigned char from, unsigned char to) {
+	for (unsigned c = from; c <= to; ++c)
+		step->set[c >> 6] |= 1ULL << (c & 63);
+}
+
+void glob_compile(struct arena *arena, const char *text, struct glob_component *component) {
+	size_t len = strlen(text);
+	struct glob_step *steps = arena_alloc(arena, (len + 1) * sizeof(struct glob_step));
+	int count = 0;
+
+	for (size_t i = 0; i < len; ++i) {
+		struct glob_step *step = &steps[count++];
+		memset(step, 0, sizeof(*step));
+		if (text[i] == '*') {
+			step->op = GLOB_STAR;
+			while (text[i + 1] == '*') // ** inside a name is just *
+				i++;
+		} else if (text[i] == '?') {
+			step->op = GLOB_ANY;
+		} else if (text[i] == '[') {
+			// [abc], [a-z], [!x] and [^x], a ] right after [ or [! is literal
+			size_t j = i + 1;
+			bool negate = text[j] == '!' || text[j] == '^';
+			if (negate)
+				j++;
+			size_t start = j;
+			while (j < len && (text[j] != ']' || j == start)) {
+				unsigned char from = text[j];
+				if (text[j + 1] == '-' && j + 2 < len && text[j + 2] != ']') {
+					glob_class_add(step, from, text[j + 2]);
+					j += 3;
+				} else {
+					glob_class_add(step, from, from);
+					j++;
+				}
+			}
+			if (j >= len) {
+				// no closing ], the [ is an ordinary character
+				memset(step, 0, sizeof(*step));
+				step->op = GLOB_CHAR;
+				step->c = '[';
+				continue;
+			}
+			if (negate)
+				for (int k = 0; k < 4; ++k)
+					step->set[k] = ~step->set[k];
+			step->op = GLOB_CLASS;
+			i = j;
+		} else {
+			step->op = GLOB_CHAR;
+			step->c = text[i];
+		}
+	}
+
+	// the prefix is the leading run of GLOB_CHAR steps
+	int literal_steps = 0;
+	while (literal_steps < count && steps[literal_steps].op == GLOB_CHAR)
+		literal_steps++;
+	component->prefix = arena_alloc(arena, literal_steps + 1);
+	for (int i = 0; i < literal_steps; ++i)
+		component->prefix[i] = steps[i].c;
+	component->prefix[literal_steps] = '\0';
+
+	component->text = text;
+	component->steps = steps;
+	component->step_count = count;
+	component->literal = literal_steps == count;
+	component->recursive = strcmp(text, "**") == 0;
+}
+
+static inline bool glob_step_matches(const struct glob_step *step, unsigned char c) {
+	switch (step->op) {
+	case GLOB_CHAR:
+		return step->c == c;
+	case GLOB_ANY:
+		return true;
+	case GLOB_CLASS:
+		return (step->set[c >> 6] >> (c & 63)) & 1;
+	default:
+		return false;
+	}
+}
+
+/**
+ * Match len bytes of name. Only the last * is ever backtracked to, which
+ * keeps this linear in practice.
+ */
+bool glob_match(const struct glob_component *component, const char *name, size_t len) {
+	const struct glob_step *steps = component->steps;
+	int count = component->step_count, p = 0, star = -1;
+	size_t n = 0, star_n = 0;
+
+	// a leading dot is only matched by a pattern that has one
+	if (len > 0 && name[0] == '.' && !(count > 0 && steps[0].op == GLOB_CHAR && steps[0].c == '.'))
+		return false;
+
+	while (n < len) {
+		if (p < count && steps[p].op == GLOB_STAR) {
+			star = p++;
+			star_n = n;
+		} else if (p < count && glob_step_matches(&steps[p], name[n])) {
+			p++;
+			n++;
+		} else if (star >= 0) {
+			p = star + 1;
+			n = ++star_n;
+		} else {
+			return false;
+		}
+	}
+	while (p < count && steps[p].op == GLOB_STAR)
+		p++;
+	return p == count;
+}
+
+static void glob_emit(struct glob_state *g, size_t len) {
+	if (g->match_count == g->capacity) {
+		g->capacity = g->capacity ? g->capacity * 2 : 64;
+		g->matches = realloc(g->matches, g->capacity * sizeof(char *));
+	}
+	char *match = arena_alloc(g->arena, len + 2);
+	memcpy(match, g->path, len);
+	if (g->dirs_only)
+		match[len++] = '/';
+	match[len] = '\0';
+	g->matches[g->match_count++] = match;
+}
+
+// append name to the path, NUL terminated, returns the new length or 0 if it does not fit
+static size_t glob_join(struct glob_state *g, size_t len, const char *name, size_t name_len) {
+	if (len > 0 && g->path[len - 1] != '/')
+		g->path[len++] = '/';
+	if (len + name_len + 1 >= sizeof(g->path))
+		return 0;
+	memcpy(g->path + len, name, name_len);
+	len += name_len;
+	g->path[len] = '\0';
+	return len;
+}
+
+void glob_walk(struct glob_state *g, size_t len, int index) {
+	const struct glob_component *component = &g->components[index];
+	bool last = index == g->count - 1;
+	struct stat st;
+
+	if (component->literal) {
+		size_t next = glob_join(g, len, component->text, strlen(component->text));
+		if (next == 0)
+			return;
+		if (!last)
+			glob_walk(g, next, index + 1);
+		else if (g->dirs_only ? stat(g->path, &st) == 0 && S_ISDIR(st.st_mode)
+							  : lstat(g->path, &st) == 0)
+			glob_emit(g, next);
+		return;
+	}
+
+	if (component->recursive && !last)
+		glob_walk(g, len, index + 1); // ** as no directory at all
+
+	g->path[len] = '\0';
+	struct dir_listing *listing = dir_cache_lookup(len > 0 ? g->path : ".");
+	if (listing == NULL)
+		return;
+
+	int first = 0, end = listing->name_count;
+	if (component->prefix[0] != '\0')
+		prefix_range(listing->names, listing->name_count, component->prefix, &first, &end);
+
+	// the listing only lasts until the next lookup, keep the names to descend into
+	char **descend = NULL;
+	size_t descend_count = 0;
+	for (int i = first; i < end; ++i) {
+		const char *name = listing->names[i];
+		size_t name_len = strlen(name);
+		bool is_dir = name[name_len - 1] == '/';
+		if (is_dir)
+			name_len--;
+
+		if (component->recursive ? name[0] == '.' : !glob_match(component, name, name_len))
+			continue;
+		if (last && (!g->dirs_only || is_dir)) {
+			size_t next = glob_join(g, len, name, name_len);
+			if (next != 0)
+				glob_emit(g, next);
+		}
+		if (is_dir && (!last || component->recursive)) {
+			if ((descend_count & (descend_count + 1)) == 0) // at 0, 1, 3, 7, ...
+				descend = realloc(descend, (descend_count * 2 + 1) * sizeof(char *));
+			descend[descend_count++] = strndup(name, name_len);
+		}
+	}
+
+	for (size_t i = 0; i < descend_count; ++i) {
+		size_t next = glob_join(g, len, descend[i], strlen(descend[i]));
+		if (next != 0) {
+			if (!component->recursive)
+				glob_walk(g, next, index + 1);
+			else if (lstat(g->path, &st) == 0 && S_ISDIR(st.st_mode))
+				glob_walk(g, next, index); // one level deeper, still inside **
+		}
+		free(descend[i]);
+	}
+	free(descend);
+}
+
+/**
+ * Expand a pattern into sorted matches allocated from arena.
+ * @return the number of matches, 0 if there are none or it has no wildcards
+ */
+size_t glob_expand(struct arena *arena, const char *pattern, char ***matches) {
+	size_t len = strlen(pattern);
+	char *copy = arena_alloc(arena, len + 1);
+	struct glob_state *g = malloc(sizeof(struct glob_state));
+	bool wildcards = false;
+
+	memcpy(copy, pattern, len + 1);
+	memset(g, 0, sizeof(*g));
+	g->arena = arena;
+	g->components = arena_alloc(arena, (len / 2 + 1) * sizeof(struct glob_component));
+	g->dirs_only = len > 1 && copy[len - 1] == '/';
+
+	for (char *p = copy, *slash; *p != '\0'; p = slash) {
+		slash = strchr(p, '/');
+		if (slash != NULL)
+			*slash++ = '\0';
+		else
+			slash = p + strlen(p);
+		if (*p == '\0')
+			continue; // repeated or trailing slashes
+		glob_compile(arena, p, &g->components[g->count]);
+		wildcards |= !g->components[g->count].literal;
+		g->count++;
+	}
+
+	size_t count = 0;
+	if (wildcards && g->count > 0) {
+		size_t start = 0;
+		if (pattern[0] == '/')
+			g->path[start++] = '/';
+		glob_walk(g, start, 0);
+		// one listing gives sorted matches already, only a walk over several needs this
+		size_t sorted = 1;
+		while (sorted < g->match_count && strcmp(g->matches[sorted - 1], g->matches[sorted]) <= 0)
+			sorted++;
+		if (sorted < g->match_count)
+			qsort(g->matches, g->match_count, sizeof(char *), compare_names);
+		*matches = arena_alloc(arena, g->match_count * sizeof(char *));
+		memcpy(*matches, g->matches, g->match_count * sizeof(char *));
+		count = g->match_count;
+	}
+	free(g->matches);
+	free(g);
+	return count;
+}
+
+/**
+ * A stage's arguments once a glob made them outgrow the token array.
+ */
+struct arg_list {
+	char **args;
+	size_t count, capacity;
+};
+
+void arg_list_push(struct arena *arena, struct arg_list *list, char *arg) {
+	if (list->count == list->capacity) {
+		list->capacity = list->capacity ? list->capacity * 2 : 64;
+		char **args = arena_alloc(arena, list->capacity * sizeof(char *));
+		memcpy(args, list->args, list->count * sizeof(char *));
+		list->args = args;
+	}
+	list->args[list->count++] = arg;
+}
+
+/**
+ * Parse a command line into a pipeline of commands. The line is split in
+ * place: names, arguments and redirects point into buf, which has to live
+ * as long as the commands, and every stage's args is a run of one token
+ * array ended by NULL written over its "|". Unquoted arguments with
+ * wildcards are replaced by their matches, a stage that gains arguments
+ * that way gets its own args array. The commands, the token array and
+ * the matches come from arena.
+ * @return the first command of the pipeline
+ */
+struct command_t *parse_command(struct arena *arena, char *buf) {
+	const char *splitters = " \t"; // split at whitespace
+	size_t len = strlen(buf), count = 0;
+	bool background = false, auto_complete = false;
+
+	// trim right whitespace
+	while (len > 0 && strchr(splitters, buf[len - 1]) != NULL)
+		buf[--len] = '\0';
+
+	// auto-complete
+	if (len > 0 && buf[len - 1] == '?')
+		auto_complete = true;
+
+	// background, "cmd&" as well as "cmd &"
+	if (len > 0 && buf[len - 1] == '&') {
+		background = true;
+		buf[--len] = '\0';
+	}
+
+	// tokens are at least one byte and a separator, plus the last NULL
+	char **tokens = arena_alloc(arena, (len / 2 + 2) * sizeof(char *));
+	for (char *p = buf + strspn(buf, splitters); *p != '\0'; p += strspn(p, splitters)) {
+		tokens[count++] = p;
+		p += strcspn(p, splitters);
+		if (*p != '\0')
+			*p++ = '\0';
+	}
+
+	struct command_t *head = arena_alloc(arena, sizeof(struct command_t));
+	struct command_t *command = head;
+	size_t first = 0, out = 0; // start of this stage's args, next arg slot
+	struct arg_list expanded = { NULL, 0, 0 };
+	bool in_list = false; // this stage's args moved to expanded
+
+	memset(head, 0, sizeof(struct command_t));
+	for (size_t i = 0;; ++i) {
+		if (i < count && strcmp(tokens[i], "|") != 0) {
+			char *token = tokens[i];
+			if (strcmp(token, "&") == 0)
+				continue;
+
+			// redirects, the file name may be the next token
+			int redirect = token[0] == '<' ? 0 : token[0] != '>' ? -1 : token[1] == '>' ? 2 : 1;
+			if (redirect != -1) {
+				char *file = token + (redirect == 2 ? 2 : 1);
+				if (*file == '\0' && i + 1 < count && strcmp(tokens[i + 1], "|") != 0)
+					file = tokens[++i];
+				if (*file != '\0')
+					command->redirects[redirect] = file;
+				continue;
+			}
+
+			// quote wrapped arg
+			size_t token_len = strlen(token);
+			bool quoted = false;
+			if (token_len > 2 && (token[0] == '"' || token[0] == '\'') &&
+				token[token_len - 1] == token[0]) {
+				token[token_len - 1] = '\0';
+				token++;
+				quoted = true;
+			}
+
+			char **matches = NULL;
+			size_t match_count = 0;
+			if (!quoted && strpbrk(token, "*?[") != NULL)
+				match_count = glob_expand(arena, token, &matches);
+			if (match_count > 0 && !in_list) {
+				// more args than tokens from here on
+				for (size_t j = first; j < out; ++j)
+					arg_list_push(arena, &expanded, tokens[j]);
+				in_list = true;
+			}
+			if (!in_list) {
+				tokens[out++] = token;
+			} else if (match_count > 0) {
+				for (size_t j = 0; j < match_count; ++j)
+					arg_list_push(arena, &expanded, matches[j]);
+			} else {
+				arg_list_push(arena, &expanded, token);
+			}
+			continue;
+		}
+
+		if (in_list) {
+			arg_list_push(arena, &expanded, NULL);
+			command->args = expanded.args;
+			command->arg_count = expanded.count; // args ends with NULL
+			expanded = (struct arg_list){ NULL, 0, 0 };
+			in_list = false;
+		} else {
+			// end of a stage, out <= i so the NULL goes at most over the "|"
+			tokens[out] = NULL;
+			command->args = tokens + first;
+			command->arg_count = out - first + 1; // args ends with NULL
+		}
+		command->name = command->args[0] != NULL ? command->args[0] : (char *)"";
+		command->background = background;
+		command->auto_complete = auto_complete;
+		if (i >= count)
+			break;
+
+		command->next = arena_alloc(arena, sizeof(struct command_t));
+		command = command->next;
+		memset(command, 0, sizeof(struct command_t));
+		first = out = i + 1;
+	}
+	return head;
+}
+
+/**
+ * Background jobs. SIGCHLD stays blocked in the shell and is read from a
+ * signalfd, which the prompt polls together with stdin, so finished jobs
+ * are reaped as they exit instead of piling up as zombies. Processes are
+ * found through a pid hash, so reaping costs the same with thousands of
+ * jobs. Children that are not part of a job (foreground commands) are
+ * kept in a small list until whoever waits for them asks.
+ */
+#define JOB_PID_BUCKETS 1024
+
+struct job {
+	int id;
+	char *text; // the command line, for jobs and notifications
+	int process_count;
+	int running; // processes not reaped yet
+	pid_t last_pid; // the pipeline's status is the one of its last stage
+	int status;
+	double start, end;
+};
+
+struct job_process {
+	pid_t pid;
+	struct job *job;
+	struct job_process *next;
+};
+
+struct reaped_child {
+	pid_t pid;
+	int status;
+	struct rusage usage;
+	double end;
+};
+
+static struct job **jobs; // ordered by id
+static int job_count, job_capacity;
+static struct job_process *job_pids[JOB_PID_BUCKETS];
+static struct reaped_child *reaped; // foreground children reaped with the jobs
+static int reaped_count, reaped_capacity;
+static int job_sigfd = -1;
+static sigset_t job_sigset; // SIGCHLD
+
+double now_seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Block SIGCHLD and open the signalfd it is delivered to.
+ */
+void jobs_init() {
+	sigemptyset(&job_sigset);
+	sigaddset(&job_sigset, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &job_sigset, NULL);
+	job_sigfd = signalfd(-1, &job_sigset, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (job_sigfd == -1)
+		perror("signalfd");
+}
+
+/**
+ * Rebuild the command line of a parsed command.
+ * @return malloc'd string
+ */
+char *command_text(struct command_t *command) {
+	static const char *redirect_ops[3] = { " < ", " > ", " >> " };
+	size_t len = 1;
+
+	for (struct command_t *c = command; c != NULL; c = c->next) {
+		for (int i = 0; c->args[i] != NULL; ++i)
+			len += strlen(c->args[i]) + 1;
+		for (int i = 0; i < 3; ++i)
+			if (c->redirects[i] != NULL)
+				len += strlen(c->redirects[i]) + 4;
+		len += 3 + 2; // " | " or " &"
+	}
+
+	char *text = malloc(len), *p = text;
+	for (struct command_t *c = command; c != NULL; c = c->next) {
+		for (int i = 0; c->args[i] != NULL; ++i)
+			p += sprintf(p, i > 0 ? " %s" : "%s", c->args[i]);
+		for (int i = 0; i < 3; ++i)
+			if (c->redirects[i] != NULL)
+				p += sprintf(p, "%s%s", redirect_ops[i], c->redirects[i]);
+		if (c->next != NULL)
+			p += sprintf(p, " | ");
+	}
+	*p = '\0';
+	return text;
+}
+
+/**
+ * Add a job for already started processes.
+ */
+struct job *job_add(const char *text, const pid_t *pids, int count) {
+	struct job *job = calloc(1, sizeof(struct job));
+
+	job->id = job_count > 0 ? jobs[job_count - 1]->id + 1 : 1;
+	job->text = strdup(text);
+	job->process_count = job->running = count;
+	job->last_pid = pids[count - 1];
+	job->start = now_seconds();
+
+	for (int i = 0; i < count; ++i) {
+		struct job_process *process = malloc(sizeof(struct job_process));
+		process->pid = pids[i];
+		process->job = job;
+		process->next = job_pids[pids[i] % JOB_PID_BUCKETS];
+		job_pids[pids[i] % JOB_PID_BUCKETS] = process;
+	}
+
+	if (job_count == job_capacity) {
+		job_capacity = job_capacity ? 2 * job_capacity : 16;
+		jobs = realloc(jobs, job_capacity * sizeof(struct job *));
+	}
+	jobs[job_count++] = job;
+	return job;
+}
+
+/**
+ * Record the exit of a child.
+ */
+void job_child_exited(pid_t pid, int status, const struct rusage *usage) {
+	struct job_process **link = &job_pids[pid % JOB_PID_BUCKETS];
+
+	while (*link != NULL && (*link)->pid != pid)
+		link = &(*link)->next;
+
+	if (*link == NULL) {
+		// a foreground child, keep its status for wait_child
+		if (reaped_count == reaped_capacity) {
+			reaped_capacity = reaped_capacity ? 2 * reaped_capacity : 16;
+			reaped = realloc(reaped, reaped_capacity * sizeof(struct reaped_child));
+		}
+		reaped[reaped_count++] = (struct reaped_child){ pid, status, *usage, now_seconds() };
+		return;
+	}
+
+	struct job_process *process = *link;
+	struct job *job = process->job;
+	*link = process->next;
+	free(process);
+
+	if (pid == job->last_pid)
+		job->status = status;
+	if (--job->running == 0)
+		job->end = now_seconds();
+}
+
+/**
+ * Reap every child that has exited, without blocking.
+ */
+void jobs_reap() {
+	struct signalfd_siginfo info[16];
+	struct rusage usage;
+	int status;
+	pid_t pid;
+
+	// drain the signalfd first so an exit after the wait4 loop wakes the next poll
+	while (read(job_sigfd, info, sizeof(info)) > 0)
+		;
+	while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0)
+		job_child_exited(pid, status, &usage);
+}
+
+/**
+ * Block until SIGCHLD arrives, then reap.
+ */
+void jobs_wait_event() {
+	struct pollfd fd = { job_sigfd, POLLIN, 0 };
+
+	if (job_sigfd == -1 || poll(&fd, 1, -1) > 0)
+		jobs_reap();
+}
+
+/**
+ * Check without blocking whether a child that is not part of a job has
+ * exited, reaping it. usage and end may be NULL.
+ * @return true with its wait status, resource usage and exit time once it has
+ */
+bool child_exited(pid_t pid, int *status, struct rusage *usage, double *end) {
+	struct rusage ignored;
+
+	for (int i = 0; i < reaped_count; ++i) {
+		if (reaped[i].pid == pid) {
+			*status = reaped[i].status;
+			if (usage != NULL)
+				*usage = reaped[i].usage;
+			if (end != NULL)
+				*end = reaped[i].end;
+			reaped[i] = reaped[--reaped_count];
+			return true;
+		}
+	}
+	pid_t r = wait4(pid, status, WNOHANG, usage != NULL ? usage : &ignored);
+	if (r == -1 && usage != NULL)
+		memset(usage, 0, sizeof(*usage));
+	if (end != NULL)
+		*end = now_seconds();
+	return r == pid || (r == -1 && errno != EINTR);
+}
+
+/**
+ * Wait for a child that is not part of a job.
+ * @return its wait status
+ */
+int wait_child(pid_t pid) {
+	int status = 0;
+
+	if (job_sigfd == -1) {
+		waitpid(pid, &status, 0);
+		return status;
+	}
+	while (!child_exited(pid, &status, NULL, NULL))
+		jobs_wait_event();
+	return status;
+}
+
+void job_wait(struct job *job) {
+	while (job->running > 0)
+		jobs_wait_event();
+}
+
+/**
+ * Resource accounting. Every foreground command is measured: children
+ * through wait4, commands run inside the shell through getrusage. A time
+ * prefix prints the numbers per pipeline stage, stats log writes them to
+ * a file for every command and stats summarizes the slowest commands and
+ * what the shell itself spends on parsing, forking and spawning.
+ */
+#define MAX_STAGES 256
+#define SLOWEST_KEPT 10
+
+struct stage_usage {
+	struct command_t *command;
+	double wall;
+	struct rusage usage;
+	int status;
+};
+
+struct command_record {
+	char *text;
+	double wall, user, sys;
+	long max_rss; // KB
+};
+
+struct shell_stats {
+	unsigned long commands;
+	double wall;
+	struct command_record slowest[SLOWEST_KEPT]; // slowest first
+	int slowest_count;
+	unsigned long parses, spawns, forks;
+	double parse_time, spawn_time, fork_time;
+	int log_fd;
+};
+
+static struct shell_stats stats = { .log_fd = -1 };
+
+static double timeval_seconds(struct timeval tv) {
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/**
+ * Wait for all stages of a foreground command, taking each one's end time
+ * from when it was reaped rather than from when we got to it. Thread
+ * stages have a pid of 0 and are left alone.
+ */
+void wait_stages(const pid_t *pids, struct stage_usage *stages, int count, double start) {
+	int remaining = count;
+	double end;
+
+	for (int i = 0; i < count; ++i) {
+		if (pids[i] > 0)
+			stages[i].wall = -1;
+		else
+			remaining--; // a thread stage, joined by the caller
+	}
+	while (remaining > 0) {
+		for (int i = 0; i < count; ++i) {
+			if (pids[i] > 0 && stages[i].wall < 0 &&
+				child_exited(pids[i], &stages[i].status, &stages[i].usage, &end)) {
+				stages[i].wall = end - start;
+				remaining--;
+			}
+		}
+		if (remaining > 0)
+			jobs_wait_event();
+	}
+}
+
+/**
+ * Stage's words joined by spaces, cut to fit buf.
+ */
+void stage_text(struct command_t *command, char *buf, size_t size) {
+	size_t used = 0;
+
+	buf[0] = '\0';
+	for (int i = 0; command->args[i] != NULL && used + 1 < size; ++i)
+		used += snprintf(buf + used, size - used, i > 0 ? " %s" : "%s", command->args[i]);
+}
+
+/**
+ * Account a finished foreground command, printing its stages if timed.
+ */
+void account_command(struct command_t *command, struct stage_usage *stages, int count,
+					 double wall, bool timed) {
+	double user = 0, sys = 0;
+	long max_rss = 0;
+	char text[256];
+
+	if (timed)
+		fprintf(stderr, "%10s %9s %9s %10s  %s\n", "real", "user", "sys", "max rss", "stage");
+	for (int i = 0; i < count; ++i) {
+		double stage_user = timeval_seconds(stages[i].usage.ru_utime);
+		double stage_sys = timeval_seconds(stages[i].usage.ru_stime);
+		user += stage_user;
+		sys += stage_sys;
+		if (stages[i].usage.ru_maxrss > max_rss)
+			max_rss = stages[i].usage.ru_maxrss;
+
+		stage_text(stages[i].command, text, sizeof(text));
+		if (timed)
+			fprintf(stderr, "%9.3fs %8.3fs %8.3fs %7.1f MB  %s\n", stages[i].wall, stage_user,
+					stage_sys, stages[i].usage.ru_maxrss / 1024.0, text);
+		if (stats.log_fd != -1) {
+			char line[512];
+			int len = snprintf(line, sizeof(line), "%ld\t%s\t%.6f\t%.6f\t%.6f\t%ld\t%d\n",
+							   (long)time(NULL), text, stages[i].wall, stage_user, stage_sys,
+							   stages[i].usage.ru_maxrss,
+							   WIFEXITED(stages[i].status) ? WEXITSTATUS(stages[i].status)
+														   : 128 + WTERMSIG(stages[i].status));
+			write_all(stats.log_fd, line, len < (int)sizeof(line) ? len : (int)sizeof(line) - 1);
+		}
+	}
+	if (timed && count > 1)
+		fprintf(stderr, "%9.3fs %8.3fs %8.3fs %7.1f MB  total\n", wall, user, sys,
+				max_rss / 1024.0);
+
+	stats.commands++;
+	stats.wall += wall;
+
+	// keep the slowest few, slowest first
+	int at = stats.slowest_count;
+	while (at > 0 && stats.slowest[at - 1].wall < wall)
+		at--;
+	if (at >= SLOWEST_KEPT)
+		return;
+	if (stats.slowest_count == SLOWEST_KEPT)
+		free(stats.slowest[--stats.slowest_count].text);
+	memmove(&stats.slowest[at + 1], &stats.slowest[at],
+			(stats.slowest_count - at) * sizeof(struct command_record));
+	stats.slowest[at] = (struct command_record){ command_text(command), wall, user, sys, max_rss };
+	stats.slowest_count++;
+}
+
+/**
+ * stats [reset | log <file> | log off]: the slowest commands and the
+ * shell's own overhead.
+ */
+int builtin_stats(struct command_t *command) {
+	int argc = command->arg_count - 1; // args ends with NULL
+
+	if (argc == 3 && strcmp(command->args[1], "log") == 0) {
+		if (stats.log_fd != -1)
+			close(stats.log_fd);
+		stats.log_fd = -1;
+		if (strcmp(command->args[2], "off") == 0)
+			return SUCCESS;
+		stats.log_fd = open(command->args[2], O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+		if (stats.log_fd == -1) {
+			printf("-%s: stats: %s: %s\n", sysname, command->args[2], strerror(errno));
+			return UNKNOWN;
+		}
+		return SUCCESS;
+	}
+	if (argc == 2 && strcmp(command->args[1], "reset") == 0) {
+		for (int i = 0; i < stats.slowest_count; ++i)
+			free(stats.slowest[i].text);
+		int log_fd = stats.log_fd;
+		memset(&stats, 0, sizeof(stats));
+		stats.log_fd = log_fd;
+		return SUCCESS;
+	}
+	if (argc != 1) {
+		printf("Usage: stats [reset | log <file> | log off]\n");
+		return UNKNOWN;
+	}
+
+	printf("%lu commands, %.3fs wall\n", stats.commands, stats.wall);
+	if (stats.slowest_count > 0)
+		printf("slowest:\n%10s %9s %9s %10s  %s\n", "real", "user", "sys", "max rss", "command");
+	for (int i = 0; i < stats.slowest_count; ++i) {
+		struct command_record *r = &stats.slowest[i];
+		printf("%9.3fs %8.3fs %8.3fs %7.1f MB  %s\n", r->wall, r->user, r->sys,
+			   r->max_rss / 1024.0, r->text);
+	}
+	printf("shell overhead:\n");
+	printf("  parse  %8lu calls %10.1f us avg\n", stats.parses,
+		   stats.parses ? stats.parse_time / stats.parses * 1e6 : 0);
+	printf("  fork   %8lu calls %10.1f us avg\n", stats.forks,
+		   stats.forks ? stats.fork_time / stats.forks * 1e6 : 0);
+	printf("  spawn  %8lu calls %10.1f us avg (fork + exec)\n", stats.spawns,
+		   stats.spawns ? stats.spawn_time / stats.spawns * 1e6 : 0);
+	return SUCCESS;
+}
+
+/**
+ * Describe a wait status the way jobs shows it.
+ */
+void describe_status(int status, char *buf, size_t len) {
+	if (WIFSIGNALED(status))
+		snprintf(buf, len, "%s", strsignal(WTERMSIG(status)));
+	else if (WEXITSTATUS(status) != 0)
+		snprintf(buf, len, "Exit %d", WEXITSTATUS(status));
+	else
+		snprintf(buf, len, "Done");
+}
+
+void job_print(struct job *job) {
+	char state[64] = "Running";
+	double end = job->running > 0 ? now_seconds() : job->end;
+
+	if (job->running == 0)
+		describe_status(job->status, state, sizeof(state));
+	printf("[%d]  %-12s %8.2fs  %s\n", job->id, state, end - job->start, job->text);
+}
+
+/**
+ * Remove finished jobs from the table, printing them if report is set.
+ */
+void jobs_collect(bool report) {
+	int kept = 0;
+
+	for (int i = 0; i < job_count; ++i) {
+		struct job *job = jobs[i];
+		if (job->running > 0) {
+			jobs[kept++] = job;
+			continue;
+		}
+		if (report)
+			job_print(job);
+		free(job->text);
+		free(job);
+	}
+	job_count = kept;
+}
+
+/**
+ * Find a job from a "%n" or "n" argument, the latest job without one.
+ */
+struct job *job_find(const char *arg) {
+	if (arg == NULL)
+		return job_count > 0 ? jobs[job_count - 1] : NULL;
+	if (*arg == '%')
+		arg++;
+
+	char *end;
+	long id = strtol(arg, &end, 10);
+	if (*arg == '\0' || *end != '\0')
+		return NULL;
+	for (int i = 0; i < job_count; ++i)
+		if (jobs[i]->id == id)
+			return jobs[i];
+	return NULL;
+}
+
+/**
+ * jobs: list background jobs, finished ones are reported once.
+ */
+int builtin_jobs(struct command_t *command) {
+	(void)command;
+	jobs_reap();
+	for (int i = 0; i < job_count; ++i)
+		if (jobs[i]->running > 0)
+			job_print(jobs[i]);
+	jobs_collect(true);
+	return SUCCESS;
+}
+
+/**
+ * wait [%n]: wait for one job, or for all of them.
+ */
+int builtin_wait(struct command_t *command) {
+	int argc = command->arg_count - 1; // args ends with NULL
+
+	if (argc > 1) {
+		struct job *job = job_find(command->args[1]);
+		if (job == NULL) {
+			printf("-%s: wait: %s: no such job\n", sysname, command->args[1]);
+			return UNKNOWN;
+		}
+		job_wait(job);
+	} else {
+		for (int i = 0; i < job_count; ++i)
+			job_wait(jobs[i]);
+	}
+	jobs_collect(true);
+	return SUCCESS;
+}
+
+/**
+ * fg [%n]: wait for a background job as if it had been started in the
+ * foreground. Jobs share the shell's process group, so there is no
+ * terminal handoff: the job does not get the terminal's keys or signals.
+ */
+int builtin_fg(struct command_t *command) {
+	struct job *job = job_find(command->arg_count > 2 ? command->args[1] : NULL);
+
+	if (job == NULL) {
+		printf("-%s: fg: %s: no such job\n", sysname,
+			   command->arg_count > 2 ? command->args[1] : "current");
+		return UNKNOWN;
+	}
+	printf("%s\n", job->text);
+	job_wait(job);
+	jobs_collect(false);
+	return SUCCESS;
+}
+
+/**
+ * kill [-SIGNAL] %n|pid ...: signal every process of a job, or a pid.
+ */
+int builtin_kill(struct command_t *command) {
+	static const struct {
+		const char *name;
+		int number;
+	} signal_names[] = { { "HUP", SIGHUP },	  { "INT", SIGINT },   { "QUIT", SIGQUIT },
+						 { "KILL", SIGKILL }, { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 },
+						 { "TERM", SIGTERM }, { "CONT", SIGCONT }, { "STOP", SIGSTOP } };
+	int argc = command->arg_count - 1; // args ends with NULL
+	int sig = SIGTERM, i = 1, result = SUCCESS;
+
+	if (argc > 1 && command->args[1][0] == '-') {
+		const char *name = command->args[1] + 1;
+		if (strncmp(name, "SIG", 3) == 0)
+			name += 3;
+		long number = -1;
+		if (isdigit((unsigned char)*name)) {
+			// range check the long, a narrowed huge number could wrap to a valid signal
+			char *end;
+			errno = 0;
+			number = strtol(name, &end, 10);
+			if (errno == ERANGE || *end != '\0' || number < 1 || number >= NSIG)
+				number = -1;
+		}
+		sig = (int)number;
+		for (size_t j = 0; sig == -1 && j < sizeof(signal_names) / sizeof(signal_names[0]); ++j)
+			if (strcmp(name, signal_names[j].name) == 0)
+				sig = signal_names[j].number;
+		i++;
+	}
+	if (sig < 0 || i >= argc) {
+		printf("Usage: kill [-SIGNAL] %%job|pid ...\n");
+		return UNKNOWN;
+	}
+
+	for (; i < argc; ++i) {
+		const char *arg = command->args[i];
+		if (*arg != '%') {
+			// only a plain positive pid, 0 or a negative number would signal a group
+			char *end;
+			errno = 0;
+			long pid = isdigit((unsigned char)*arg) ? strtol(arg, &end, 10) : 0;
+			if (pid <= 0 || *end != '\0' || errno == ERANGE || pid != (pid_t)pid) {
+				printf("-%s: kill: %s: arguments must be process or job IDs\n", sysname, arg);
+				result = UNKNOWN;
+			} else if (kill(pid, sig) == -1) {
+				printf("-%s: kill: %s: %s\n", sysname, arg, strerror(errno));
+				result = UNKNOWN;
+			}
+			continue;
+		}
+
+		struct job *job = job_find(arg);
+		if (job == NULL) {
+			printf("-%s: kill: %s: no such job\n", sysname, arg);
+			result = UNKNOWN;
+			continue;
+		}
+		for (int b = 0; b < JOB_PID_BUCKETS; ++b)
+			for (struct job_process *p = job_pids[b]; p != NULL; p = p->next)
+				if (p->job == job)
+					kill(p->pid, sig);
+	}
+	return result;
+}
+
+/**
+ * Keys are read from stdin in blocks, so a paste arrives in one read and
+ * the editor can redraw once after going through all of it.
+ */
+static unsigned char key_buf[4096];
+static size_t key_pos, key_len;
+
+/**
+ * Wait for the next key on stdin, reaping jobs that finish meanwhile.
+ * @return the key, -1 at the end of input or -2 after timeout ms
+ */
+int read_key_timeout(int timeout) {
+	struct pollfd fds[2] = { { STDIN_FILENO, POLLIN, 0 }, { job_sigfd, POLLIN, 0 } };
+
+	if (key_pos < key_len)
+		return key_buf[key_pos++];
+
+	fflush(stdout);
+	while (1) {
+		fds[0].revents = fds[1].revents = 0;
+		int r = poll(fds, job_sigfd != -1 ? 2 : 1, timeout);
+		if (r == 0)
+			return -2;
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (fds[1].revents & POLLIN)
+			jobs_reap();
+		if (fds[0].revents != 0) {
+			ssize_t got = read(STDIN_FILENO, key_buf, sizeof(key_buf));
+			if (got > 0) {
+				key_len = got;
+				key_pos = 1;
+				return key_buf[0];
+			}
+			if (got == -1 && errno == EINTR)
+				continue;
+			return -1;
+		}
+	}
+}
+
+int read_key() {
+	return read_key_timeout(-1);
+}
+
+/**
+ * Whether more keys have been read already, the editor redraws only when
+ * it has gone through them.
+ */
+bool key_pending() {
+	return key_pos < key_len;
+}
+
+/**
+ * Give back the key read last.
+ */
+void unread_key() {
+	if (key_pos > 0)
+		key_pos--;
+}
+
+
+/**
+ * Command history. The history file is append-only, one command per line,
+ * and is mapped at startup without being parsed: up and down find entry
+ * starts walking back from the end as far as they are needed. Ctrl-R
+ * searches a trigram index of the file built in the background, so a
+ * search only verifies the entries that contain all of the query's
+ * trigrams. Entries of this session are kept in memory and appended to
+ * the file under flock, so concurrent shells do not mix their lines.
+ */
+#define TRIGRAM_INITIAL_SLOTS (1 << 16)
+
+struct trigram_list {
+	uint32_t key; // three bytes, UINT32_MAX for an empty slot
+	uint32_t count, capacity;
+	uint32_t *starts; // offsets of the entries containing it, increasing
+};
+
+struct trigram_index {
+	struct trigram_list *slots;
+	size_t slot_count, used;
+};
+
+struct history {
+	int fd;
+	const char *map; // the file as it was at startup
+	size_t map_size;
+	uint32_t *starts; // entry starts found so far, newest first
+	size_t start_count, start_capacity;
+	size_t scanned; // entries from here on are in starts
+	char **session; // this shell's entries, oldest first
+	size_t session_count, session_capacity;
+	pthread_mutex_t lock;
+	struct trigram_index *search; // set by the indexing thread when done
+};
+
+static struct history history = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static inline uint32_t trigram_key(const char *p) {
+	return (unsigned char)p[0] << 16 | (unsigned char)p[1] << 8 | (unsigned char)p[2];
+}
+
+struct trigram_list *trigram_slot(struct trigram_index *index, uint32_t key) {
+	size_t mask = index->slot_count - 1;
+	size_t i = (key * 2654435761u) & mask;
+
+	while (index->slots[i].key != key && index->slots[i].key != UINT32_MAX)
+		i = (i + 1) & mask;
+	return &index->slots[i];
+}
+
+/**
+ * Add entry start to the list of key, growing the table at half load.
+ */
+void trigram_add(struct trigram_index *index, uint32_t key, uint32_t start) {
+	struct trigram_list *list = trigram_slot(index, key);
+
+	if (list->key == UINT32_MAX) {
+		if (2 * (index->used + 1) > index->slot_count) {
+			struct trigram_index grown = { calloc(2 * index->slot_count, sizeof(struct trigram_list)),
+										   2 * index->slot_count, index->used };
+			for (size_t i = 0; i < grown.slot_count; ++i)
+				grown.slots[i].key = UINT32_MAX;
+			for (size_t i = 0; i < index->slot_count; ++i)
+				if (index->slots[i].key != UINT32_MAX)
+					*trigram_slot(&grown, index->slots[i].key) = index->slots[i];
+			free(index->slots);
+			*index = grown;
+			list = trigram_slot(index, key);
+		}
+		list->key = key;
+		index->used++;
+	}
+	if (list->count > 0 && list->starts[list->count - 1] == start)
+		return; // the trigram appears twice in this entry
+	if (list->count == list->capacity) {
+		list->capacity = list->capacity ? 2 * list->capacity : 4;
+		list->starts = realloc(list->starts, list->capacity * sizeof(uint32_t));
+	}
+	list->starts[list->count++] = start;
+}
+
+void *history_index_thread(void *arg) {
+	(void)arg;
+	struct trigram_index *index = malloc(sizeof(struct trigram_index));
+	const char *map = history.map;
+	size_t size = history.map_size;
+
+	index->slot_count = TRIGRAM_INITIAL_SLOTS;
+	index->used = 0;
+	index->slots = calloc(index->slot_count, sizeof(struct trigram_list));
+	for (size_t i = 0; i < index->slot_count; ++i)
+		index->slots[i].key = UINT32_MAX;
+
+	for (size_t start = 0; start < size;) {
+		const char *eol = memchr(map + start, '\n', size - start);
+		size_t end = eol != NULL ? (size_t)(eol - map) : size;
+		for (size_t i = start; i + 3 <= end; ++i)
+			trigram_add(index, trigram_key(map + i), start);
+		start = end + 1;
+	}
+
+	pthread_mutex_lock(&history.lock);
+	history.search = index;
+	pthread_mutex_unlock(&history.lock);
+	return NULL;
+}
+
+/**
+ * Open and map the history file, $HISTFILE or ~/.dash_history, and start
+ * indexing it for Ctrl-R.
+ */
+void history_init() {
+	char path[PATH_MAX];
+	const char *file = getenv("HISTFILE");
+	struct stat st;
+
+	if (file == NULL) {
+		const char *home = getenv("HOME");
+		if (home == NULL)
+			return;
+		snprintf(path, sizeof(path), "%s/.dash_history", home);
+		file = path;
+	}
+	history.fd = open(file, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+	if (history.fd == -1 || fstat(history.fd, &st) != 0)
+		return;
+
+	if (st.st_size > 0 && (unsigned long long)st.st_size < UINT32_MAX) {
+		void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, history.fd, 0);
+		if (map != MAP_FAILED) {
+			history.map = map;
+			history.map_size = history.scanned = st.st_size;
+		}
+	}
+
+	if (history.map != NULL) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, history_index_thread, NULL) == 0)
+			pthread_detach(thread);
+	}
+}
+
+/**
+ * End of the file entry starting at start.
+ */
+static inline size_t history_entry_end(size_t start) {
+	const char *eol = memchr(history.map + start, '\n', history.map_size - start);
+	return eol != NULL ? (size_t)(eol - history.map) : history.map_size;
+}
+
+/**
+ * Start of the entry that ends at end (its newline or the end of file).
+ */
+static inline size_t history_entry_start(size_t end) {
+	const char *nl = end > 0 ? memrchr(history.map, '\n', end) : NULL;
+	return nl != NULL ? (size_t)(nl - history.map) + 1 : 0;
+}
+
+/**
+ * Entry i, counted back from the newest one (0).
+ * @return the entry, not null terminated, or NULL past the oldest
+ */
+const char *history_get(size_t i, size_t *len) {
+	if (i < history.session_count) {
+		const char *entry = history.session[history.session_count - 1 - i];
+		*len = strlen(entry);
+		return entry;
+	}
+	i -= history.session_count;
+
+	// extend the offset index back as far as needed, skipping blank lines
+	while (history.start_count <= i && history.scanned > 0) {
+		size_t end = history.scanned;
+		if (history.map[end - 1] == '\n')
+			end--;
+		size_t start = history_entry_start(end);
+		history.scanned = start;
+		if (start == end)
+			continue;
+		if (history.start_count == history.start_capacity) {
+			history.start_capacity = history.start_capacity ? 2 * history.start_capacity : 256;
+			history.starts = realloc(history.starts, history.start_capacity * sizeof(uint32_t));
+		}
+		history.starts[history.start_count++] = start;
+	}
+	if (i >= history.start_count)
+		return NULL;
+	*len = history_entry_end(history.starts[i]) - history.starts[i];
+	return history.map + history.starts[i];
+}
+
+/**
+ * Remember a command line and append it to the history file.
+ */
+void history_add(const char *line) {
+	size_t len = strlen(line);
+
+	if (len == 0 || (history.session_count > 0 &&
+					 strcmp(history.session[history.session_count - 1], line) == 0))
+		return;
+	if (history.session_count == history.session_capacity) {
+		history.session_capacity = history.session_capacity ? 2 * history.session_capacity : 64;
+		history.session = realloc(history.session, history.session_capacity * sizeof(char *));
+	}
+	history.session[history.session_count++] = strdup(line);
+
+	if (history.fd != -1) {
+		// one write per entry, the lock keeps long ones from interleaving
+		char *entry = malloc(len + 1);
+		memcpy(entry, line, len);
+		entry[len] = '\n';
+		flock(history.fd, LOCK_EX);
+		write_all(history.fd, entry, len + 1);
+		flock(history.fd, LOCK_UN);
+		free(entry);
+	}
+}
+
+/**
+ * Largest value below bound in a sorted list.
+ * @return its position, or -1 if there is none
+ */
+static long below(const uint32_t *starts, uint32_t count, uint64_t bound) {
+	long lo = 0, hi = count; // first position >= bound
+	while (lo < hi) {
+		long mid = (lo + hi) / 2;
+		if (starts[mid] < bound)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo - 1;
+}
+
+/**
+ * Find the newest entry before bound that contains query. Session entry k
+ * has the key map_size + 1 + k, file entries their start offset, so keys
+ * grow with age going down.
+ * @return the key of the match, or -1
+ */
+long long history_search(const char *query, long long bound) {
+	size_t qlen = strlen(query);
+
+	for (long long k = (long long)history.session_count - 1; k >= 0; --k) {
+		long long key = (long long)history.map_size + 1 + k;
+		if (key < bound && strstr(history.session[k], query) != NULL)
+			return key;
+	}
+	if (bound > (long long)history.map_size)
+		bound = history.map_size;
+
+	pthread_mutex_lock(&history.lock);
+	struct trigram_index *index = history.search;
+	pthread_mutex_unlock(&history.lock);
+
+	if (index != NULL && qlen >= 3) {
+		// walk candidates down until every trigram list has the same entry
+		uint64_t limit = bound;
+		while (1) {
+			uint32_t candidate = 0;
+			bool agreed = true;
+			for (size_t t = 0; t + 3 <= qlen; ++t) {
+				struct trigram_list *list = trigram_slot(index, trigram_key(query + t));
+				long pos = list->key == UINT32_MAX ? -1 : below(list->starts, list->count, limit);
+				if (pos < 0)
+					return -1;
+				if (t == 0) {
+					candidate = list->starts[pos];
+				} else if (list->starts[pos] < candidate) {
+					limit = (uint64_t)list->starts[pos] + 1;
+					agreed = false;
+					break;
+				}
+				limit = (uint64_t)candidate + 1;
+			}
+			if (!agreed)
+				continue;
+			size_t end = history_entry_end(candidate);
+			if (memmem(history.map + candidate, end - candidate, query, qlen) != NULL)
+				return candidate;
+			limit = candidate; // all trigrams, but not in a row
+		}
+	}
+
+	// short queries, or the index is not ready yet: scan back for the
+	// first byte of the query, matches must end with the newest entry
+	// starting before bound
+	size_t limit = bound;
+	if (limit > 0 && limit < history.map_size)
+		limit = history.map[limit - 1] == '\n' ? limit - 1 : history_entry_end(limit - 1);
+	if (qlen == 0 || qlen > limit)
+		return -1;
+	for (const char *end = history.map + limit - qlen + 1, *hit;
+		 (hit = memrchr(history.map, query[0], end - history.map)) != NULL; end = hit) {
+		if (memcmp(hit, query, qlen) == 0)
+			return history_entry_start(hit - history.map);
+	}
+	return -1;
+}
+
+/**
+ * Text of the entry with the given search key.
+ */
+const char *history_key_text(long long key, size_t *len) {
+	if (key > (long long)history.map_size) {
+		const char *entry = history.session[key - history.map_size - 1];
+		*len = strlen(entry);
+		return entry;
+	}
+	*len = history_entry_end(key) - key;
+	return history.map + key;
+}
+
+/**
+ * Line editor. The line is edited in memory and the screen is brought up
+ * to date with one write that goes back to the first row of the prompt,
+ * prints it and the line, clears the rest and puts the cursor in place.
+ */
+#define EDITOR_OUT_SIZE (3 * BUF_SIZE)
+
+struct line_editor {
+	char buf[BUF_SIZE];
+	size_t len, cursor;
+	char prompt[PATH_MAX + 512];
+	size_t prompt_len;
+	int columns; // terminal width
+	int cursor_row; // rows the terminal cursor is below the first prompt row
+};
+
+/**
+ * Number of terminal columns of text, counting UTF-8 sequences once.
+ */
+static size_t text_columns(const char *text, size_t len) {
+	size_t columns = 0;
+	for (size_t i = 0; i < len; ++i)
+		columns += ((unsigned char)text[i] & 0xc0) != 0x80;
+	return columns;
+}
+
+void editor_render(struct line_editor *ed, const char *prompt, size_t prompt_len,
+				   const char *text, size_t len, size_t cursor) {
+	char out[EDITOR_OUT_SIZE];
+	size_t used = 0;
+	size_t prompt_columns = text_columns(prompt, prompt_len);
+	size_t end = prompt_columns + text_columns(text, len);
+	size_t at = prompt_columns + text_columns(text, cursor);
+	int end_row = end / ed->columns, row = at / ed->columns;
+
+	if (prompt_len + len > EDITOR_OUT_SIZE - 64)
+		len = EDITOR_OUT_SIZE - 64 - prompt_len;
+
+	if (ed->cursor_row > 0)
+		used += sprintf(out + used, "\033[%dA", ed->cursor_row);
+	out[used++] = '\r';
+	memcpy(out + used, prompt, prompt_len);
+	used += prompt_len;
+	memcpy(out + used, text, len);
+	used += len;
+
+	// at the exact end of a row the terminal waits before wrapping, and
+	// clearing from there would take the last character with it
+	if (end > 0 && end % ed->columns == 0)
+		used += sprintf(out + used, "\r\n");
+	used += sprintf(out + used, "\033[J");
+	if (end_row > row)
+		used += sprintf(out + used, "\033[%dA", end_row - row);
+	out[used++] = '\r';
+	if (at % ed->columns > 0)
+		used += sprintf(out + used, "\033[%zuC", at % ed->columns);
+
+	fflush(stdout);
+	write_all(STDOUT_FILENO, out, used);
+	ed->cursor_row = row;
+}
+
+void editor_refresh(struct line_editor *ed) {
+	editor_render(ed, ed->prompt, ed->prompt_len, ed->buf, ed->len, ed->cursor);
+}
+
+/**
+ * Replace the line, with the cursor at its end.
+ */
+void editor_set(struct line_editor *ed, const char *text, size_t len) {
+	if (len > BUF_SIZE - 2)
+		len = BUF_SIZE - 2;
+	memmove(ed->buf, text, len);
+	ed->len = ed->cursor = len;
+}
+
+void editor_insert(struct line_editor *ed, char c) {
+	if (ed->len >= BUF_SIZE - 2)
+		return;
+	memmove(ed->buf + ed->cursor + 1, ed->buf + ed->cursor, ed->len - ed->cursor);
+	ed->buf[ed->cursor++] = c;
+	ed->len++;
+}
+
+/**
+ * Delete the bytes between from and to.
+ */
+void editor_delete(struct line_editor *ed, size_t from, size_t to) {
+	memmove(ed->buf + from, ed->buf + to, ed->len - to);
+	ed->len -= to - from;
+	ed->cursor = from;
+}
+
+/**
+ * Position of the character before or after pos, stepping over UTF-8
+ * continuation bytes.
+ */
+static size_t char_left(const struct line_editor *ed, size_t pos) {
+	while (pos > 0 && ((unsigned char)ed->buf[--pos] & 0xc0) == 0x80)
+		;
+	return pos;
+}
+
+static size_t char_right(const struct line_editor *ed, size_t pos) {
+	while (pos < ed->len && ((unsigned char)ed->buf[++pos] & 0xc0) == 0x80)
+		;
+	return pos < ed->len ? pos : ed->len;
+}
+
+static size_t word_left(const struct line_editor *ed, size_t pos) {
+	while (pos > 0 && ed->buf[pos - 1] == ' ')
+		pos--;
+	while (pos > 0 && ed->buf[pos - 1] != ' ')
+		pos--;
+	return pos;
+}
+
+static size_t word_right(const struct line_editor *ed, size_t pos) {
+	while (pos < ed->len && ed->buf[pos] == ' ')
+		pos++;
+	while (pos < ed->len && ed->buf[pos] != ' ')
+		pos++;
+	return pos;
+}
+
+enum editor_key {
+	KEY_NONE = 256,
+	KEY_UP,
+	KEY_DOWN,
+	KEY_LEFT,
+	KEY_RIGHT,
+	KEY_HOME,
+	KEY_END,
+	KEY_DELETE,
+	KEY_WORD_LEFT,
+	KEY_WORD_RIGHT,
+};
+
+/**
+ * Decode what follows an ESC: CSI (ESC [ params final) and SS3 (ESC O
+ * final) sequences and the Alt-b/f word motions. An ESC with nothing
+ * after it within 50 ms is a lone Escape.
+ */
+int read_escape() {
+	int c = key_pending() ? read_key() : read_key_timeout(50);
+	int param = 0;
+
+	if (c == 'b')
+		return KEY_WORD_LEFT;
+	if (c == 'f')
+		return KEY_WORD_RIGHT;
+	if (c != '[' && c != 'O')
+		return KEY_NONE;
+
+	bool csi = c == '[';
+	while ((c = read_key()) >= '0' && c <= '?') {
+		if (c >= '0' && c <= '9')
+			param = param * 10 + c - '0';
+		else if (c == ';')
+			param = 0; // modifiers, only the key matters
+	}
+
+	switch (c) {
+	case 'A':
+		return KEY_UP;
+	case 'B':
+		return KEY_DOWN;
+	case 'C':
+		return KEY_RIGHT;
+	case 'D':
+		return KEY_LEFT;
+	case 'H':
+		return KEY_HOME;
+	case 'F':
+		return KEY_END;
+	case '~':
+		if (!csi)
+			return KEY_NONE;
+		if (param == 1 || param == 7)
+			return KEY_HOME;
+		if (param == 4 || param == 8)
+			return KEY_END;
+		if (param == 3)
+			return KEY_DELETE;
+		return KEY_NONE;
+	default:
+		return KEY_NONE;
+	}
+}
+
+/**
+ * Ctrl-R incremental reverse search. Typing narrows the search, Ctrl-R
+ * again goes to the next older match, Ctrl-G gives up and any other key
+ * puts the match on the line and is handled by the editor.
+ * @return true if enter was pressed and the line should run now
+ */
+bool history_isearch(struct line_editor *ed) {
+	char query[256] = "", prefix[320];
+	size_t qlen = 0, len = 0;
+	long long match = -1;
+	const char *text = "";
+	int c;
+
+	while (1) {
+		if (!key_pending()) {
+			int prefix_len = snprintf(prefix, sizeof(prefix), "(%sreverse-i-search)`%s': ",
+									  match < 0 && qlen > 0 ? "failed " : "", query);
+			editor_render(ed, prefix, prefix_len, text, len, len);
+		}
+		c = read_key();
+
+		if (c == 18) { // Ctrl-R: older match
+			long long older = qlen > 0 ? history_search(query, match >= 0 ? match : LLONG_MAX) : -1;
+			if (older >= 0)
+				match = older;
+		} else if (c == 127 || c == 8) {
+			if (qlen > 0)
+				query[--qlen] = '\0';
+			match = qlen > 0 ? history_search(query, LLONG_MAX) : -1;
+		} else if (c >= 32 && c != 127) {
+			if (qlen < sizeof(query) - 1) {
+				query[qlen++] = c;
+				query[qlen] = '\0';
+			}
+			// the current match stays if it still matches
+			match = history_search(query, match >= 0 ? match + 1 : LLONG_MAX);
+		} else {
+			break;
+		}
+		text = match >= 0 ? history_key_text(match, &len) : "";
+		if (match < 0)
+			len = 0;
+	}
+
+	if (c == 7) // Ctrl-G: keep the line as it was
+		return false;
+	if (match >= 0)
+		editor_set(ed, text, len);
+	if (c != '\n' && c != '\r' && c >= 0)
+		unread_key();
+	return c == '\n' || c == '\r';
+}
+
+/**
+ * Prompt a command from the user
+ * @param  arena    holds the parsed command until it is reset
+ * @param  command  set to the command read with the line editor
+ * @return          EXIT at the end of input, SUCCESS otherwise
+ */
+int prompt(struct arena *arena, struct command_t **command) {
+	struct line_editor ed;
+	char saved[BUF_SIZE]; // the line being typed while walking the history
+	size_t saved_len = 0;
+	size_t history_pos = 0; // entries walked back, 0 for the line being typed
+	bool accepted = false; // enter pressed in the history search
+	struct winsize ws;
+	char cwd[PATH_MAX], hostname[256];
+	int c;
+
+	// tcgetattr gets the parameters of the current terminal
+	// STDIN_FILENO will tell tcgetattr that it should write the settings
+	// of stdin to oldt
+	static struct termios backup_termios, new_termios;
+	tcgetattr(STDIN_FILENO, &backup_termios);
+	new_termios = backup_termios;
+	// ICANON normally takes care that one line at a time will be processed
+	// that means it will return if it sees a "\n" or an EOF or an EOL
+	new_termios.c_lflag &=
+		~(ICANON |
+		  ECHO); // Also disable automatic echo. We manually echo each char.
+	// Those new settings will be set to STDIN
+	// TCSANOW tells tcsetattr to change attributes immediately.
+	tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
+
+	// report background jobs that finished since the last prompt
+	jobs_reap();
+	jobs_collect(true);
+
+	gethostname(hostname, sizeof(hostname));
+	if (getcwd(cwd, sizeof(cwd)) == NULL)
+		cwd[0] = '\0';
+	ed.prompt_len = snprintf(ed.prompt, sizeof(ed.prompt), "%s@%s:%s %s> ",
+							 getenv("USER"), hostname, cwd, sysname);
+	if (ed.prompt_len >= sizeof(ed.prompt))
+		ed.prompt_len = sizeof(ed.prompt) - 1;
+	ed.columns = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+	ed.len = ed.cursor = 0;
+	ed.cursor_row = 0;
+	editor_refresh(&ed);
+
+	while (1) {
+		c = read_key();
+		// printf("Keycode: %u\n", c); // DEBUG: uncomment for debugging
+
+		if (c == -1 || (c == 4 && ed.len == 0)) { // end of input or Ctrl+D
+			tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+			return EXIT;
+		}
+		if (c == '\n' || c == '\r') // enter key
+			break;
+		if (c == 27)
+			c = read_escape();
+
+		const char *entry;
+		size_t len;
+		switch (c) {
+		case 9: // tab, complete the word before the end of the line
+			if (ed.cursor != ed.len) {
+				ed.cursor = ed.len;
+				editor_refresh(&ed);
+			}
+			ed.buf[ed.len] = '\0';
+			auto_complete(ed.buf, &ed.len);
+			ed.cursor = ed.len;
+			fflush(stdout);
+			ed.cursor_row = (text_columns(ed.prompt, ed.prompt_len) +
+							 text_columns(ed.buf, ed.len)) /
+							ed.columns;
+			break;
+		case 18: // Ctrl+R
+			accepted = history_isearch(&ed);
+			break;
+		case 127:
+		case 8: // backspace
+			if (ed.cursor > 0)
+				editor_delete(&ed, char_left(&ed, ed.cursor), ed.cursor);
+			break;
+		case 4: // Ctrl+D on a line that is not empty
+		case KEY_DELETE:
+			if (ed.cursor < ed.len)
+				editor_delete(&ed, ed.cursor, char_right(&ed, ed.cursor));
+			break;
+		case 2: // Ctrl+B
+		case KEY_LEFT:
+			ed.cursor = char_left(&ed, ed.cursor);
+			break;
+		case 6: // Ctrl+F
+		case KEY_RIGHT:
+			ed.cursor = char_right(&ed, ed.cursor);
+			break;
+		case 1: // Ctrl+A
+		case KEY_HOME:
+			ed.cursor = 0;
+			break;
+		case 5: // Ctrl+E
+		case KEY_END:
+			ed.cursor = ed.len;
+			break;
+		case KEY_WORD_LEFT:
+			ed.cursor = word_left(&ed, ed.cursor);
+			break;
+		case KEY_WORD_RIGHT:
+			ed.cursor = word_right(&ed, ed.cursor);
+			break;
+		case 21: // Ctrl+U
+			editor_delete(&ed, 0, ed.cursor);
+			break;
+		case 11: // Ctrl+K
+			ed.len = ed.cursor;
+			break;
+		case 23: // Ctrl+W
+			editor_delete(&ed, word_left(&ed, ed.cursor), ed.cursor);
+			break;
+		case 12: // Ctrl+L
+			write_all(STDOUT_FILENO, "\033[H\033[2J", 7);
+			ed.cursor_row = 0;
+			break;
+		case 16: // Ctrl+P
+		case KEY_UP:
+			if ((entry = history_get(history_pos, &len)) != NULL) {
+				if (history_pos++ == 0) {
+					memcpy(saved, ed.buf, ed.len);
+					saved_len = ed.len;
+				}
+				editor_set(&ed, entry, len);
+			}
+			break;
+		case 14: // Ctrl+N
+		case KEY_DOWN:
+			if (history_pos > 0) {
+				if (--history_pos == 0)
+					editor_set(&ed, saved, saved_len);
+				else if ((entry = history_get(history_pos - 1, &len)) != NULL)
+					editor_set(&ed, entry, len);
+			}
+			break;
+		default:
+			if (c >= 32 && c < 256 && c != 127)
+				editor_insert(&ed, c);
+			break;
+		}
+
+		if (accepted)
+			break;
+		// a paste is drawn once, after all of it has been handled
+		if (!key_pending())
+			editor_refresh(&ed);
+	}
+
+	ed.cursor = ed.len;
+	editor_refresh(&ed);
+	write_all(STDOUT_FILENO, "\n", 1);
+	ed.buf[ed.len] = '\0';
+
+	history_add(ed.buf);
+
+	// the commands point into the line, so it lives in the arena with them
+	char *line = arena_alloc(arena, ed.len + 1);
+	memcpy(line, ed.buf, ed.len + 1);
+	double start = now_seconds();
+	*command = parse_command(arena, line);
+	stats.parse_time += now_seconds() - start;
+	stats.parses++;
+
+	// print_command(*command); // DEBUG: uncomment for debugging
+
+	// restore the old settings
+	tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
+	return SUCCESS;
+}
+
+/**
+ * Remembered locations of external commands, like the `hash` builtin of
+ * other shells. The table is emptied when PATH changes and an entry is
+ * dropped when its file is no longer executable.
+ */
+#define HASH_BUCKETS 256
+
+struct hash_entry {
+	char *name;
+	char *path;
+	int hits;
+	struct hash_entry *next;
+};
+
+static struct hash_entry *cmd_hash[HASH_BUCKETS];
+static char *cmd_hash_path; // PATH the table was filled for
+
+unsigned int hash_string(const char *str) {
+	unsigned int h = 2166136261u; // FNV-1a
+	while (*str)
+		h = (h ^ (unsigned char)*str++) * 16777619u;
+	return h;
+}
+
+void hash_clear() {
+	for (int i = 0; i < HASH_BUCKETS; ++i) {
+		while (cmd_hash[i] != NULL) {
+			struct hash_entry *entry = cmd_hash[i];
+			cmd_hash[i] = entry->next;
+			free(entry->name);
+			free(entry->path);
+			free(entry);
+		}
+	}
+}
+
+/**
+ * Search PATH for an executable, without modifying the environment.
+ * @return malloc'ed full path or NULL
+ */
+char *search_path(const char *name) {
+	const char *path = getenv("PATH");
+	char full_path[PATH_MAX];
+
+	if (path == NULL)
+		return NULL;
+
+	for (;;) {
+		size_t len = strcspn(path, ":");
+		struct stat st;
+		// an empty entry, leading, trailing or ::, is the current directory
+		if (snprintf(full_path, sizeof(full_path), "%.*s/%s", len > 0 ? (int)len : 1,
+					 len > 0 ? path : ".", name) < (int)sizeof(full_path) &&
+			access(full_path, X_OK) == 0 && stat(full_path, &st) == 0 && S_ISREG(st.st_mode))
+			return strdup(full_path);
+		if (path[len] == '\0')
+			return NULL;
+		path += len + 1;
+	}
+}
+
+/**
+ * Full path to execute for a command name, NULL if it cannot be found.
+ * Names with a '/' are used as they are, others go through the hash table.
+ */
+const char *resolve_command(const char *name) {
+	const char *path = getenv("PATH");
+
+	if (strchr(name, '/') != NULL)
+		return name;
+
+	if (path == NULL)
+		path = "";
+	if (cmd_hash_path == NULL || strcmp(cmd_hash_path, path) != 0) {
+		hash_clear();
+		free(cmd_hash_path);
+		cmd_hash_path = strdup(path);
+	}
+
+	struct hash_entry **link = &cmd_hash[hash_string(name) % HASH_BUCKETS];
+	for (; *link != NULL; link = &(*link)->next) {
+		struct hash_entry *entry = *link;
+		if (strcmp(entry->name, name) != 0)
+			continue;
+
+		if (access(entry->path, X_OK) == 0) {
+			entry->hits++;
+			return entry->path;
+		}
+
+		// stale entry, forget it and search again
+		*link = entry->next;
+		free(entry->name);
+		free(entry->path);
+		free(entry);
+		break;
+	}
+
+	char *full_path = search_path(name);
+	if (full_path == NULL)
+		return NULL;
+
+	struct hash_entry *entry = malloc(sizeof(struct hash_entry));
+	unsigned int bucket = hash_string(name) % HASH_BUCKETS;
+	entry->name = strdup(name);
+	entry->path = full_path;
+	entry->hits = 1;
+	entry->next = cmd_hash[bucket];
+	cmd_hash[bucket] = entry;
+	return entry->path;
+}
+
+/**
+ * hash: list remembered commands, hash -r: forget them all,
+ * hash name...: look the names up and remember them.
+ */
+int builtin_hash(struct command_t *command) {
+	int argc = command->arg_count - 1; // args ends with NULL
+
+	if (argc == 2 && strcmp(command->args[1], "-r") == 0) {
+		hash_clear();
+		return SUCCESS;
+	}
+
+	if (argc > 1) {
+		for (int i = 1; i < argc; ++i) {
+			const char *name = command->args[i];
+			if (resolve_command(name) == NULL)
+				printf("-%s: hash: %s: not found\n", sysname, name);
+		}
+		return SUCCESS;
+	}
+
+	bool empty = true;
+	for (int i = 0; i < HASH_BUCKETS; ++i) {
+		for (struct hash_entry *entry = cmd_hash[i]; entry; entry = entry->next) {
+			if (empty)
+				printf("hits\tcommand\n");
+			printf("%4d\t%s\n", entry->hits, entry->path);
+			empty = false;
+		}
+	}
+	if (empty)
+		printf("%s: hash table empty\n", sysname);
+	return SUCCESS;
+}
+
+/**
+ * kuhex: hex dump of a file
+ * @return exit status for the shell
+ */
+int builtin_kuhex(struct command_t *command) {
+	int argc = command->arg_count - 1; // args ends with NULL
+	const char *usage = "Usage: kuhex [-g <group_size>] [-s <offset>] [-n <length>] [-j <threads>] <filename | ->\n"
+						"       kuhex -r <dump | -> [<output_file>]\n"
+						"       kuhex -d <file1> <file2>\n";
+	char *filename = NULL;
+	char *second_file = NULL;
+	bool reverse = false, diff = false;
+	int group_size = 1; // Default group size
+	unsigned long long offset = 0, length = ULLONG_MAX;
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	for (int i = 1; i < argc; ++i) {
+		char *end;
+		if (strcmp(command->args[i], "-g") == 0 && i + 1 < argc) {
+			group_size = atoi(command->args[++i]);
+			if (group_size != 1 && group_size != 2 && group_size != 4 &&
+				group_size != 8 && group_size != 16) {
+				printf("Invalid group size. Supported values: 1, 2, 4, 8, 16.\n");
+				return UNKNOWN;
+			}
+		} else if (strcmp(command->args[i], "-r") == 0) {
+			reverse = true;
+		} else if (strcmp(command->args[i], "-d") == 0) {
+			diff = true;
+		} else if (strcmp(command->args[i], "-j") == 0 && i + 1 < argc) {
+			threads = atoi(command->args[++i]);
+			if (threads < 1 || threads > 256) {
+				printf("Invalid thread count. Supported values: 1 to 256.\n");
+				return UNKNOWN;
+			}
+		} else if ((strcmp(command->args[i], "-s") == 0 ||
+					strcmp(command->args[i], "-n") == 0) && i + 1 < argc) {
+			// decimal, or hex after 0x; no sign, no octal
+			const char *number = command->args[i + 1];
+			int base = 10;
+			if (number[0] == '0' && (number[1] == 'x' || number[1] == 'X')) {
+				number += 2;
+				base = 16;
+			}
+			errno = 0;
+			unsigned long long value = strtoull(number, &end, base);
+			if (!isxdigit((unsigned char)number[0]) || *end != '\0' || errno == ERANGE) {
+				printf("%s", usage);
+				return UNKNOWN;
+			}
+			if (command->args[i][1] == 's')
+				offset = value;
+			else
+				length = value;
+			i++;
+		} else if (filename == NULL) {
+			filename = command->args[i];
+		} else if (second_file == NULL) {
+			second_file = command->args[i];
+		} else {
+			printf("%s", usage);
+			return UNKNOWN;
+		}
+	}
+
+	if (filename == NULL || (reverse && diff) || (second_file != NULL && !reverse && !diff) ||
+		(diff && second_file == NULL)) {
+		printf("%s", usage);
+		return UNKNOWN;
+	}
+
+	if (diff)
+		// like cmp, differing files are a failure; UNKNOWN since EXIT would end the shell
+		return kuhex_diff(filename, second_file, STDOUT_FILENO) == 0 ? SUCCESS : UNKNOWN;
+
+	if (reverse) {
+		int out_fd = STDOUT_FILENO;
+		if (second_file != NULL) {
+			out_fd = open(second_file, O_WRONLY | O_CREAT, 0666);
+			if (out_fd == -1) {
+				perror("Error opening output file");
+				return UNKNOWN;
+			}
+		}
+		int r = kuhex_reverse(filename, out_fd);
+		if (second_file != NULL)
+			close(out_fd);
+		return r == 0 ? SUCCESS : UNKNOWN;
+	}
+
+	struct kuhex_options options = { group_size, offset, length,
+									 threads > 0 ? threads : 1, STDOUT_FILENO };
+	return kuhex_dump(filename, &options) == 0 ? SUCCESS : UNKNOWN;
+}
+
+/**
+ * psvis without the kernel module: the stat file of every process in /proc
+ * is read once, by several threads when there are many, into an array
+ * sorted by pid. A pid hash and a parent-to-children index are built over
+ * it: the children of procs[i] are children[child_start[i]] up to
+ * children[child_start[i + 1] - 1], in pid order. Index count is a virtual
+ * pid 0 whose children are the processes without a parent in the table.
+ */
+#define PS_COMM_MAX 64
+#define PS_SCAN_PER_THREAD 2048 // fewer processes than this per thread are read serially
+#define PS_SCAN_MAX_THREADS 32
+
+struct ps_process {
+	pid_t pid, ppid;
+	char state;
+	unsigned long long start_time; // clock ticks since boot, tells a reused pid apart
+	char comm[PS_COMM_MAX];
+};
+
+struct ps_tree {
+	struct ps_process *procs;
+	int count;
+	int *slots; // pid hash: index + 1, 0 for an empty slot
+	unsigned slot_mask;
+	int *child_start; // count + 2 entries
+	int *children;
+};
+
+/**
+ * Parse the contents of /proc/<pid>/stat. comm may hold spaces and
+ * parentheses, so it ends at the last ')'.
+ * @return 0 on success
+ */
+int ps_parse_stat(char *buf, struct ps_process *p) {
+	char *open = strchr(buf, '('), *close = strrchr(buf, ')');
+	if (open == NULL || close == NULL || close < open)
+		return -1;
+
+	size_t comm_len = close - open - 1;
+	if (comm_len >= PS_COMM_MAX)
+		comm_len = PS_COMM_MAX - 1;
+	memcpy(p->comm, open + 1, comm_len);
+	p->comm[comm_len] = '\0';
+	p->pid = atoi(buf);
+
+	// fields after comm: state ppid ... with starttime the 20th
+	char *field = close + 1;
+	p->state = field[1];
+	field += 2;
+	for (int i = 4; i <= 22; ++i) {
+		unsigned long long value = strtoull(field, &field, 10);
+		if (i == 4)
+			p->ppid = value;
+		else if (i == 22)
+			p->start_time = value;
+	}
+	return 0;
+}
+
+/**
+ * Read one process relative to an open /proc.
+ * @return 0 on success, -1 if it is gone
+ */
+int ps_read(int proc_fd, pid_t pid, struct ps_process *p) {
+	char path[32], buf[1024];
+
+	snprintf(path, sizeof(path), "%d/stat", pid);
+	int fd = openat(proc_fd, path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+	ssize_t len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return -1;
+	buf[len] = '\0';
+	return ps_parse_stat(buf, p);
+}
+
+struct ps_scan_part {
+	int proc_fd;
+	struct ps_process *procs; // pid filled in, 0 after reading once it is gone
+	int first, end;
+};
+
+void *ps_scan_worker(void *arg) {
+	struct ps_scan_part *part = arg;
+
+	for (int i = part->first; i < part->end; ++i)
+		if (ps_read(part->proc_fd, part->procs[i].pid, &part->procs[i]) != 0)
+			part->procs[i].pid = 0;
+	return NULL;
+}
+
+int compare_pids(const void *a, const void *b) {
+	pid_t x = ((const struct ps_process *)a)->pid, y = ((const struct ps_process *)b)->pid;
+	return (x > y) - (x < y);
+}
+
+static inline unsigned ps_hash(pid_t pid) {
+	return (unsigned)pid * 2654435761u;
+}
+
+int ps_find(const struct ps_tree *tree, pid_t pid) {
+	for (unsigned slot = ps_hash(pid) & tree->slot_mask; tree->slots[slot] != 0;
+		 slot = (slot + 1) & tree->slot_mask) {
+		if (tree->procs[tree->slots[slot] - 1].pid == pid)
+			return tree->slots[slot] - 1;
+	}
+	return -1;
+}
+
+/**
+ * Build the pid hash and the children index over tree->procs, which has
+ * to be sorted by pid.
+ */
+void ps_tree_index(struct ps_tree *tree) {
+	int count = tree->count;
+	unsigned size = 16;
+
+	while (size < 2 * (unsigned)count)
+		size *= 2;
+	free(tree->slots);
+	tree->slots = calloc(size, sizeof(int));
+	tree->slot_mask = size - 1;
+	for (int i = 0; i < count; ++i) {
+		unsigned slot = ps_hash(tree->procs[i].pid) & tree->slot_mask;
+		while (tree->slots[slot] != 0)
+			slot = (slot + 1) & tree->slot_mask;
+		tree->slots[slot] = i + 1;
+	}
+
+	// count the children of every parent, then place them in pid order
+	int *parents = malloc(sizeof(int) * (count + 1));
+	free(tree->child_start);
+	free(tree->children);
+	tree->child_start = calloc(count + 2, sizeof(int));
+	tree->children = malloc(sizeof(int) * (count + 1));
+	for (int i = 0; i < count; ++i) {
+		const struct ps_process *p = &tree->procs[i];
+		int parent = p->ppid != p->pid ? ps_find(tree, p->ppid) : -1;
+		parents[i] = parent != -1 ? parent : count;
+		tree->child_start[parents[i] + 1]++;
+	}
+	for (int i = 0; i <= count; ++i)
+		tree->child_start[i + 1] += tree->child_start[i];
+	int *next = malloc(sizeof(int) * (count + 1));
+	memcpy(next, tree->child_start, sizeof(int) * (count + 1));
+	for (int i = 0; i < count; ++i)
+		tree->children[next[parents[i]]++] = i;
+	free(next);
+	free(parents);
+}
+
+void ps_tree_free(struct ps_tree *tree) {
+	free(tree->procs);
+	free(tree->slots);
+	free(tree->child_start);
+	free(tree->children);
+	memset(tree, 0, sizeof(*tree));
+}
+
+/**
+ * Read every process in /proc into tree.
+ * @return 0 on success
+ */
+int ps_tree_scan(struct ps_tree *tree) {
+	int capacity = 1024, count = 0;
+	struct ps_process *procs = malloc(sizeof(struct ps_process) * capacity);
+
+	memset(tree, 0, sizeof(*tree));
+	DIR *proc = opendir("/proc");
+	if (proc == NULL) {
+		perror("psvis: /proc");
+		free(procs);
+		return -1;
+	}
+	struct dirent *entry;
+	while ((entry = readdir(proc)) != NULL) {
+		if (!isdigit((unsigned char)entry->d_name[0]))
+			continue;
+		if (count == capacity) {
+			capacity *= 2;
+			procs = realloc(procs, sizeof(struct ps_process) * capacity);
+		}
+		procs[count++].pid = atoi(entry->d_name);
+	}
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int threads = count / PS_SCAN_PER_THREAD;
+	if (threads > cpus)
+		threads = cpus;
+	if (threads > PS_SCAN_MAX_THREADS)
+		threads = PS_SCAN_MAX_THREADS;
+	if (threads < 1)
+		threads = 1;
+
+	struct ps_scan_part parts[PS_SCAN_MAX_THREADS];
+	pthread_t workers[PS_SCAN_MAX_THREADS];
+	int started = 0;
+	for (int i = 0; i < threads; ++i) {
+		parts[i] = (struct ps_scan_part){ dirfd(proc), procs, (int)((long)count * i / threads),
+										  (int)((long)count * (i + 1) / threads) };
+		// the calling thread reads the last part itself
+		if (i == threads - 1 || pthread_create(&workers[started], NULL, ps_scan_worker,
+												&parts[i]) != 0)
+			ps_scan_worker(&parts[i]);
+		else
+			started++;
+	}
+	for (int i = 0; i < started; ++i)
+		pthread_join(workers[i], NULL);
+	closedir(proc);
+
+	// drop the processes that exited meanwhile
+	int kept = 0;
+	for (int i = 0; i < count; ++i)
+		if (procs[i].pid != 0)
+			procs[kept++] = procs[i];
+	qsort(procs, kept, sizeof(struct ps_process), compare_pids);
+
+	tree->procs = procs;
+	tree->count = kept;
+	ps_tree_index(tree);
+	return 0;
+}
+
+/**
+ * Depth first walk of the subtree under index (count for the virtual
+ * pid 0), calling enter before a process's children and leave after them.
+ */
+struct ps_walk_ops {
+	void (*enter)(FILE *out, const struct ps_tree *tree, int index, int parent, int depth);
+	void (*leave)(FILE *out, const struct ps_tree *tree, int index, int depth);
+};
+
+void ps_walk(FILE *out, const struct ps_tree *tree, int root, const struct ps_walk_ops *ops) {
+	struct {
+		int index, next; // next child position in tree->children
+	} *stack = malloc(sizeof(*stack) * (tree->count + 1));
+	int depth = 0;
+
+	ops->enter(out, tree, root, -1, 0);
+	stack[0].index = root;
+	stack[0].next = tree->child_start[root];
+	while (depth >= 0) {
+		int index = stack[depth].index;
+		if (stack[depth].next < tree->child_start[index + 1]) {
+			int child = tree->children[stack[depth].next++];
+			ops->enter(out, tree, child, index, depth + 1);
+			depth++;
+			stack[depth].index = child;
+			stack[depth].next = tree->child_start[child];
+		} else {
+			if (ops->leave != NULL)
+				ops->leave(out, tree, index, depth);
+			depth--;
+		}
+	}
+	free(stack);
+}
+
+static const struct ps_process ps_swapper = { 0, 0, 'R', 0, "swapper" };
+
+static inline const struct ps_process *ps_at(const struct ps_tree *tree, int index) {
+	return index < tree->count ? &tree->procs[index] : &ps_swapper;
+}
+
+// comm as a quoted string, for DOT and JSON
+static void ps_put_quoted(FILE *out, const char *text) {
+	putc('"', out);
+	for (const char *c = text; *c != '\0'; ++c) {
+		if (*c == '"' || *c == '\\')
+			putc('\\', out);
+		if ((unsigned char)*c >= ' ')
+			putc(*c, out);
+	}
+	putc('"', out);
+}
+
+static void ps_dot_node(FILE *out, const struct ps_process *p) {
+	char label[PS_COMM_MAX + 16];
+	snprintf(label, sizeof(label), "%d %s", p->pid, p->comm);
+	ps_put_quoted(out, label);
+}
+
+static void ps_dot_enter(FILE *out, const struct ps_tree *tree, int index, int parent, int depth) {
+	(void)depth;
+	if (parent == -1) {
+		// the root on its own, so a process without children still shows
+		ps_dot_node(out, ps_at(tree, index));
+		fputs(";\n", out);
+		return;
+	}
+	ps_dot_node(out, ps_at(tree, parent));
+	fputs(" -> ", out);
+	ps_dot_node(out, ps_at(tree, index));
+	fputs(";\n", out);
+}
+
+static void ps_text_enter(FILE *out, const struct ps_tree *tree, int index, int parent, int depth) {
+	const struct ps_process *p = ps_at(tree, index);
+	(void)parent;
+	fprintf(out, "%*s%d %s\n", 2 * depth, "", p->pid, p->comm);
+}
+
+static void ps_json_enter(FILE *out, const struct ps_tree *tree, int index, int parent, int depth) {
+	const struct ps_process *p = ps_at(tree, index);
+	// a later sibling needs a comma, the first child of parent comes right after "["
+	bool first = parent == -1 || tree->children[tree->child_start[parent]] == index;
+	fprintf(out, "%s\n%*s{\"pid\": %d, \"ppid\": %d, \"state\": \"%c\", \"comm\": ",
+			first ? "" : ",", 2 * depth, "", p->pid, p->ppid, p->state);
+	ps_put_quoted(out, p->comm);
+	fputs(", \"children\": [", out);
+}
+
+static void ps_json_leave(FILE *out, const struct ps_tree *tree, int index, int depth) {
+	if (tree->child_start[index] == tree->child_start[index + 1])
+		fputs("]}", out);
+	else
+		fprintf(out, "\n%*s]}", 2 * depth, "");
+	if (depth == 0)
+		putc('\n', out);
+}
+
+void ps_write_dot(FILE *out, const struct ps_tree *tree, int root) {
+	static const struct ps_walk_ops ops = { ps_dot_enter, NULL };
+	fprintf(out, "digraph ProcessTree {\n");
+	fprintf(out, "node [shape=ellipse];\n");
+	ps_walk(out, tree, root, &ops);
+	fprintf(out, "}\n");
+}
+
+void ps_write_text(FILE *out, const struct ps_tree *tree, int root) {
+	static const struct ps_walk_ops ops = { ps_text_enter, NULL };
+	ps_walk(out, tree, root, &ops);
+}
+
+void ps_write_json(FILE *out, const struct ps_tree *tree, int root) {
+	static const struct ps_walk_ops ops = { ps_json_enter, ps_json_leave };
+	ps_walk(out, tree, root, &ops);
+}
+
+/**
+ * Native SVG output: a tidy tree layout, Walker's algorithm in the linear
+ * time form of Buchheim, Jünger and Leipert. Children sit in pid order
+ * under their parent, centred over them, and every subtree is pushed right
+ * just as far as its contour against the left siblings requires. Boxes are
+ * as wide as their "pid comm" label, so the separation of two neighbours
+ * is half of both widths plus a gap.
+ */
+#define PS_SVG_CHAR_WIDTH 7.2 // monospace at font-size 12
+#define PS_SVG_BOX_HEIGHT 20
+#define PS_SVG_LEVEL_HEIGHT 56
+#define PS_SVG_GAP 10
+#define PS_SVG_MARGIN 16
+
+struct ps_layout_node {
+	double prelim, mod, shift, change, width, x;
+	int parent, number, depth; // number is the position among the siblings
+	int thread, ancestor, default_ancestor;
+};
+
+static inline int ps_first_child(const struct ps_tree *tree, int v) {
+	int start = tree->child_start[v];
+	return start < tree->child_start[v + 1] ? tree->children[start] : -1;
+}
+
+static inline int ps_last_child(const struct ps_tree *tree, int v) {
+	int end = tree->child_start[v + 1];
+	return tree->child_start[v] < end ? tree->children[end - 1] : -1;
+}
+
+// next node on the left contour, a thread where the subtree ends
+static inline int ps_next_left(const struct ps_tree *tree, const struct ps_layout_node *nodes,
+							   int v) {
+	int child = ps_first_child(tree, v);
+	return child != -1 ? child : nodes[v].thread;
+}
+
+static inline int ps_next_right(const struct ps_tree *tree, const struct ps_layout_node *nodes,
+								int v) {
+	int child = ps_last_child(tree, v);
+	return child != -1 ? child : nodes[v].thread;
+}
+
+static inline double ps_separation(const struct ps_layout_node *nodes, int a, int b) {
+	return (nodes[a].width + nodes[b].width) / 2 + PS_SVG_GAP;
+}
+
+// move the subtree of right by shift, spreading it over the siblings between left and right
+static void ps_move_subtree(struct ps_layout_node *nodes, int left, int right, double shift) {
+	double change = shift / (nodes[right].number - nodes[left].number);
+	nodes[right].change -= change;
+	nodes[right].shift += shift;
+	nodes[left].change += change;
+	nodes[right].prelim += shift;
+	nodes[right].mod += shift;
+}
+
+static void ps_execute_shifts(const struct ps_tree *tree, struct ps_layout_node *nodes, int v) {
+	double shift = 0, change = 0;
+	for (int c = tree->child_start[v + 1] - 1; c >= tree->child_start[v]; --c) {
+		struct ps_layout_node *w = &nodes[tree->children[c]];
+		w->prelim += shift;
+		w->mod += shift;
+		change += w->change;
+		shift += w->shift + change;
+	}
+}
+
+/**
+ * Walk the right contour of the left siblings of v against the left
+ * contour of v, moving v right where they overlap.
+ * @return the new default ancestor of v's parent
+ */
+static int ps_apportion(const struct ps_tree *tree, struct ps_layout_node *nodes, int v, int w,
+						int ancestor) {
+	if (w == -1)
+		return ancestor;
+	int inner_right = v, outer_right = v, inner_left = w;
+	int outer_left = ps_first_child(tree, nodes[v].parent);
+	double sum_ir = nodes[v].mod, sum_or = nodes[v].mod;
+	double sum_il = nodes[w].mod, sum_ol = nodes[outer_left].mod;
+
+	for (;;) {
+		inner_left = ps_next_right(tree, nodes, inner_left);
+		inner_right = ps_next_left(tree, nodes, inner_right);
+		if (inner_left == -1 || inner_right == -1)
+			break;
+		outer_left = ps_next_left(tree, nodes, outer_left);
+		outer_right = ps_next_right(tree, nodes, outer_right);
+		nodes[outer_right].ancestor = v;
+		double shift = nodes[inner_left].prelim + sum_il - nodes[inner_right].prelim - sum_ir +
+					   ps_separation(nodes, inner_left, inner_right);
+		if (shift > 0) {
+			int left = nodes[inner_left].ancestor;
+			if (nodes[left].parent != nodes[v].parent)
+				left = ancestor;
+			ps_move_subtree(nodes, left, v, shift);
+			sum_ir += shift;
+			sum_or += shift;
+		}
+		sum_il += nodes[inner_left].mod;
+		sum_ir += nodes[inner_right].mod;
+		sum_ol += nodes[outer_left].mod;
+		sum_or += nodes[outer_right].mod;
+	}
+	if (inner_left != -1 && ps_next_right(tree, nodes, outer_right) == -1) {
+		nodes[outer_right].thread = inner_left;
+		nodes[outer_right].mod += sum_il - sum_or;
+	}
+	if (inner_right != -1 && ps_next_left(tree, nodes, outer_left) == -1) {
+		nodes[outer_left].thread = inner_right;
+		nodes[outer_left].mod += sum_ir - sum_ol;
+		ancestor = v;
+	}
+	return ancestor;
+}
+
+/**
+ * Lay out the subtree of root. nodes is indexed like the tree, order gets
+ * the subtree in preorder with the children right to left, so read
+ * backwards it is a left to right postorder.
+ * @return the number of processes in the subtree
+ */
+int ps_layout(const struct ps_tree *tree, int root, struct ps_layout_node *nodes, int *order) {
+	int *stack = malloc(sizeof(int) * (tree->count + 1));
+	int n = 0, top = 0;
+
+	stack[top++] = root;
+	nodes[root].parent = -1;
+	nodes[root].number = 0;
+	nodes[root].depth = 0;
+	while (top > 0) {
+		int v = stack[--top];
+		struct ps_layout_node *node = &nodes[v];
+		char label[PS_COMM_MAX + 16];
+		order[n++] = v;
+		node->prelim = node->mod = node->shift = node->change = 0;
+		node->width = snprintf(label, sizeof(label), "%d %s", ps_at(tree, v)->pid,
+							   ps_at(tree, v)->comm) * PS_SVG_CHAR_WIDTH + 8;
+		node->thread = node->default_ancestor = -1;
+		node->ancestor = v;
+		for (int c = tree->child_start[v]; c < tree->child_start[v + 1]; ++c) {
+			int child = tree->children[c];
+			nodes[child].parent = v;
+			nodes[child].number = c - tree->child_start[v];
+			nodes[child].depth = node->depth + 1;
+			stack[top++] = child;
+		}
+	}
+	free(stack);
+
+	// first walk, bottom up: place each node relative to its left sibling
+	for (int i = n - 1; i >= 0; --i) {
+		int v = order[i], parent = nodes[v].parent;
+		struct ps_layout_node *node = &nodes[v];
+		int w = node->number > 0 ? tree->children[tree->child_start[parent] + node->number - 1]
+								 : -1;
+		int first = ps_first_child(tree, v);
+		if (first != -1) {
+			ps_execute_shifts(tree, nodes, v);
+			double midpoint = (nodes[first].prelim + nodes[ps_last_child(tree, v)].prelim) / 2;
+			if (w != -1) {
+				node->prelim = nodes[w].prelim + ps_separation(nodes, v, w);
+				node->mod = node->prelim - midpoint;
+			} else {
+				node->prelim = midpoint;
+			}
+		} else if (w != -1) {
+			node->prelim = nodes[w].prelim + ps_separation(nodes, v, w);
+		}
+		if (parent != -1) {
+			int ancestor = nodes[parent].default_ancestor;
+			nodes[parent].default_ancestor = ps_apportion(
+				tree, nodes, v, w, ancestor != -1 ? ancestor : ps_first_child(tree, parent));
+		}
+	}
+
+	// second walk, top down: add up the modifiers, with the root at 0
+	nodes[root].x = 0;
+	nodes[root].mod -= nodes[root].prelim;
+	for (int i = 1; i < n; ++i) {
+		struct ps_layout_node *node = &nodes[order[i]];
+		node->x = node->prelim + nodes[node->parent].mod;
+		node->mod += nodes[node->parent].mod;
+	}
+	return n;
+}
+
+// text for XML content and attributes
+static void ps_put_xml(FILE *out, const char *text) {
+	for (const char *c = text; *c != '\0'; ++c) {
+		if (*c == '&')
+			fputs("&amp;", out);
+		else if (*c == '<')
+			fputs("&lt;", out);
+		else if (*c == '>')
+			fputs("&gt;", out);
+		else if ((unsigned char)*c >= ' ')
+			putc(*c, out);
+	}
+}
+
+void ps_write_svg(FILE *out, const struct ps_tree *tree, int root) {
+	struct ps_layout_node *nodes = malloc(sizeof(struct ps_layout_node) * (tree->count + 1));
+	int *order = malloc(sizeof(int) * (tree->count + 1));
+	int n = ps_layout(tree, root, nodes, order);
+
+	double left = 0, right = 0;
+	int depth = 0;
+	for (int i = 0; i < n; ++i) {
+		const struct ps_layout_node *node = &nodes[order[i]];
+		if (node->x - node->width / 2 < left)
+			left = node->x - node->width / 2;
+		if (node->x + node->width / 2 > right)
+			right = node->x + node->width / 2;
+		if (node->depth > depth)
+			depth = node->depth;
+	}
+	// whole pixels from here on, measured from the left edge
+	double origin = PS_SVG_MARGIN - left + 0.5;
+	int width = (int)(right - left) + 2 * PS_SVG_MARGIN;
+	int height = depth * PS_SVG_LEVEL_HEIGHT + PS_SVG_BOX_HEIGHT + 2 * PS_SVG_MARGIN;
+
+	fprintf(out,
+			"<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%d\" height=\"%d\" "
+			"viewBox=\"0 0 %d %d\" font-family=\"monospace\" font-size=\"12\">\n"
+			"<style>rect{fill:#eef2ff;stroke:#4a5a8a}path{fill:none;stroke:#8a8a8a}"
+			"text{text-anchor:middle;dominant-baseline:central}</style>\n",
+			width, height, width, height);
+
+	// edges: down from the parent, across its children, down to each child
+	fputs("<path d=\"", out);
+	for (int i = 0; i < n; ++i) {
+		int v = order[i], first = ps_first_child(tree, v);
+		if (first == -1)
+			continue;
+		int top = PS_SVG_MARGIN + nodes[v].depth * PS_SVG_LEVEL_HEIGHT + PS_SVG_BOX_HEIGHT;
+		int middle = top + (PS_SVG_LEVEL_HEIGHT - PS_SVG_BOX_HEIGHT) / 2;
+		fprintf(out, "M%d %dV%dM%d %dH%d", (int)(nodes[v].x + origin), top, middle,
+				(int)(nodes[first].x + origin), middle,
+				(int)(nodes[ps_last_child(tree, v)].x + origin));
+		for (int c = tree->child_start[v]; c < tree->child_start[v + 1]; ++c)
+			fprintf(out, "M%d %dv%d", (int)(nodes[tree->children[c]].x + origin), middle,
+					top + PS_SVG_LEVEL_HEIGHT - PS_SVG_BOX_HEIGHT - middle);
+	}
+	fputs("\"/>\n", out);
+
+	for (int i = 0; i < n; ++i) {
+		const struct ps_layout_node *node = &nodes[order[i]];
+		const struct ps_process *p = ps_at(tree, order[i]);
+		int x = (int)(node->x + origin), y = PS_SVG_MARGIN + node->depth * PS_SVG_LEVEL_HEIGHT;
+		fprintf(out, "<rect x=\"%d\" y=\"%d\" width=\"%d\" height=\"%d\" rx=\"4\"/>"
+				"<text x=\"%d\" y=\"%d\">%d ",
+				x - (int)(node->width / 2), y, (int)node->width, PS_SVG_BOX_HEIGHT, x,
+				y + PS_SVG_BOX_HEIGHT / 2, p->pid);
+		ps_put_xml(out, p->comm);
+		fputs("</text>\n", out);
+	}
+	fputs("</svg>\n", out);
+	free(order);
+	free(nodes);
+}
+
+/**
+ * Render the subtree with Graphviz, DOT goes to dot through a pipe.
+ * @return 0 on success
+ */
+int ps_render_graphviz(const struct ps_tree *tree, int root, const char *format,
+					   const char *output_file) {
+	char type[32];
+	char *args[] = { "dot", type, "-o", (char *)output_file, NULL };
+	posix_spawn_file_actions_t actions;
+	int pipefd[2];
+	pid_t pid;
+
+	snprintf(type, sizeof(type), "-T%s", format);
+	if (pipe2(pipefd, O_CLOEXEC) == -1) {
+		perror("psvis: pipe");
+		return -1;
+	}
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, pipefd[0], STDIN_FILENO);
+	int r = posix_spawnp(&pid, "dot", &actions, NULL, args, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	close(pipefd[0]);
+	if (r != 0) {
+		fprintf(stderr, "psvis: dot: %s, is Graphviz installed?\n", strerror(r));
+		close(pipefd[1]);
+		return -1;
+	}
+
+	FILE *out = fdopen(pipefd[1], "w");
+	ps_write_dot(out, tree, root);
+	fclose(out);
+	int status = wait_child(pid);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "psvis: dot failed to render %s\n", output_file);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Write the subtree of root to output_file in the format its extension
+ * names: .dot and .gv as DOT, .txt as an indented list, .json as nested
+ * objects, .svg drawn here, anything else through Graphviz (PNG without an
+ * extension).
+ * An output of - prints the list to stdout.
+ * @return 0 on success
+ */
+int ps_write_tree(const struct ps_tree *tree, int root, const char *output_file) {
+	const char *base = strrchr(output_file, '/');
+	const char *dot = strrchr(base != NULL ? base : output_file, '.');
+	const char *ext = dot != NULL ? dot + 1 : "png";
+	void (*writer)(FILE *, const struct ps_tree *, int) = NULL;
+
+	if (strcmp(output_file, "-") == 0 || strcasecmp(ext, "txt") == 0)
+		writer = ps_write_text;
+	else if (strcasecmp(ext, "dot") == 0 || strcasecmp(ext, "gv") == 0)
+		writer = ps_write_dot;
+	else if (strcasecmp(ext, "json") == 0)
+		writer = ps_write_json;
+	else if (strcasecmp(ext, "svg") == 0)
+		writer = ps_write_svg;
+	else
+		return ps_render_graphviz(tree, root, ext, output_file);
+
+	if (strcmp(output_file, "-") == 0) {
+		writer(stdout, tree, root);
+		fflush(stdout);
+		return 0;
+	}
+	FILE *out = fopen(output_file, "w");
+	if (out == NULL) {
+		fprintf(stderr, "psvis: %s: %s\n", output_file, strerror(errno));
+		return -1;
+	}
+	setvbuf(out, NULL, _IOFBF, 1 << 20);
+	writer(out, tree, root);
+	if (fclose(out) != 0) {
+		fprintf(stderr, "psvis: %s: %s\n", output_file, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static bool psvis_module_failed; // do not try insmod again in this shell
+
+/**
+ * Get the subtree of pid from the kernel module, loading it if needed. Its
+ * lines are "parent" -> "child" edges with "pid comm" labels.
+ * @return 0 on success, -1 if the module cannot be used
+ */
+int psvis_module_tree(pid_t pid, struct ps_tree *tree) {
+	memset(tree, 0, sizeof(*tree));
+	if (psvis_module_failed)
+		return -1;
+
+	// check if the kernel module is loaded
+	FILE *proc_modules = fopen("/proc/modules", "r");
+	bool module_loaded = false;
+	char line[256];
+	while (proc_modules != NULL && fgets(line, sizeof(line), proc_modules)) {
+		if (strstr(line, "mymodule") != NULL) {
+			module_loaded = true;
+			printf("Kernel Module is already loaded.\n");
+			break;
+		}
+	}
+	if (proc_modules != NULL)
+		fclose(proc_modules);
+
+	char path_to_module[PATH_MAX];
+	char src_dir[PATH_MAX];
+	ssize_t len = readlink("/proc/self/exe", path_to_module, sizeof(path_to_module) - 1);
+	if (!module_loaded && len != -1) {
+		path_to_module[len] = '\0'; // null terminate
+		strncpy(src_dir, path_to_module, sizeof(src_dir) - 1);
+		src_dir[sizeof(src_dir) - 1] = '\0'; // null terminate
+
+		// construct the full path of mymodule.ko next to the executable and load it,
+		// sudo -n fails at once rather than prompting so the /proc walk takes over
+		char *directory = dirname(src_dir);
+		snprintf(path_to_module, sizeof(path_to_module), "%s/module/mymodule.ko", directory);
+		char insmod_command[PATH_MAX + 32];
+		snprintf(insmod_command, sizeof(insmod_command), "sudo -n insmod %s 2>/dev/null",
+				 path_to_module);
+		module_loaded = system(insmod_command) == 0;
+	}
+
+	// write the PID to /proc/psvis as parameter, then read the edges back
+	FILE *proc_psvis = module_loaded ? fopen("/proc/psvis", "w") : NULL;
+	if (proc_psvis == NULL) {
+		psvis_module_failed = true;
+		return -1;
+	}
+	fprintf(proc_psvis, "%d", pid);
+	fclose(proc_psvis);
+	proc_psvis = fopen("/proc/psvis", "r");
+	if (proc_psvis == NULL) {
+		psvis_module_failed = true;
+		return -1;
+	}
+
+	// the root first, then every child as it appears in an edge
+	int capacity = 64;
+	tree->procs = malloc(sizeof(struct ps_process) * capacity);
+	memset(&tree->procs[0], 0, sizeof(struct ps_process));
+	tree->procs[0].pid = pid;
+	tree->procs[0].state = '?';
+	tree->count = 1;
+	char edge[2 * PS_COMM_MAX + 64];
+	while (fgets(edge, sizeof(edge), proc_psvis)) {
+		struct ps_process child = { 0 };
+		pid_t parent;
+		char parent_comm[PS_COMM_MAX];
+		if (sscanf(edge, "\"%d %63[^\"]\" -> \"%d %63[^\"]\";", &parent, parent_comm,
+				   &child.pid, child.comm) != 4)
+			continue;
+		if (parent == pid)
+			strcpy(tree->procs[0].comm, parent_comm);
+		child.ppid = parent;
+		child.state = '?';
+		if (tree->count == capacity) {
+			capacity *= 2;
+			tree->procs = realloc(tree->procs, sizeof(struct ps_process) * capacity);
+		}
+		tree->procs[tree->count++] = child;
+	}
+	fclose(proc_psvis);
+
+	if (tree->procs[0].comm[0] == '\0') // no children, ask /proc for the name
+		ps_read(AT_FDCWD, pid, &tree->procs[0]);
+	qsort(tree->procs, tree->count, sizeof(struct ps_process), compare_pids);
+	ps_tree_index(tree);
+	return 0;
+}
+
+/**
+ * psvis --watch: the tree is kept between refreshes. Every interval /proc
+ * is listed and merged with the previous pids. Only new processes and the
+ * surviving children of exited ones, which the kernel reparents, have their
+ * stat read again, so the reads per refresh follow the churn and not the
+ * number of processes. Each change is printed as an added, exited or
+ * reparented event, and full snapshots can be written every few refreshes.
+ */
+struct ps_watch {
+	struct ps_tree tree;
+	DIR *proc;
+	pid_t root; // watched subtree, 0 for everything
+	double start;
+	unsigned long refreshes, reads, events;
+	double refresh_time;
+};
+
+enum ps_event_kind { PS_ADDED, PS_EXITED, PS_REPARENTED };
+
+struct ps_event {
+	enum ps_event_kind kind;
+	struct ps_process proc;
+	pid_t old_ppid;
+};
+
+// process index belongs to the subtree of root
+bool ps_in_subtree(const struct ps_tree *tree, int index, pid_t root) {
+	if (root == 0)
+		return true;
+	for (int steps = 0; index != -1 && steps < tree->count; ++steps) {
+		const struct ps_process *p = &tree->procs[index];
+		if (p->pid == root)
+			return true;
+		index = p->ppid != p->pid ? ps_find(tree, p->ppid) : -1;
+	}
+	return false;
+}
+
+// index of pid in procs sorted by pid, -1 if it is not there
+int ps_search(const struct ps_process *procs, int count, pid_t pid) {
+	int low = 0, high = count - 1;
+	while (low <= high) {
+		int mid = (low + high) / 2;
+		if (procs[mid].pid == pid)
+			return mid;
+		if (procs[mid].pid < pid)
+			low = mid + 1;
+		else
+			high = mid - 1;
+	}
+	return -1;
+}
+
+int compare_pid_values(const void *a, const void *b) {
+	pid_t x = *(const pid_t *)a, y = *(const pid_t *)b;
+	return (x > y) - (x < y);
+}
+
+static void ps_push_event(struct ps_event **events, int *count, int *capacity,
+						  const struct ps_event *e) {
+	if (*count == *capacity) {
+		*capacity = *capacity ? *capacity * 2 : 64;
+		*events = realloc(*events, sizeof(struct ps_event) * *capacity);
+	}
+	(*events)[(*count)++] = *e;
+}
+
+void ps_print_event(FILE *out, const struct ps_watch *w, const struct ps_event *e) {
+	static const char *names[] = { "added", "exited", "reparented" };
+	fprintf(out, "%9.3f %-10s %7d %s", now_seconds() - w->start, names[e->kind], e->proc.pid,
+			e->proc.comm);
+	if (e->kind == PS_ADDED)
+		fprintf(out, ", parent %d\n", e->proc.ppid);
+	else if (e->kind == PS_REPARENTED)
+		fprintf(out, ", parent %d -> %d\n", e->old_ppid, e->proc.ppid);
+	else
+		putc('\n', out);
+}
+
+/**
+ * Bring the tree up to date and print the events of the watched subtree.
+ * @return the number of events printed
+ */
+int ps_watch_refresh(struct ps_watch *w, FILE *out) {
+	struct ps_tree *old = &w->tree;
+	double start = now_seconds();
+	int capacity = old->count + 64, count = 0;
+	pid_t *pids = malloc(sizeof(pid_t) * capacity);
+
+	rewinddir(w->proc);
+	struct dirent *entry;
+	while ((entry = readdir(w->proc)) != NULL) {
+		if (!isdigit((unsigned char)entry->d_name[0]))
+			continue;
+		if (count == capacity) {
+			capacity *= 2;
+			pids = realloc(pids, sizeof(pid_t) * capacity);
+		}
+		pids[count++] = atoi(entry->d_name);
+	}
+	// /proc lists pids in ascending order, but do not rely on it
+	for (int i = 1; i < count; ++i) {
+		if (pids[i - 1] > pids[i]) {
+			qsort(pids, count, sizeof(pid_t), compare_pid_values);
+			break;
+		}
+	}
+
+	// merge the sorted old pids with the listing: new ones are read, missing ones exited
+	struct ps_process *procs = malloc(sizeof(struct ps_process) * (old->count + count + 1));
+	struct ps_event *events = NULL;
+	int event_count = 0, event_capacity = 0, n = 0;
+	bool *exited = calloc(old->count + 1, sizeof(bool));
+	int proc_fd = dirfd(w->proc);
+	for (int i = 0, j = 0; i < old->count || j < count;) {
+		struct ps_event e;
+		memset(&e, 0, sizeof(e));
+		if (j >= count || (i < old->count && old->procs[i].pid < pids[j])) {
+			exited[i] = true;
+			e.kind = PS_EXITED;
+			e.proc = old->procs[i++];
+		} else if (i >= old->count || pids[j] < old->procs[i].pid) {
+			w->reads++;
+			if (ps_read(proc_fd, pids[j++], &e.proc) != 0)
+				continue; // came and went
+			e.kind = PS_ADDED;
+			procs[n++] = e.proc;
+		} else {
+			procs[n++] = old->procs[i++];
+			j++;
+			continue;
+		}
+		ps_push_event(&events, &event_count, &event_capacity, &e);
+	}
+	free(pids);
+
+	// children of exited processes have a new parent now
+	int exits = event_count;
+	for (int e = 0; e < exits; ++e) {
+		if (events[e].kind != PS_EXITED)
+			continue;
+		int parent = ps_find(old, events[e].proc.pid);
+		for (int c = old->child_start[parent]; c < old->child_start[parent + 1]; ++c) {
+			int child = old->children[c];
+			int at = exited[child] ? -1 : ps_search(procs, n, old->procs[child].pid);
+			if (at == -1)
+				continue;
+			struct ps_event change = { PS_REPARENTED, procs[at], procs[at].ppid };
+			w->reads++;
+			if (ps_read(proc_fd, procs[at].pid, &change.proc) != 0 ||
+				change.proc.start_time != procs[at].start_time) {
+				// exited since the listing
+				change.kind = PS_EXITED;
+				change.proc = procs[at];
+				procs[at].pid = 0;
+			} else if (change.proc.ppid == procs[at].ppid) {
+				continue;
+			} else {
+				procs[at] = change.proc;
+			}
+			ps_push_event(&events, &event_count, &event_capacity, &change);
+		}
+	}
+	int kept = 0;
+	for (int i = 0; i < n; ++i)
+		if (procs[i].pid != 0)
+			procs[kept++] = procs[i];
+
+	// exits are filtered against the old tree, the rest against the new one
+	struct ps_tree tree;
+	memset(&tree, 0, sizeof(tree));
+	tree.procs = procs;
+	tree.count = kept;
+	if (event_count > 0)
+		ps_tree_index(&tree);
+	int printed = 0;
+	for (int e = 0; e < event_count; ++e) {
+		const struct ps_event *event = &events[e];
+		bool shown = event->kind == PS_EXITED
+						 ? ps_in_subtree(old, ps_find(old, event->proc.pid), w->root)
+						 : ps_in_subtree(&tree, ps_find(&tree, event->proc.pid), w->root);
+		if (event->kind == PS_REPARENTED && !shown)
+			shown = ps_in_subtree(old, ps_find(old, event->proc.pid), w->root);
+		if (shown) {
+			ps_print_event(out, w, event);
+			printed++;
+		}
+	}
+	fflush(out);
+
+	if (event_count > 0) {
+		ps_tree_free(old);
+		w->tree = tree;
+	} else {
+		free(procs);
+	}
+	free(events);
+	free(exited);
+	w->refreshes++;
+	w->events += printed;
+	w->refresh_time += now_seconds() - start;
+	return printed;
+}
+
+/**
+ * psvis --watch [-i <ms>] [-n <refreshes>] [-s <every>] [PID [output_file]]
+ * Runs until Ctrl-C, Enter on a terminal or -n refreshes. With -s a full
+ * snapshot goes to output_file, or to stdout as a list, every that many
+ * refreshes.
+ */
+int psvis_watch(struct command_t *command) {
+	int argc = command->arg_count - 1; // args ends with NULL
+	long interval = 1000, limit = -1, every = 0;
+	const char *output_file = NULL;
+	struct ps_watch w;
+	bool have_pid = false;
+
+	memset(&w, 0, sizeof(w));
+	for (int i = 2; i < argc; ++i) {
+		char *arg = command->args[i], *end = NULL;
+		long *option = strcmp(arg, "-i") == 0 ? &interval
+					   : strcmp(arg, "-n") == 0 ? &limit
+					   : strcmp(arg, "-s") == 0 ? &every
+												: NULL;
+		if (option != NULL && i + 1 < argc)
+			*option = strtol(command->args[++i], &end, 10);
+		bool valid = option != NULL ? end != NULL && *end == '\0' && *option >= 0
+									: have_pid ? output_file == NULL
+											   : isdigit((unsigned char)arg[0]);
+		if (!valid || interval == 0) {
+			printf("Usage: psvis --watch [-i <ms>] [-n <refreshes>] [-s <every>] "
+				   "[PID [output_file]]\n");
+			return UNKNOWN;
+		}
+		if (option != NULL)
+			continue;
+		if (have_pid) {
+			output_file = arg;
+		} else {
+			w.root = atoi(arg);
+			have_pid = true;
+		}
+	}
+
+	w.proc = opendir("/proc");
+	if (w.proc == NULL || ps_tree_scan(&w.tree) != 0) {
+		perror("psvis: /proc");
+		if (w.proc != NULL)
+			closedir(w.proc);
+		return UNKNOWN;
+	}
+	if (w.root != 0 && ps_find(&w.tree, w.root) == -1) {
+		printf("Process with PID %d not found.\n", w.root);
+		ps_tree_free(&w.tree);
+		closedir(w.proc);
+		return UNKNOWN;
+	}
+
+	// Ctrl-C ends the watch rather than the shell
+	sigset_t interrupt, old_mask;
+	sigemptyset(&interrupt);
+	sigaddset(&interrupt, SIGINT);
+	sigprocmask(SIG_BLOCK, &interrupt, &old_mask);
+	int interrupt_fd = signalfd(-1, &interrupt, SFD_CLOEXEC);
+	bool keys = isatty(STDIN_FILENO);
+
+	w.start = now_seconds();
+	printf("watching pid %d, %d processes, every %ld ms\n", w.root, w.tree.count, interval);
+	fflush(stdout);
+	bool pressed = false;
+	while (limit < 0 || (long)w.refreshes < limit) {
+		struct pollfd fds[2] = { { interrupt_fd, POLLIN, 0 },
+								 { keys ? STDIN_FILENO : -1, POLLIN, 0 } };
+		if (poll(fds, 2, interval) > 0) {
+			pressed = fds[1].revents != 0;
+			break;
+		}
+
+		ps_watch_refresh(&w, stdout);
+		if (w.root != 0 && ps_find(&w.tree, w.root) == -1) {
+			printf("%9.3f watched process %d exited\n", now_seconds() - w.start, w.root);
+			break;
+		}
+		if (every > 0 && w.refreshes % every == 0) {
+			int root = w.root == 0 ? w.tree.count : ps_find(&w.tree, w.root);
+			if (output_file != NULL) {
+				ps_write_tree(&w.tree, root, output_file);
+			} else {
+				printf("%9.3f snapshot, %d processes\n", now_seconds() - w.start, w.tree.count);
+				ps_write_text(stdout, &w.tree, root);
+			}
+			fflush(stdout);
+		}
+	}
+
+	// consume the Ctrl-C or the line that ended the watch
+	struct timespec no_wait = { 0, 0 };
+	while (sigtimedwait(&interrupt, NULL, &no_wait) == SIGINT)
+		;
+	if (pressed)
+		tcflush(STDIN_FILENO, TCIFLUSH);
+	if (interrupt_fd != -1)
+		close(interrupt_fd);
+	sigprocmask(SIG_SETMASK, &old_mask, NULL);
+
+	fprintf(stderr, "%lu refreshes, %lu events, %lu stat reads, %.3f ms per refresh\n",
+			w.refreshes, w.events, w.reads,
+			w.refreshes > 0 ? w.refresh_time / w.refreshes * 1e3 : 0.0);
+	ps_tree_free(&w.tree);
+	closedir(w.proc);
+	return SUCCESS;
+}
+
+/**
+ * psvis: draw the process tree of a PID. The tree comes from the kernel
+ * module when it can be loaded and from /proc otherwise.
+ * @return exit status for the shell
+ */
+int builtin_psvis(struct command_t *command) {
+	struct ps_tree tree;
+	char *end;
+
+	if (command->arg_count >= 3 && strcmp(command->args[1], "--watch") == 0)
+		return psvis_watch(command);
+	if (command->arg_count < 4) { // args ends with NULL
+		printf("Usage: psvis <PID> <output_file>\n");
+		printf("       psvis --watch [-i <ms>] [-n <refreshes>] [-s <every>] [PID [output_file]]\n");
+		printf("       output: .dot .gv .txt .json .svg, - for a list on stdout, else Graphviz\n");
+		return UNKNOWN;
+	}
+
+	pid_t pid = strtol(command->args[1], &end, 10);
+	const char *output_file = command->args[2];
+	if (*command->args[1] == '\0' || *end != '\0' || pid < 0) {
+		printf("psvis: %s: not a PID\n", command->args[1]);
+		return UNKNOWN;
+	}
+
+	bool tried = psvis_module_failed;
+	if (psvis_module_tree(pid, &tree) != 0) {
+		if (!tried)
+			fprintf(stderr, "psvis: kernel module unavailable, reading /proc from now on\n");
+		if (ps_tree_scan(&tree) != 0)
+			return UNKNOWN;
+	}
+
+	int root = pid == 0 ? tree.count : ps_find(&tree, pid);
+	if (root == -1) {
+		printf("Process with PID %d not found.\n", pid);
+		ps_tree_free(&tree);
+		return UNKNOWN;
+	}
+
+	int r = ps_write_tree(&tree, root, output_file);
+	ps_tree_free(&tree);
+	if (r != 0)
+		return UNKNOWN;
+	if (strcmp(output_file, "-") != 0)
+		printf("Process tree visualization saved to %s\n", output_file);
+	return SUCCESS;
+}
+
+/**
+ * cat and tee: data is moved inside the kernel where the fds allow it,
+ * with copy_file_range between files, sendfile out of files, splice and
+ * tee through pipes, and a large buffer otherwise.
+ */
+#define COPY_CHUNK (1 << 30) // per zero-copy call
+#define COPY_BUFFER_SIZE (1 << 20)
+
+bool zero_copy = true; // off to copy everything through a buffer
+
+// errors that mean the call cannot handle this pair of fds, not that copying failed
+static bool copy_unsupported(int error) {
+	return error == EINVAL || error == EXDEV || error == EOPNOTSUPP || error == ENOSYS ||
+		   error == EBADF || error == ESPIPE;
+}
+
+/**
+ * Copy through a buffer until EOF, stdin and stdout may be pipeline rings.
+ * @return 0 on success
+ */
+int copy_buffered(int in, int out) {
+	char *buf = malloc(COPY_BUFFER_SIZE);
+	ssize_t got;
+	int result = 0;
+
+	while ((got = read_input(in, buf, COPY_BUFFER_SIZE)) != 0) {
+		if (got < 0) {
+			if (errno == EINTR)
+				continue;
+			result = -1;
+			break;
+		}
+		if (write_all(out, buf, got) != 0) {
+			result = -1;
+			break;
+		}
+	}
+	free(buf);
+	return result;
+}
+
+/**
+ * Copy in to out until EOF without the data entering user space. The fds
+ * keep their offsets current, so a call that turns out not to work for
+ * this pair leaves the next method to carry on where it stopped.
+ * @return 0 when all was copied, 1 when no call handles these fds, -1 on error
+ */
+int copy_in_kernel(int in, int out, const struct stat *in_st, const struct stat *out_st) {
+	ssize_t n;
+
+	if (S_ISREG(in_st->st_mode) && S_ISREG(out_st->st_mode)) {
+		do
+			n = copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0);
+		while (n > 0 || (n == -1 && errno == EINTR));
+		if (n == 0)
+			return 0;
+		if (!copy_unsupported(errno))
+			return -1;
+	}
+	if (S_ISREG(in_st->st_mode)) {
+		do
+			n = sendfile(out, in, NULL, COPY_CHUNK);
+		while (n > 0 || (n == -1 && errno == EINTR));
+		if (n == 0)
+			return 0;
+		if (!copy_unsupported(errno))
+			return -1;
+	}
+	if (S_ISFIFO(in_st->st_mode) || S_ISFIFO(out_st->st_mode)) {
+		do
+			n = splice(in, NULL, out, NULL, COPY_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+		while (n > 0 || (n == -1 && errno == EINTR));
+		if (n == 0)
+			return 0;
+		if (!copy_unsupported(errno))
+			return -1;
+	}
+	return 1;
+}
+
+/**
+ * Copy in to out until EOF, in the kernel if possible.
+ * @return 0 on success
+ */
+int copy_fd(int in, int out) {
+	struct stat in_st, out_st;
+	int result = 1;
+
+	in = stage_fd(in);
+	out = stage_fd(out);
+	if (zero_copy && in != STAGE_RING && out != STAGE_RING && fstat(in, &in_st) == 0 &&
+		fstat(out, &out_st) == 0 && !(fcntl(out, F_GETFL) & O_APPEND)) {
+		// the zero-copy calls refuse O_APPEND, >> keeps its atomic appends with write
+		result = copy_in_kernel(in, out, &in_st, &out_st);
+	}
+	return result == 1 ? copy_buffered(in, out) : result;
+}
+
+/**
+ * cat without options, anything else is left to the cat in PATH
+ */
+bool cat_handles(struct command_t *command) {
+	for (int i = 1; command->args[i] != NULL; ++i)
+		if (command->args[i][0] == '-' && command->args[i][1] != '\0')
+			return false;
+	return true;
+}
+
+/**
+ * cat: concatenate files (- or none for stdin) to stdout
+ * @return exit status for the shell
+ */
+int builtin_cat(struct command_t *command) {
+	int argc = command->arg_count - 1; // args ends with NULL
+	char *stdin_only[] = { "cat", "-", NULL };
+	char **files = argc > 1 ? command->args : stdin_only;
+	struct stat out_st, in_st;
+	int status = SUCCESS;
+
+	fflush(stdout);
+	bool out_regular = fstat(stage_fd(STDOUT_FILENO), &out_st) == 0 && S_ISREG(out_st.st_mode);
+
+	for (int i = 1; files[i] != NULL; ++i) {
+		const char *name = files[i];
+		int in = STDIN_FILENO;
+
+		if (strcmp(name, "-") != 0 && (in = open(name, O_RDONLY | O_CLOEXEC)) == -1) {
+			fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+			status = UNKNOWN;
+			continue;
+		}
+		if (out_regular && fstat(stage_fd(in), &in_st) == 0 && in_st.st_dev == out_st.st_dev &&
+			in_st.st_ino == out_st.st_ino) {
+			fprintf(stderr, "cat: %s: input file is output file\n", name);
+			status = UNKNOWN;
+		} else if (copy_fd(in, STDOUT_FILENO) != 0) {
+			status = UNKNOWN;
+			if (errno == EPIPE) { // the reader is gone, as quiet as SIGPIPE
+				if (in != STDIN_FILENO)
+					close(in);
+				break;
+			}
+			fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+		}
+		if (in != STDIN_FILENO)
+			close(in);
+	}
+	return status;
+}
+
+/**
+ * tee with at most -a and --, anything else is left to the tee in PATH
+ */
+bool tee_handles(struct command_t *command) {
+	for (int i = 1; command->args[i] != NULL && strcmp(command->args[i], "--") != 0; ++i)
+		if (command->args[i][0] == '-' && command->args[i][1] != '\0' &&
+			strcmp(command->args[i], "-a") != 0)
+			return false;
+	return true;
+}
+
+/**
+ * tee: copy stdin to stdout and to every file. With pipes on both sides
+ * and one file, tee(2) duplicates the data into stdout and splice moves
+ * it on into the file. -a opens with O_APPEND and always copies by write.
+ * @return exit status for the shell
+ */
+int builtin_tee(struct command_t *command) {
+	int argc = command->arg_count - 1; // args ends with NULL
+	int fds[argc > 1 ? argc : 1];
+	const char *names[argc > 1 ? argc : 1];
+	int count = 0, status = SUCCESS;
+	bool append = false, options = true;
+
+	// like getopt, -a counts anywhere before --
+	for (int i = 1; i < argc && strcmp(command->args[i], "--") != 0; ++i)
+		if (strcmp(command->args[i], "-a") == 0)
+			append = true;
+
+	for (int i = 1; i < argc; ++i) {
+		if (options && strcmp(command->args[i], "--") == 0) {
+			options = false;
+			continue;
+		}
+		if (options && strcmp(command->args[i], "-a") == 0)
+			continue;
+		int fd = open(command->args[i],
+					  O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), 0666);
+		if (fd == -1) {
+			fprintf(stderr, "tee: %s: %s\n", command->args[i], strerror(errno));
+			status = UNKNOWN;
+			continue;
+		}
+		names[count] = command->args[i];
+		fds[count++] = fd;
+	}
+
+	fflush(stdout);
+	int in = stage_fd(STDIN_FILENO), out = stage_fd(STDOUT_FILENO);
+	struct stat in_st, out_st;
+	bool pipes = zero_copy && in != STAGE_RING && out != STAGE_RING &&
+				 fstat(in, &in_st) == 0 && S_ISFIFO(in_st.st_mode) &&
+				 fstat(out, &out_st) == 0 && S_ISFIFO(out_st.st_mode);
+	char *buf = NULL;
+	ssize_t n;
+
+	if (count == 0) {
+		if (copy_fd(STDIN_FILENO, STDOUT_FILENO) != 0 && errno != EPIPE)
+			status = UNKNOWN;
+	} else if (pipes && count == 1 && !append) { // splice refuses O_APPEND
+		while ((n = tee(in, out, COPY_CHUNK, 0)) != 0) {
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				if (errno != EPIPE)
+					fprintf(stderr, "tee: %s\n", strerror(errno));
+				status = UNKNOWN;
+				break;
+			}
+			// tee left the data in stdin, now move exactly that much into the file
+			while (n > 0) {
+				ssize_t moved = splice(in, NULL, fds[0], NULL, n, SPLICE_F_MOVE);
+				if (moved < 0 && errno == EINTR)
+					continue;
+				if (moved <= 0)
+					break;
+				n -= moved;
+			}
+			if (n > 0) {
+				fprintf(stderr, "tee: %s: %s\n", names[0], strerror(errno));
+				status = UNKNOWN;
+				break;
+			}
+		}
+	} else {
+		buf = malloc(COPY_BUFFER_SIZE);
+		while ((n = read_input(STDIN_FILENO, buf, COPY_BUFFER_SIZE)) != 0) {
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				status = UNKNOWN;
+				break;
+			}
+			// a closed stdout does not stop the files from being written
+			if (out != -1 && write_all(STDOUT_FILENO, buf, n) != 0) {
+				status = UNKNOWN;
+				out = -1;
+			}
+			for (int i = 0; i < count; ++i) {
+				if (fds[i] != -1 && write_all(fds[i], buf, n) != 0) {
+					fprintf(stderr, "tee: %s: %s\n", names[i], strerror(errno));
+					status = UNKNOWN;
+					close(fds[i]);
+					fds[i] = -1;
+				}
+			}
+		}
+	}
+
+	free(buf);
+	for (int i = 0; i < count; ++i)
+		if (fds[i] != -1)
+			close(fds[i]);
+	return status;
+}
+
+/**
+ * Apply the <, > and >> redirections of a command to the current process.
+ * @return 0 on success
+ */
+static const int redirect_flags[3] = { O_RDONLY, O_WRONLY | O_TRUNC | O_CREAT,
+									   O_WRONLY | O_APPEND | O_CREAT };
+
+int apply_redirects(struct command_t *command) {
+	for (int i = 0; i < 3; ++i) {
+		if (command->redirects[i] == NULL)
+			continue;
+
+		int fd = open(command->redirects[i], redirect_flags[i], 0666);
+		if (fd == -1) {
+			printf("-%s: %s: %s\n", sysname, command->redirects[i], strerror(errno));
+			return -1;
+		}
+		dup2(fd, i == 0 ? STDIN_FILENO : STDOUT_FILENO);
+		close(fd);
+	}
+	return 0;
+}
+
+/**
+ * Launch an external command with posix_spawn, a single vfork-style process
+ * with no address space copy. in_fd and out_fd (-1 for none) become its
+ * stdin and stdout, then the redirections of the command are opened.
+ * @return 0 on success, else the status it fails with: 127 if it is not
+ * found, 126 if it cannot be run
+ */
+int spawn_command(struct command_t *command, int in_fd, int out_fd, pid_t *pid) {
+	const char *full_path = resolve_command(command->name);
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t no_signals;
+	int r;
+
+	if (full_path == NULL) {
+		printf("-%s: %s: command not found\n", sysname, command->name);
+		return 127;
+	}
+
+	posix_spawn_file_actions_init(&actions);
+	if (in_fd != -1)
+		posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+	if (out_fd != -1)
+		posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+	if (command->redirects[0] != NULL)
+		posix_spawn_file_actions_addopen(&actions, STDIN_FILENO,
+										 command->redirects[0], O_RDONLY, 0);
+	if (command->redirects[1] != NULL)
+		posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, command->redirects[1],
+										 O_WRONLY | O_TRUNC | O_CREAT, 0666);
+	if (command->redirects[2] != NULL)
+		posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, command->redirects[2],
+										 O_WRONLY | O_APPEND | O_CREAT, 0666);
+
+	// the shell blocks SIGCHLD for its signalfd, the command starts without that
+	sigemptyset(&no_signals);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigmask(&attr, &no_signals);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+	double start = now_seconds();
+	r = posix_spawn(pid, full_path, &actions, &attr, command->args, environ);
+	stats.spawn_time += now_seconds() - start;
+	stats.spawns++;
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+
+	if (r != 0) {
+		printf("-%s: %s: %s\n", sysname, command->name, strerror(r));
+		return 126;
+	}
+	return 0;
+}
+
+/**
+ * exit [n]: unload the psvis kernel module if it is loaded and leave the
+ * shell with status n, or with the last command's status
+ */
+int builtin_exit(struct command_t *command) {
+	if (command->arg_count > 2) { // args ends with NULL
+		char *end;
+		long n = strtol(command->args[1], &end, 10);
+		if (command->args[1][0] == '\0' || *end != '\0') {
+			printf("-%s: exit: %s: numeric argument required\n", sysname, command->args[1]);
+			n = 2;
+		}
+		last_status = n & 0xff;
+	}
+
+	// Check if the kernel module is loaded
+	FILE *proc_modules = fopen("/proc/modules", "r");
+	if (!proc_modules) {
+		perror("Failed to open /proc/modules");
+		return EXIT;
+	}
+
+	bool module_loaded = false;
+	char line[256];
+	while (fgets(line, sizeof(line), proc_modules)) {
+		if (strstr(line, "mymodule") != NULL) {
+			module_loaded = true;
+			printf("Removing Kernel Module.\n");
 			break;
 		}
+	}
+	fclose(proc_modules);
+
+	// Remove the kernel module if it is loaded and exiting
+	if (module_loaded) {
+		if (system("sudo rmmod mymodule") != 0) {
+			perror("Failed to remove psvis kernel module");
+			return EXIT;
+		}
+	}
+
+	return EXIT;
+}
+
+/**
+ * cd: change the working directory of the shell
+ */
+int builtin_cd(struct command_t *command) {
+	int r;
+
+	if (command->arg_count > 1) {
+		r = chdir(command->args[1]);
+		if (r == -1) {
+			printf("-%s: cd: %s\n", sysname, strerror(errno));
+		}
+		return SUCCESS;
+	} else {
+		printf("-%s: cd: missing argument\n", sysname);
+		return SUCCESS;
+	}
+}
+
+const struct builtin *find_builtin(const char *name) {
+	for (int i = 0; builtins[i].name != NULL; ++i)
+		if (builtins[i].run != NULL && strcmp(builtins[i].name, name) == 0)
+			return &builtins[i];
+	return NULL;
+}
+
+/**
+ * The builtin that runs this command, or NULL when it is a program, including
+ * the forms of a builtin that only the program in PATH supports.
+ */
+const struct builtin *command_builtin(struct command_t *command) {
+	const struct builtin *builtin = find_builtin(command->name);
+	if (builtin != NULL && builtin->handles != NULL && !builtin->handles(command))
+		return NULL;
+	return builtin;
+}
+
+/**
+ * Run a builtin in the shell process. Its redirections are applied to
+ * stdin and stdout for the duration of the call, the originals are kept
+ * in saved fds and put back afterwards.
+ * @return exit status of the builtin
+ */
+int run_builtin(const struct builtin *builtin, struct command_t *command) {
+	int saved[2] = { -1, -1 };
+	int code = UNKNOWN;
+	sigset_t pipe_signal, old_mask;
+	struct timespec no_wait = { 0, 0 };
+
+	// a reader that went away makes writes fail with EPIPE instead of killing the shell
+	sigemptyset(&pipe_signal);
+	sigaddset(&pipe_signal, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &pipe_signal, &old_mask);
+
+	fflush(stdout);
+	for (int i = 0; i < 3; ++i) {
+		int fd = i == 0 ? STDIN_FILENO : STDOUT_FILENO;
+		if (command->redirects[i] != NULL && saved[fd] == -1)
+			saved[fd] = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+	}
+
+	if (apply_redirects(command) == 0)
+		code = builtin->run(command);
+
+	fflush(stdout);
+	for (int fd = 0; fd < 2; ++fd) {
+		if (saved[fd] != -1) {
+			dup2(saved[fd], fd);
+			close(saved[fd]);
+		}
+	}
+
+	// drop the SIGPIPEs raised meanwhile, unblocking would deliver them
+	while (sigtimedwait(&pipe_signal, NULL, &no_wait) == SIGPIPE)
+		;
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+	return code;
+}
+
+/**
+ * Run a builtin in a forked child, for pipeline stages and background
+ * jobs. in_fd and out_fd are used as in spawn_command.
+ * @return 0 on success
+ */
+int spawn_builtin(const struct builtin *builtin, struct command_t *command, int in_fd,
+				  int out_fd, pid_t *pid) {
+	fflush(stdout); // or the child writes the shell's pending output again
+
+	double start = now_seconds();
+	*pid = fork();
+	if (*pid == 0) {
+		sigprocmask(SIG_UNBLOCK, &job_sigset, NULL);
+		if (in_fd != -1)
+			dup2(in_fd, STDIN_FILENO);
+		if (out_fd != -1)
+			dup2(out_fd, STDOUT_FILENO);
+		// a stage still holding the read end of its own pipe would never see EPIPE
+		close_range(3, ~0U, 0);
+		if (apply_redirects(command) != 0)
+			exit(EXIT_FAILURE);
+		exit(builtin->run(command));
+	}
+	stats.fork_time += now_seconds() - start;
+	stats.forks++;
+
+	if (*pid < 0) {
+		perror("Fork failed");
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * A builtin pipeline stage running as a thread of the shell. It owns the
+ * ends of its io: rings are closed and fds are closed when it returns.
+ */
+struct stage_thread {
+	const struct builtin *builtin;
+	struct command_t *command;
+	struct stage_io io;
+	struct stage_usage *usage;
+	double start;
+	bool started;
+	pthread_t thread;
+};
+
+bool pipeline_threads = true; // off to run every stage as a process
+
+void stage_io_release(struct stage_io *io) {
+	if (io->in != NULL)
+		ring_abandon(io->in);
+	if (io->out != NULL)
+		ring_close(io->out);
+	if (io->in_fd != -1)
+		close(io->in_fd);
+	if (io->out_fd != -1)
+		close(io->out_fd);
+	io->in = io->out = NULL;
+	io->in_fd = io->out_fd = -1;
+}
+
+/**
+ * Open the redirections of a thread stage in place of its pipeline io.
+ * @return 0 on success
+ */
+int stage_redirects(struct command_t *command, struct stage_io *io) {
+	for (int i = 0; i < 3; ++i) {
+		if (command->redirects[i] == NULL)
+			continue;
+
+		int fd = open(command->redirects[i], redirect_flags[i] | O_CLOEXEC, 0666);
+		if (fd == -1) {
+			printf("-%s: %s: %s\n", sysname, command->redirects[i], strerror(errno));
+			return -1;
+		}
+		struct stage_io replaced = { NULL, NULL, -1, -1 };
+		if (i == 0) {
+			replaced.in = io->in;
+			replaced.in_fd = io->in_fd;
+			io->in = NULL;
+			io->in_fd = fd;
+		} else {
+			replaced.out = io->out;
+			replaced.out_fd = io->out_fd;
+			io->out = NULL;
+			io->out_fd = fd;
+		}
+		stage_io_release(&replaced);
+	}
+	return 0;
+}
 
-		free_command(command);
-	}
+void *stage_thread_main(void *arg) {
+	struct stage_thread *t = arg;
+	sigset_t pipe_signal;
 
-	printf("\n");
+	// writing to a pipe nobody reads fails with EPIPE instead of killing the shell
+	sigemptyset(&pipe_signal);
+	sigaddset(&pipe_signal, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &pipe_signal, NULL);
+
+	stage_io = &t->io;
+	int code = t->builtin->run(t->command);
+	stage_io = NULL;
+	stage_io_release(&t->io);
+
+	getrusage(RUSAGE_THREAD, &t->usage->usage);
+	t->usage->wall = now_seconds() - t->start;
+	t->usage->status = code << 8;
+	return NULL;
+}
+
+/**
+ * Start a thread stage. Its io is released if it cannot start.
+ * @return 0 on success
+ */
+int start_stage_thread(struct stage_thread *t) {
+	memset(t->usage, 0, sizeof(*t->usage));
+	t->usage->command = t->command;
+	t->usage->status = UNKNOWN << 8;
+	t->started = stage_redirects(t->command, &t->io) == 0 &&
+				 pthread_create(&t->thread, NULL, stage_thread_main, t) == 0;
+	if (!t->started) {
+		stage_io_release(&t->io);
+		return -1;
+	}
 	return 0;
 }
 
-int process_command(struct command_t *command) {
-	int r;
+/**
+ * parallel: run a command template once per argument with up to -j
+ * children at a time. Each job's stdout goes to its own pipe and is
+ * printed in one piece when the job ends, so outputs never interleave.
+ */
+struct parallel_job {
+	pid_t pid; // 0 once reaped
+	int fd; // read end of the output pipe, -1 at EOF
+	int status;
+	const char *arg;
+	char *out;
+	size_t used, capacity;
+};
 
-	if (strcmp(command->name, "") == 0) {
-		return SUCCESS;
+/**
+ * Build the argv for one argument: every {} in the template is replaced,
+ * without any the argument is appended.
+ */
+char **parallel_args(char **template, int count, const char *arg) {
+	char **args = calloc(count + 2, sizeof(char *));
+	bool placed = false;
+
+	for (int i = 0; i < count; ++i) {
+		const char *t = template[i], *hole;
+		size_t len = strlen(t) + 1;
+		for (hole = strstr(t, "{}"); hole != NULL; hole = strstr(hole + 2, "{}"))
+			len += strlen(arg);
+
+		char *p = args[i] = malloc(len);
+		while ((hole = strstr(t, "{}")) != NULL) {
+			memcpy(p, t, hole - t);
+			p += hole - t;
+			p = stpcpy(p, arg);
+			t = hole + 2;
+			placed = true;
+		}
+		strcpy(p, t);
 	}
+	if (!placed)
+		args[count] = strdup(arg);
+	return args;
+}
 
-	if (strcmp(command->name, "exit") == 0) {
-
+/**
+ * Read the whole of fd and split it into lines in place.
+ * @return number of lines, *lines and *data are malloc'd
+ */
+int read_lines(int fd, char ***lines, char **data) {
+	size_t used = 0, capacity = 64 << 10;
+	char *buf = malloc(capacity);
+	ssize_t got;
+	int count = 0, capacity_lines = 64;
+
+	while ((got = read(fd, buf + used, capacity - used - 1)) != 0) {
+		if (got < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		used += got;
+		if (capacity - used < 2)
+			buf = realloc(buf, capacity *= 2);
+	}
+	buf[used] = '\0';
+
+	*lines = malloc(capacity_lines * sizeof(char *));
+	for (char *p = buf; p < buf + used;) {
+		char *eol = memchr(p, '\n', buf + used - p);
+		if (eol == NULL)
+			eol = buf + used;
+		*eol = '\0';
+		if (eol > p) {
+			if (count == capacity_lines)
+				*lines = realloc(*lines, (capacity_lines *= 2) * sizeof(char *));
+			(*lines)[count++] = p;
+		}
+		p = eol + 1;
+	}
+	*data = buf;
+	return count;
+}
 
-		// Check if the kernel module is loaded
-		FILE *proc_modules = fopen("/proc/modules", "r");
-		if (!proc_modules) {
-			perror("Failed to open /proc/modules");
-			return EXIT;
+/**
+ * parallel [-j N] command [args with {}] [::: arg ...]: arguments come
+ * after ::: or one per line from stdin.
+ */
+int builtin_parallel(struct command_t *command) {
+	int argc = command->arg_count - 1; // args ends with NULL
+	long slots = sysconf(_SC_NPROCESSORS_ONLN);
+	int first = 1, separator = argc;
+	char **inputs, *input_data = NULL;
+	int input_count;
+
+	if (argc > 2 && strcmp(command->args[1], "-j") == 0) {
+		char *end;
+		errno = 0;
+		slots = strtol(command->args[2], &end, 10);
+		if (end == command->args[2] || *end != '\0' || errno == ERANGE)
+			slots = 0;
+		first = 3;
+	}
+	for (int i = first; i < argc; ++i) {
+		if (strcmp(command->args[i], ":::") == 0) {
+			separator = i;
+			break;
 		}
+	}
+	if (slots < 1 || separator == first) {
+		printf("Usage: parallel [-j N] command [args with {}] [::: arg ...]\n");
+		return UNKNOWN;
+	}
+	if (resolve_command(command->args[first]) == NULL) {
+		printf("-%s: %s: command not found\n", sysname, command->args[first]);
+		return UNKNOWN;
+	}
 
-		bool module_loaded = false;
-		char line[256];
-		while (fgets(line, sizeof(line), proc_modules)) {
-			if (strstr(line, "mymodule") != NULL) {
-				module_loaded = true;
-				printf("Removing Kernel Module.\n");
+	if (separator < argc) {
+		inputs = command->args + separator + 1;
+		input_count = argc - separator - 1;
+	} else {
+		input_count = read_lines(STDIN_FILENO, &inputs, &input_data);
+	}
+	fflush(stdout);
+
+	if (slots > input_count)
+		slots = input_count > 0 ? input_count : 1;
+	struct parallel_job *running = calloc(slots, sizeof(struct parallel_job));
+	struct pollfd *fds = malloc((slots + 1) * sizeof(struct pollfd));
+	int next = 0, active = 0, failed = 0;
+	double start = now_seconds();
+
+	while (next < input_count || active > 0) {
+		// feed new jobs into the free slots
+		for (int s = 0; s < slots && next < input_count; ++s) {
+			struct parallel_job *job = &running[s];
+			if (job->arg != NULL)
+				continue;
+
+			int pipefd[2];
+			if (pipe2(pipefd, O_CLOEXEC) == -1) {
+				perror("Pipe failed");
+				next = input_count;
 				break;
 			}
+			fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
+			const char *arg = inputs[next++];
+			struct command_t job_command = { 0 };
+			job_command.args = parallel_args(command->args + first, separator - first, arg);
+			job_command.name = job_command.args[0];
+
+			job->arg = arg;
+			job->used = 0;
+			if (spawn_command(&job_command, -1, pipefd[1], &job->pid) == 0) {
+				job->fd = pipefd[0];
+				active++;
+			} else {
+				job->arg = NULL;
+				job->pid = 0;
+				close(pipefd[0]);
+				failed++;
+			}
+			close(pipefd[1]);
+			for (int i = 0; job_command.args[i] != NULL; ++i)
+				free(job_command.args[i]);
+			free(job_command.args);
 		}
-		fclose(proc_modules);
+		if (active == 0)
+			continue;
 
-		// Remove the kernel module if it is loaded and exiting
-		if (module_loaded) {
-			if (system("sudo rmmod mymodule") != 0) {
-				perror("Failed to remove psvis kernel module");
-				return EXIT;
+		int count = 0;
+		for (int s = 0; s < slots; ++s)
+			if (running[s].arg != NULL && running[s].fd != -1)
+				fds[count++] = (struct pollfd){ running[s].fd, POLLIN, 0 };
+		fds[count++] = (struct pollfd){ job_sigfd, POLLIN, 0 };
+		if (poll(fds, count, -1) == -1 && errno != EINTR)
+			break;
+		jobs_reap();
+
+		for (int s = 0; s < slots; ++s) {
+			struct parallel_job *job = &running[s];
+			if (job->arg == NULL)
+				continue;
+
+			// collect output until EOF
+			while (job->fd != -1) {
+				if (job->capacity - job->used < 4096)
+					job->out = realloc(job->out, job->capacity = 2 * job->capacity + 4096);
+				ssize_t got = read(job->fd, job->out + job->used, job->capacity - job->used);
+				if (got > 0) {
+					job->used += got;
+					continue;
+				}
+				if (got == -1 && (errno == EINTR || errno == EAGAIN))
+					break;
+				close(job->fd);
+				job->fd = -1;
+			}
+			if (job->pid != 0 && child_exited(job->pid, &job->status, NULL, NULL))
+				job->pid = 0;
+			if (job->pid != 0 || job->fd != -1)
+				continue;
+
+			// done, print its output in one piece
+			write_all(STDOUT_FILENO, job->out, job->used);
+			if (!WIFEXITED(job->status) || WEXITSTATUS(job->status) != 0) {
+				char state[64];
+				describe_status(job->status, state, sizeof(state));
+				fprintf(stderr, "parallel: %s: %s\n", job->arg, state);
+				failed++;
 			}
+			job->arg = NULL;
+			active--;
 		}
+	}
 
-		return EXIT;
+	double elapsed = now_seconds() - start;
+	fprintf(stderr, "parallel: %d jobs in %.2fs, %.1f jobs/s, %d failed\n", input_count,
+			elapsed, elapsed > 0 ? input_count / elapsed : 0, failed);
+
+	for (int s = 0; s < slots; ++s)
+		free(running[s].out);
+	free(running);
+	free(fds);
+	if (input_data != NULL) {
+		free(inputs);
+		free(input_data);
+	}
+	return failed == 0 ? SUCCESS : UNKNOWN;
+}
+
+
+/**
+ * bench spawn [runs [MB]]: launch latency of the old double fork + execv path
+ * against posix_spawn, optionally with MB of touched memory in the shell
+ */
+int bench_spawn(int argc, char **args) {
+	int runs = argc > 2 ? atoi(args[2]) : 1000;
+	size_t ballast_size = argc > 3 ? (size_t)atoi(args[3]) << 20 : 0;
+	char *ballast = NULL;
+	char *true_args[] = { "true", NULL };
+	const char *true_path = resolve_command("true");
+
+	if (runs <= 0 || true_path == NULL) {
+		printf("Usage: bench spawn [runs [MB]]\n");
+		return UNKNOWN;
 	}
 
-	if (strcmp(command->name, "cd") == 0) {
-		
+	// a bigger shell makes every fork copy more page tables
+	if (ballast_size > 0) {
+		ballast = malloc(ballast_size);
+		if (ballast != NULL)
+			memset(ballast, 1, ballast_size);
+	}
 
-		if (command->arg_count > 1) {
-			r = chdir(command->args[1]);
-			if (r == -1) {
-				printf("-%s: cd: %s\n", sysname, strerror(errno));
+	double start = now_seconds();
+	for (int i = 0; i < runs; ++i) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			pid_t pid2 = fork();
+			if (pid2 == 0) {
+				execv(true_path, true_args);
+				_exit(EXIT_FAILURE);
 			}
-			return SUCCESS;
-		} else {
-			printf("-%s: cd: missing argument\n", sysname);
-			return SUCCESS;
+			waitpid(pid2, NULL, 0);
+			_exit(SUCCESS);
 		}
+		waitpid(pid, NULL, 0);
 	}
+	double forked = now_seconds() - start;
 
-	
+	start = now_seconds();
+	for (int i = 0; i < runs; ++i) {
+		pid_t pid;
+		if (posix_spawn(&pid, true_path, NULL, NULL, true_args, environ) == 0)
+			waitpid(pid, NULL, 0);
+	}
+	double spawned = now_seconds() - start;
+
+	printf("double fork + execv: %d runs, %.1f us/command, %.0f commands/s\n", runs,
+		   forked / runs * 1e6, runs / forked);
+	printf("posix_spawn:         %d runs, %.1f us/command, %.0f commands/s\n", runs,
+		   spawned / runs * 1e6, runs / spawned);
+	free(ballast);
+	return SUCCESS;
+}
 
+/**
+ * bench kuhex <file> [threads]: kuhex throughput to /dev/null with 1 to
+ * threads formatting threads
+ */
+int bench_kuhex(int argc, char **args) {
+	int max_threads = argc > 3 ? atoi(args[3]) : sysconf(_SC_NPROCESSORS_ONLN);
+	struct stat st;
+	double serial = 0;
+
+	if (argc < 3 || stat(args[2], &st) != 0 || max_threads < 1) {
+		printf("Usage: bench kuhex <file> [threads]\n");
+		return UNKNOWN;
+	}
 
+	int null_fd = open("/dev/null", O_WRONLY);
+	for (int threads = 1; threads <= max_threads; ++threads) {
+		struct kuhex_options options = { 1, 0, ULLONG_MAX, threads, null_fd };
+		double start = now_seconds();
+		if (kuhex_dump(args[2], &options) != 0)
+			break;
+		double elapsed = now_seconds() - start;
+		if (threads == 1)
+			serial = elapsed;
+		printf("%3d threads: %.3f s, %.2f GB/s input, speedup %.2fx\n", threads,
+			   elapsed, st.st_size / elapsed / 1e9, serial / elapsed);
+	}
+	close(null_fd);
+	return SUCCESS;
+}
 
+/**
+ * bench jobs [count]: launch count background jobs of true through the job
+ * table, then reap them all
+ */
+int bench_jobs(int argc, char **args) {
+	int count = argc > 2 ? atoi(args[2]) : 1000;
+	char *true_args[] = { "true", NULL };
+	struct command_t command = { .name = "true", .arg_count = 2, .args = true_args };
+	struct job **started;
+	int started_count = 0;
+
+	if (count <= 0) {
+		printf("Usage: bench jobs [count]\n");
+		return UNKNOWN;
+	}
 
-	// Handle piping
-	if (command->next != NULL) { 
-		struct command_t *current_command = command;
-		int pipefd[2];
-		int prev_pipe_read_end = -1; // To store the read end of the previous pipe
+	started = malloc(count * sizeof(struct job *));
+	double start = now_seconds();
+	for (int i = 0; i < count; ++i) {
 		pid_t pid;
+		if (spawn_command(&command, -1, -1, &pid) != 0)
+			break;
+		started[started_count++] = job_add("true", &pid, 1);
+	}
+	double launched = now_seconds() - start;
+
+	for (int i = 0; i < started_count; ++i)
+		job_wait(started[i]);
+	double total = now_seconds() - start;
+
+	int zombies = 0;
+	for (int i = 0; i < started_count; ++i)
+		if (kill(started[i]->last_pid, 0) == 0)
+			zombies++; // still exists after being reaped
+	jobs_collect(false);
+	free(started);
+
+	printf("%d jobs: launch %.1f us/job, launch + reap %.1f us/job, %d left unreaped\n",
+		   started_count, launched / started_count * 1e6, total / started_count * 1e6,
+		   zombies);
+	return SUCCESS;
+}
 
-		while (current_command != NULL) {
-			if (current_command->next != NULL) {
-				// create a pipe for the current command
-				if (pipe(pipefd) == -1) {
-					perror("Pipe failed");
-					return UNKNOWN;
-				}
-			}
+/**
+ * bench script [lines]: startup time of a non-interactive dash and the
+ * rate it runs a script of cd . lines at
+ */
+int bench_script(int argc, char **args) {
+	int lines = argc > 2 ? atoi(args[2]) : 100000;
+	char path[] = "/tmp/dash-bench-XXXXXX";
+	char *empty_args[] = { "dash", "/dev/null", NULL };
+	char *script_args[] = { "dash", path, NULL };
+	const int runs = 20;
+	pid_t pid;
+
+	if (lines <= 0) {
+		printf("Usage: bench script [lines]\n");
+		return UNKNOWN;
+	}
 
-			pid = fork();
-			if (pid == 0) { // child process
-				
-				// if there's a previous pipe, connect its read end to stdin
-				if (prev_pipe_read_end != -1) {
-					dup2(prev_pipe_read_end, STDIN_FILENO);
-					close(prev_pipe_read_end);
-				}
+	double start = now_seconds();
+	for (int i = 0; i < runs; ++i)
+		if (posix_spawn(&pid, "/proc/self/exe", NULL, NULL, empty_args, environ) == 0)
+			wait_child(pid);
+	double startup = (now_seconds() - start) / runs;
 
-				// if there's a next command, connect stdout to the write end of the current pipe
-				if (current_command->next != NULL) {
-					dup2(pipefd[1], STDOUT_FILENO);
-					close(pipefd[1]);
-					close(pipefd[0]);
-				}
+	int fd = mkstemp(path);
+	if (fd == -1) {
+		perror("mkstemp");
+		return UNKNOWN;
+	}
+	char *text = malloc((size_t)lines * 5);
+	for (int i = 0; i < lines; ++i)
+		memcpy(text + (size_t)i * 5, "cd .\n", 5);
+	write_all(fd, text, (size_t)lines * 5);
+	close(fd);
+	free(text);
+
+	start = now_seconds();
+	if (posix_spawn(&pid, "/proc/self/exe", NULL, NULL, script_args, environ) == 0)
+		wait_child(pid);
+	double elapsed = now_seconds() - start - startup;
+	unlink(path);
+
+	printf("startup: %.2f ms\n", startup * 1e3);
+	printf("%d lines: %.3f s, %.0f lines/s\n", lines, elapsed, lines / elapsed);
+	return SUCCESS;
+}
 
-				// execute the current command
-				char *path = getenv("PATH");
-				char *dir = strtok(path, ":");
-				char full_path[1024];
-				while (dir != NULL) {
-					snprintf(full_path, sizeof(full_path), "%s/%s", dir, current_command->name);
-					if (access(full_path, X_OK) == 0) {
-						execv(full_path, current_command->args);
-						break;
-					}
-					dir = strtok(NULL, ":");
-				}
-				perror("Command execution failed");
-				exit(EXIT_FAILURE);
 
-			} else if (pid > 0) { // parent process
-				
-				if (current_command->next != NULL) {
-					close(pipefd[1]);
-				}
+/**
+ * bench parse [runs]: parser throughput on a short line, a 100 stage
+ * pipeline and a 1000 argument command
+ */
+int bench_parse(int argc, char **args) {
+	int runs = argc > 2 ? atoi(args[2]) : 2000;
+	char *pipeline = malloc(8192), *arguments = malloc(16384), *p;
+	struct {
+		const char *name;
+		const char *line;
+		int runs;
+	} cases[] = { { "short", "ls -la /tmp > out.txt", 100 * runs },
+				  { "pipeline x100", pipeline, runs },
+				  { "args x1000", arguments, runs } };
+	struct arena arena = { NULL };
+
+	if (runs <= 0) {
+		printf("Usage: bench parse [runs]\n");
+		return UNKNOWN;
+	}
 
-				if (prev_pipe_read_end != -1) {
-					close(prev_pipe_read_end);
-				}
+	p = pipeline;
+	for (int i = 0; i < 100; ++i)
+		p += sprintf(p, "%sgrep -v pattern%d file%d", i > 0 ? " | " : "", i, i);
+	p = arguments + sprintf(arguments, "echo");
+	for (int i = 0; i < 1000; ++i)
+		p += sprintf(p, " argument%d", i);
+	sprintf(p, " > out.txt");
+
+	for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); ++c) {
+		size_t len = strlen(cases[c].line) + 1;
+		double start = now_seconds();
+		for (int i = 0; i < cases[c].runs; ++i) {
+			// the parser splits in place, so each run gets a fresh copy
+			char *line = arena_alloc(&arena, len);
+			memcpy(line, cases[c].line, len);
+			parse_command(&arena, line);
+			arena_reset(&arena);
+		}
+		double elapsed = now_seconds() - start;
+		printf("%-14s %8.2f us/line, %6.0f MB/s\n", cases[c].name,
+			   elapsed / cases[c].runs * 1e6, len * (double)cases[c].runs / elapsed / 1e6);
+	}
 
-				// move to the next command and update prev_pipe_read_end
-				prev_pipe_read_end = pipefd[0];
-				current_command = current_command->next;
-			} else {
-				perror("Fork failed");
-				return UNKNOWN;
-			}
+	free(arena.head);
+	free(pipeline);
+	free(arguments);
+	return SUCCESS;
+}
+
+/**
+ * bench psvis [runs] [nodes]: /proc scan of all processes and DOT output of the
+ * whole tree to /dev/null, a watch refresh, then the SVG of a made up tree
+ */
+int bench_psvis(int argc, char **args) {
+	int runs = argc > 2 ? atoi(args[2]) : 20;
+	int nodes = argc > 3 ? atoi(args[3]) : 100000;
+	struct ps_tree tree;
+	double scan = 0, write = 0;
+
+	if (runs <= 0 || nodes <= 0) {
+		printf("Usage: bench psvis [runs] [nodes]\n");
+		return UNKNOWN;
+	}
+
+	for (int i = 0; i < runs; ++i) {
+		double start = now_seconds();
+		if (ps_tree_scan(&tree) != 0)
+			return UNKNOWN;
+		scan += now_seconds() - start;
+
+		start = now_seconds();
+		FILE *out = fopen("/dev/null", "w");
+		ps_write_dot(out, &tree, tree.count);
+		fclose(out);
+		write += now_seconds() - start;
+		if (i < runs - 1)
+			ps_tree_free(&tree);
+	}
+
+	// a watch refresh with the tree already known
+	struct ps_watch w;
+	memset(&w, 0, sizeof(w));
+	w.tree = tree;
+	w.proc = opendir("/proc");
+	FILE *events = fopen("/dev/null", "w");
+	for (int i = 0; w.proc != NULL && events != NULL && i < runs; ++i)
+		ps_watch_refresh(&w, events);
+	if (events != NULL)
+		fclose(events);
+	if (w.proc != NULL)
+		closedir(w.proc);
+
+	printf("%d processes: scan %.2f ms (%.2f us/process), DOT %.2f ms\n", tree.count,
+		   scan / runs * 1e3, scan / runs / tree.count * 1e6, write / runs * 1e3);
+	printf("watch refresh %.3f ms, %.1f stat reads\n",
+		   w.refreshes > 0 ? w.refresh_time / w.refreshes * 1e3 : 0.0,
+		   w.refreshes > 0 ? (double)w.reads / w.refreshes : 0.0);
+	ps_tree_free(&w.tree);
+
+	// SVG of a made up tree, every process under a random earlier one
+	unsigned seed = 304;
+	memset(&tree, 0, sizeof(tree));
+	tree.procs = malloc(sizeof(struct ps_process) * nodes);
+	tree.count = nodes;
+	for (int i = 0; i < nodes; ++i) {
+		tree.procs[i] = (struct ps_process){ i + 1, i > 0 ? 1 + rand_r(&seed) % i : 0, 'S', 0,
+											 "" };
+		snprintf(tree.procs[i].comm, PS_COMM_MAX, "proc%d", rand_r(&seed) % 1000);
+	}
+	ps_tree_index(&tree);
+	char path[] = "/tmp/dash-bench-XXXXXX.svg";
+	int fd = mkstemps(path, 4);
+	FILE *out = fd != -1 ? fdopen(fd, "w") : NULL;
+	if (out == NULL) {
+		perror("bench: svg");
+		ps_tree_free(&tree);
+		return UNKNOWN;
+	}
+	setvbuf(out, NULL, _IOFBF, 1 << 20);
+	double start = now_seconds();
+	ps_write_svg(out, &tree, tree.count);
+	fflush(out);
+	double svg = now_seconds() - start;
+	long size = ftell(out);
+	fclose(out);
+	unlink(path);
+	printf("%d process tree: SVG %.1f ms, %.1f MB\n", nodes, svg * 1e3, size / 1e6);
+	ps_tree_free(&tree);
+	return SUCCESS;
+}
+
+/**
+ * bench glob [files]: expand patterns over a fresh directory of files,
+ * first with the listing read and then from the cache
+ */
+int bench_glob(int argc, char **args) {
+	int files = argc > 2 ? atoi(args[2]) : 100000;
+	char dir[] = "/tmp/dash-bench-XXXXXX";
+	char path[PATH_MAX];
+	struct arena arena = { NULL };
+	const char *patterns[] = { "*", "*.log", "file1234*", "*[0-9]7.log", "**/*.log" };
+
+	if (files <= 0 || mkdtemp(dir) == NULL) {
+		printf("Usage: bench glob [files]\n");
+		return UNKNOWN;
+	}
+	for (int i = 0; i < files; ++i) {
+		snprintf(path, sizeof(path), "%s/file%d.%s", dir, i, i % 2 ? "log" : "txt");
+		close(open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0666));
+	}
+
+	for (size_t c = 0; c < sizeof(patterns) / sizeof(patterns[0]); ++c) {
+		char pattern[PATH_MAX];
+		char **matches;
+		snprintf(pattern, sizeof(pattern), "%s/%s", dir, patterns[c]);
+
+		double times[2];
+		size_t count = 0;
+		for (int run = 0; run < 2; ++run) {
+			if (run == 0) // drop the cached listing
+				utimensat(AT_FDCWD, dir, NULL, 0);
+			double start = now_seconds();
+			count = glob_expand(&arena, pattern, &matches);
+			times[run] = now_seconds() - start;
+			arena_reset(&arena);
 		}
+		printf("%-12s %7zu matches, %8.2f ms cold, %8.2f ms cached\n", patterns[c], count,
+			   times[0] * 1e3, times[1] * 1e3);
+	}
 
-		// wait for all child processes to finish
-		while (wait(NULL) > 0);
-		return SUCCESS;
+	for (int i = 0; i < files; ++i) {
+		snprintf(path, sizeof(path), "%s/file%d.%s", dir, i, i % 2 ? "log" : "txt");
+		unlink(path);
 	}
-	
-	
+	rmdir(dir);
+	free(arena.head);
+	return SUCCESS;
+}
 
-	
+/**
+ * bench builtin [runs]: a small kuhex with its output redirected to
+ * /dev/null, run in the shell against run in a forked child
+ */
+int bench_builtin(int argc, char **args) {
+	int runs = argc > 2 ? atoi(args[2]) : 2000;
+	char *kuhex_args[] = { "kuhex", "-n", "64", "-j", "1", "/proc/self/exe", NULL };
+	struct command_t command = { .name = "kuhex", .arg_count = 7, .args = kuhex_args,
+								 .redirects = { NULL, "/dev/null", NULL } };
+	const struct builtin *kuhex = find_builtin("kuhex");
+
+	if (runs <= 0) {
+		printf("Usage: bench builtin [runs]\n");
+		return UNKNOWN;
+	}
 
-	pid_t pid = fork();
-	// child
-	if (pid == 0) {
+	double start = now_seconds();
+	for (int i = 0; i < runs; ++i)
+		run_builtin(kuhex, &command);
+	double in_shell = now_seconds() - start;
 
-		
+	start = now_seconds();
+	for (int i = 0; i < runs; ++i) {
+		pid_t pid;
+		if (spawn_builtin(kuhex, &command, -1, -1, &pid) == 0)
+			wait_child(pid);
+	}
+	double forked = now_seconds() - start;
 
-		int fd_read;
-		int fd_write;
-		int fd_append;
+	printf("in the shell: %d runs, %.1f us/command\n", runs, in_shell / runs * 1e6);
+	printf("forked:       %d runs, %.1f us/command, %.1f us fork overhead\n", runs,
+		   forked / runs * 1e6, (forked - in_shell) / runs * 1e6);
+	return SUCCESS;
+}
 
-		// open read redirect file if exists
-		if (command->redirects[0] != NULL) {
-			fd_read = open(command->redirects[0], O_RDONLY);
-			if (fd_read == EXIT) {
-				perror("failed to open input redirect file");
-				exit(EXIT);
-			}
-		}
+int execute_command(struct command_t *command, struct stage_usage *stages, int *waited);
 
-		// open write redirect file if exists
-		if (command->redirects[1] != NULL) {
-			fd_write = open(command->redirects[1], O_WRONLY | O_TRUNC | O_CREAT, 0666);
-			if (fd_write == EXIT) {
-				perror("failed to open write redirect file");
-				exit(EXIT);
-			}
-		}
+/**
+ * bench pipeline <file> [stages]: a kuhex dump piped through stages - 1
+ * alternating kuhex -r - and kuhex - stages into /dev/null, with the
+ * builtin stages as threads and rings against one process and pipe each
+ */
+int bench_pipeline(int argc, char **args) {
+	int stages = argc > 3 ? atoi(args[3]) : 2;
+	struct stage_usage usage[MAX_STAGES];
+	struct arena arena = { NULL };
+	struct stat st;
+	double elapsed[2];
+
+	if (argc < 3 || stat(args[2], &st) != 0 || stages < 2 || stages > 64) {
+		printf("Usage: bench pipeline <file> [stages]\n");
+		return UNKNOWN;
+	}
 
-		// open append redirect file if exists
-		if (command->redirects[2] != NULL) {
-			fd_append = open(command->redirects[2], O_WRONLY | O_APPEND | O_CREAT, 0666);
-			if (fd_append == EXIT) {
-				perror("failed to open append redirect file");
-				exit(EXIT);
-			}
-		}
+	size_t len = strlen(args[2]) + 32 * stages;
+	char *line = malloc(len), *p = line;
+	p += sprintf(p, "kuhex -j 1 %s", args[2]);
+	for (int i = 1; i < stages; ++i)
+		p += sprintf(p, i % 2 == 1 ? " | kuhex -r -" : " | kuhex -");
+	sprintf(p, " > /dev/null");
+
+	for (int threads = 1; threads >= 0; --threads) {
+		// parsing splits the line in place, so each run gets a fresh copy
+		char *copy = arena_alloc(&arena, len);
+		int waited = 0;
+		strcpy(copy, line);
+		struct command_t *command = parse_command(&arena, copy);
+
+		pipeline_threads = threads;
+		double start = now_seconds();
+		execute_command(command, usage, &waited);
+		elapsed[threads] = now_seconds() - start;
+		arena_reset(&arena);
+	}
+	pipeline_threads = true;
+
+	printf("%s\n", line);
+	printf("threads + rings:   %.3f s, %.0f MB/s input\n", elapsed[1],
+		   st.st_size / elapsed[1] / 1e6);
+	printf("processes + pipes: %.3f s, %.0f MB/s input\n", elapsed[0],
+		   st.st_size / elapsed[0] / 1e6);
+	free(arena.head);
+	free(line);
+	return SUCCESS;
+}
 
-		// execute command
-		pid_t pid2;
-		if ((pid2 = fork()) == 0) {
+/**
+ * bench cat <file>: file to file and file to pipe copies with the cat
+ * builtin in the kernel, through a buffer and with /bin/cat, and two cat
+ * thread stages joined by a ring
+ */
+int bench_cat(int argc, char **args) {
+	char path[] = "/tmp/dash-bench-XXXXXX";
+	struct stage_usage usage[MAX_STAGES];
+	struct arena arena = { NULL };
+	struct stat st;
+	const struct {
+		const char *name;
+		const char *format;
+		bool zero_copy;
+	} cases[] = { { "cat > file, in kernel", "cat %s > %s", true },
+				  { "cat > file, buffered", "cat %s > %s", false },
+				  { "/bin/cat > file", "/bin/cat %s > %s", true },
+				  { "cat | wc, in kernel", "cat %s | wc -c > /dev/null", true },
+				  { "cat | wc, buffered", "cat %s | wc -c > /dev/null", false },
+				  { "/bin/cat | wc", "/bin/cat %s | wc -c > /dev/null", true },
+				  { "cat | cat, ring", "cat %s | cat > /dev/null", true } };
+
+	if (argc < 3 || stat(args[2], &st) != 0) {
+		printf("Usage: bench cat <file>\n");
+		return UNKNOWN;
+	}
+	int fd = mkstemp(path);
+	if (fd == -1) {
+		perror("mkstemp");
+		return UNKNOWN;
+	}
+	close(fd);
+
+	for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); ++c) {
+		size_t len = strlen(cases[c].format) + strlen(args[2]) + sizeof(path);
+		char *line = arena_alloc(&arena, len);
+		int waited = 0;
+		snprintf(line, len, cases[c].format, args[2], path);
+		struct command_t *command = parse_command(&arena, line);
+
+		zero_copy = cases[c].zero_copy;
+		double start = now_seconds();
+		execute_command(command, usage, &waited);
+		double elapsed = now_seconds() - start;
+		printf("%-21s %.3f s, %.2f GB/s\n", cases[c].name, elapsed, st.st_size / elapsed / 1e9);
+		arena_reset(&arena);
+	}
+	zero_copy = true;
 
-			// Redirections 
+	unlink(path);
+	free(arena.head);
+	return SUCCESS;
+}
 
-			// Reading redirection
-			if (command->redirects[0] != NULL) {
-				dup2(fd_read, STDIN_FILENO);
-				close(fd_read);
-			}
+/**
+ * bench <what> [...]: measurements of the shell's own machinery
+ */
+int builtin_bench(struct command_t *command) {
+	int argc = command->arg_count - 1; // args ends with NULL
+
+	if (argc >= 2 && strcmp(command->args[1], "spawn") == 0)
+		return bench_spawn(argc, command->args);
+	if (argc >= 2 && strcmp(command->args[1], "kuhex") == 0)
+		return bench_kuhex(argc, command->args);
+	if (argc >= 2 && strcmp(command->args[1], "jobs") == 0)
+		return bench_jobs(argc, command->args);
+	if (argc >= 2 && strcmp(command->args[1], "script") == 0)
+		return bench_script(argc, command->args);
+	if (argc >= 2 && strcmp(command->args[1], "parse") == 0)
+		return bench_parse(argc, command->args);
+	if (argc >= 2 && strcmp(command->args[1], "builtin") == 0)
+		return bench_builtin(argc, command->args);
+	if (argc >= 2 && strcmp(command->args[1], "pipeline") == 0)
+		return bench_pipeline(argc, command->args);
+	if (argc >= 2 && strcmp(command->args[1], "cat") == 0)
+		return bench_cat(argc, command->args);
+	if (argc >= 2 && strcmp(command->args[1], "glob") == 0)
+		return bench_glob(argc, command->args);
+	if (argc >= 2 && strcmp(command->args[1], "psvis") == 0)
+		return bench_psvis(argc, command->args);
+
+	printf("Usage: bench spawn [runs [MB]]\n");
+	printf("       bench kuhex <file> [threads]\n");
+	printf("       bench jobs [count]\n");
+	printf("       bench script [lines]\n");
+	printf("       bench parse [runs]\n");
+	printf("       bench builtin [runs]\n");
+	printf("       bench pipeline <file> [stages]\n");
+	printf("       bench cat <file>\n");
+	printf("       bench glob [files]\n");
+	printf("       bench psvis [runs] [nodes]\n");
+	return UNKNOWN;
+}
 
-			// Overwrite redirection
-			if (command->redirects[1] != NULL) {
-				dup2(fd_write, STDOUT_FILENO);
-				close(fd_write);
-			}
+const struct builtin builtins[] = {
+	{ "cd", builtin_cd, false, NULL },
+	{ "exit", builtin_exit, false, NULL },
+	{ "hash", builtin_hash, false, NULL },
+	{ "bench", builtin_bench, false, NULL },
+	{ "jobs", builtin_jobs, false, NULL },
+	{ "wait", builtin_wait, false, NULL },
+	{ "fg", builtin_fg, false, NULL },
+	{ "kill", builtin_kill, false, NULL },
+	{ "parallel", builtin_parallel, false, NULL },
+	{ "stats", builtin_stats, false, NULL },
+	{ "kuhex", builtin_kuhex, true, NULL },
+	{ "psvis", builtin_psvis, false, NULL },
+	{ "cat", builtin_cat, true, cat_handles },
+	{ "tee", builtin_tee, true, tee_handles },
+	{ "time", NULL, false, NULL },
+	{ NULL, NULL, false, NULL },
+};
 
-			// Append redirection
-			if (command->redirects[2] != NULL) {
-				dup2(fd_append, STDOUT_FILENO);
-				close(fd_append);
-			}
+int process_command(struct command_t *command);
 
+#define SCRIPT_BLOCK_SIZE (1 << 20)
 
-			if (strcmp(command->name, "kuhex") == 0) {
-				if (command->arg_count < 3) {
-					printf("Usage: kuhex <filename> [-g <group_size>]\n");
-					return UNKNOWN;
-				}
+/**
+ * Run commands from fd without the line editor: large blocks are read,
+ * split into lines in place and executed back to back. Lines starting
+ * with # (comments and the #! line) are skipped.
+ * @return EXIT if a command asked the shell to exit, SUCCESS otherwise
+ */
+int run_script(int fd) {
+	struct arena arena = { NULL };
+	size_t capacity = SCRIPT_BLOCK_SIZE, used = 0;
+	char *block = malloc(capacity + 1);
+	int code = SUCCESS;
+	bool eof = false;
+
+	while (code != EXIT && !eof) {
+		ssize_t got = read(fd, block + used, capacity - used);
+		if (got < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("read");
+			break;
+		}
+		used += got;
+		eof = got == 0;
+
+		char *p = block, *end = block + used, *eol;
+		while (code != EXIT && p < end) {
+			eol = memchr(p, '\n', end - p);
+			if (eol == NULL) {
+				if (!eof)
+					break; // finish the line with the next block
+				eol = end;
+			}
+			*eol = '\0';
+
+			char *line = p;
+			p = eol + 1;
+			while (*line == ' ' || *line == '\t')
+				line++;
+			if (*line == '\0' || *line == '#')
+				continue;
+
+			// parsed in place, the block outlives the command
+			double start = now_seconds();
+			struct command_t *command = parse_command(&arena, line);
+			stats.parse_time += now_seconds() - start;
+			stats.parses++;
+			code = process_command(command);
+			arena_reset(&arena);
+
+			// keep our output in order with the children's, and reap
+			// background jobs since there is no prompt to do it
+			fflush(stdout);
+			if (job_count > 0)
+				jobs_reap();
+		}
 
-				char *filename = command->args[1];
-				int group_size = 1; // Default group size
-
-				if (command->arg_count == 5 && strcmp(command->args[1], "-g") == 0) {
-					group_size = atoi(command->args[2]);
-					if (group_size != 1 && group_size != 2 && group_size != 4 &&
-						group_size != 8 && group_size != 16) {
-						printf("Invalid group size. Supported values: 1, 2, 4, 8, 16.\n");
-						return UNKNOWN;
-					}
-					filename = command->args[3];
-				}
+		// keep the partial last line, growing the block if it is that long
+		used = p < end ? end - p : 0;
+		memmove(block, p < end ? p : end, used);
+		if (used == capacity)
+			block = realloc(block, (capacity *= 2) + 1);
+	}
 
-				kuhex_dump(filename, group_size);
-				exit(SUCCESS);
-			} 
+	arena_reset(&arena);
+	free(arena.head);
+	free(block);
+	return code;
+}
 
+int main(int argc, char *argv[]) {
+	jobs_init();
 
+	// dash script, or commands piped in: no prompt and no line editor
+	if (argc > 1 || !isatty(STDIN_FILENO)) {
+		int fd = STDIN_FILENO;
+		if (argc > 1 && (fd = open(argv[1], O_RDONLY | O_CLOEXEC)) == -1) {
+			fprintf(stderr, "-%s: %s: %s\n", sysname, argv[1], strerror(errno));
+			return 127;
+		}
+		run_script(fd);
+		return last_status;
+	}
 
-			else if (strcmp(command->name, "psvis") == 0) {
-				if (command->arg_count < 3) {
-					printf("Usage: psvis <PID> <output_file>\n");
-					return UNKNOWN;
-				}
+	command_index_start();
+	history_init();
 
-				const char *pid = command->args[1];
-				const char *output_file = command->args[2];
+	struct arena arena = { NULL }; // one command line at a time
 
-				// check if the kernel module is loaded
-				FILE *proc_modules = fopen("/proc/modules", "r");
-				if (!proc_modules) {
-					perror("Failed to open /proc/modules");
-					return UNKNOWN;
-				}
+	while (1) {
+		struct command_t *command;
 
-				bool module_loaded = false;
-				char line[256];
-				while (fgets(line, sizeof(line), proc_modules)) {
-					if (strstr(line, "mymodule") != NULL) {
-						module_loaded = true;
-						printf("Kernel Module is already loaded.\n");
-						break;
-					}
-				}
-				fclose(proc_modules);
-
-
-				
-				char path_to_module[PATH_MAX];
-				char src_dir[PATH_MAX];
-				ssize_t len = readlink("/proc/self/exe", path_to_module, sizeof(path_to_module) - 1);
-				if (len != -1) {
-					path_to_module[len] = '\0'; // null terminate
-
-					
-					strncpy(src_dir, path_to_module, sizeof(src_dir) - 1);
-					src_dir[sizeof(src_dir) - 1] = '\0'; // null terminate
-
-					char *directory = dirname(src_dir); // get the directory of the current executable
-					
-					// construct the full path of mymodule.ko 
-					snprintf(path_to_module, sizeof(path_to_module), "%s/module/mymodule.ko", directory);
-
-					// if kernel module is not loaded, load it.
-					if (!module_loaded) {
-						char insmod_command[PATH_MAX + 20];
-						snprintf(insmod_command, sizeof(insmod_command), "sudo insmod %s", path_to_module);
-						if (system(insmod_command) != 0) {
-							perror("Failed to load psvis kernel module");
-							return UNKNOWN;
-						}
-					}
-				} else {
-					perror("Failed to determine the path to the executable");
-					return UNKNOWN;
-				}
+		int code;
+		code = prompt(&arena, &command);
+		if (code == EXIT) {
+			break;
+		}
 
+		code = process_command(command);
+		arena_reset(&arena);
+		if (code == EXIT) {
+			break;
+		}
+	}
 
-				// write the PID to /proc/psvis as parameter
-				FILE *proc_psvis = fopen("/proc/psvis", "w");
-				if (!proc_psvis) {
-					perror("Failed to open /proc/psvis for writing");
-					return UNKNOWN;
-				}
+	printf("\n");
+	return last_status;
+}
 
-				fprintf(proc_psvis, "%s", pid); 
-				fclose(proc_psvis);
+/**
+ * Run a command line. Children it waits for are put in stages with their
+ * resource usage, *waited is how many.
+ */
+int execute_command(struct command_t *command, struct stage_usage *stages, int *waited) {
+	if (strcmp(command->name, "") == 0) {
+		return SUCCESS;
+	}
 
-				
-				proc_psvis = fopen("/proc/psvis", "r");
-				if (!proc_psvis) {
-					perror("Failed to open /proc/psvis for reading");
-					return UNKNOWN;
-				}
+	// Handle piping
+	if (command->next != NULL) { 
+		struct command_t *current_command = command;
+		int pipefd[2];
+		int prev_pipe_read_end = -1; // To store the read end of the previous pipe
+		struct ring *prev_ring = NULL; // or the ring between two thread stages
+		pid_t pids[MAX_STAGES];
+		struct stage_thread threads[MAX_STAGES];
+		struct ring *rings[MAX_STAGES];
+		int stage_count = 0, thread_count = 0, ring_count = 0;
+		double start = now_seconds();
+
+		// every stage needs a slot to be waited for, so refuse before starting any
+		int length = 0;
+		for (struct command_t *c = command; c != NULL; c = c->next)
+			length++;
+		if (length > MAX_STAGES) {
+			fprintf(stderr, "-%s: pipeline of %d commands, at most %d are supported\n",
+					sysname, length, MAX_STAGES);
+			return UNKNOWN;
+		}
 
-				// create a DOT file
-				FILE *dot_file = fopen("process_tree.dot", "w");
-				if (!dot_file) {
-					perror("Failed to create DOT file");
-					fclose(proc_psvis);
-					return UNKNOWN;
-				}
+		// builtins that stream run as threads unless the pipeline is a job
+		bool use_threads = pipeline_threads && !command->background;
 
-				
-				fprintf(dot_file, "digraph ProcessTree {\n");
-				fprintf(dot_file, "node [shape=ellipse];\n");
+		while (current_command != NULL) {
+			const struct builtin *builtin = command_builtin(current_command);
+			bool threaded = use_threads && builtin != NULL && builtin->threaded;
+			int write_end = -1;
+			struct ring *ring = NULL;
 
-				// read the kernel module output and write it to the DOT file
-				char linee[256];
-				while (fgets(linee, sizeof(linee), proc_psvis)) {
-					fprintf(dot_file, "%s", linee);
+			if (current_command->next != NULL) {
+				const struct builtin *next = command_builtin(current_command->next);
+				// two thread stages share a ring, anything else gets a pipe that the
+				// stages only see as stdin/stdout
+				if (threaded && next != NULL && next->threaded) {
+					ring = rings[ring_count++] = ring_new();
+				} else if (pipe2(pipefd, O_CLOEXEC) == -1) {
+					perror("Pipe failed");
+					break;
+				} else {
+					write_end = pipefd[1];
 				}
+			}
 
-				fprintf(dot_file, "}\n");
-				fclose(proc_psvis);
-				fclose(dot_file);
+			if (threaded) {
+				// the thread takes over both ends it is given
+				struct stage_thread *t = &threads[thread_count++];
+				*t = (struct stage_thread){ builtin, current_command,
+											{ prev_ring, ring, prev_pipe_read_end, write_end },
+											&stages[stage_count], start, false, 0 };
+				start_stage_thread(t);
+				pids[stage_count++] = 0;
+			} else {
+				pid_t pid;
+				int r = builtin != NULL ? spawn_builtin(builtin, current_command,
+														prev_pipe_read_end, write_end, &pid)
+										: spawn_command(current_command, prev_pipe_read_end,
+														write_end, &pid);
+				stages[stage_count].command = current_command;
+				if (r == 0) {
+					pids[stage_count++] = pid;
+				} else if (!command->background) {
+					// keep a failed stage for its status, with nothing to wait for
+					memset(&stages[stage_count].usage, 0, sizeof(struct rusage));
+					stages[stage_count].wall = 0;
+					stages[stage_count].status = (r > 0 ? r : UNKNOWN) << 8;
+					pids[stage_count++] = 0;
+				}
 
-				// Graphviz operations to generate the PNG image
-				char graphviz_command[256];
-				snprintf(graphviz_command, sizeof(graphviz_command), "dot -Tpng process_tree.dot -o %s", output_file);
-				if (system(graphviz_command) != 0) {
-					perror("Failed to generate graph image using Graphviz");
-					return UNKNOWN;
+				if (write_end != -1) {
+					close(write_end);
 				}
 
-				printf("Process tree visualization saved to %s\n", output_file);
-				exit(SUCCESS);
-			}
-			
-			
-			
-			else {
-
-				char *path = getenv("PATH");
-				char *dir = strtok(path, ":");
-				char full_path[1024];
-				while (dir != NULL) {
-					snprintf(full_path, sizeof(full_path), "%s/%s", dir, command->name);
-					if (access(full_path, X_OK) == 0) {
-						execv(full_path, command->args); 
-						break;
-					}
-					dir = strtok(NULL, ":");
+				if (prev_pipe_read_end != -1) {
+					close(prev_pipe_read_end);
 				}
-				printf("-%s: %s: command not found\n", sysname, command->name);
-				exit(EXIT_FAILURE);
 			}
-		}
-
-		// Parent waits for pid2 to finish
-		waitpid(pid2, NULL, 0);
 
-		// Close file descriptors
-		close(fd_read);
-		close(fd_write);
-		close(fd_append);
+			// move to the next command and update prev_pipe_read_end
+			prev_pipe_read_end = write_end != -1 ? pipefd[0] : -1;
+			prev_ring = ring;
+			current_command = current_command->next;
+		}
 
-		exit(SUCCESS);
+		if (prev_pipe_read_end != -1) {
+			close(prev_pipe_read_end);
+		}
+		if (current_command != NULL && prev_ring != NULL) {
+			ring_abandon(prev_ring);
+		}
 
-	} else {
-		// TODO: implement background processes here
-		if (command->background) {
-			// don't wait for the child process
-			printf("[%d] Running in background\n", pid);
+		if (command->background && stage_count > 0) {
+			char *text = command_text(command);
+			struct job *job = job_add(text, pids, stage_count);
+			printf("[%d] %d\n", job->id, pids[stage_count - 1]);
+			free(text);
 			return SUCCESS;
+		}
 
+		// wait for all stages of the pipeline to finish
+		wait_stages(pids, stages, stage_count, start);
+		for (int i = 0; i < thread_count; ++i) {
+			if (threads[i].started)
+				pthread_join(threads[i].thread, NULL);
 		}
-		else if (!command->background) {
-			wait(0); // wait for child process to finish
-			return SUCCESS;
+		for (int i = 0; i < ring_count; ++i) {
+			ring_free(rings[i]);
 		}
+		*waited = stage_count;
+		return SUCCESS;
+	}
+	
+	
 
+	
 
-		
+	const struct builtin *builtin = command_builtin(command);
+	if (builtin != NULL && !command->background) {
+		return run_builtin(builtin, command);
 	}
 
-	// TODO: your implementation here
+	pid_t pid;
+	double start = now_seconds();
+	int r = builtin != NULL ? spawn_builtin(builtin, command, -1, -1, &pid)
+							: spawn_command(command, -1, -1, &pid);
+	if (r != 0) {
+		return r > 0 ? r : UNKNOWN; // 127 or 126 becomes the command's status
+	}
 
-	printf("-%s: %s: command not found\n", sysname, command->name);
-	return UNKNOWN;
-}
\ No newline at end of file
+	if (command->background) {
+		// don't wait for the child process, it is reaped from the prompt
+		char *text = command_text(command);
+		struct job *job = job_add(text, &pid, 1);
+		printf("[%d] %d\n", job->id, pid);
+		free(text);
+		return SUCCESS;
+	}
+
+	// wait for child process to finish
+	stages[0].command = command;
+	wait_stages(&pid, stages, 1, start);
+	*waited = 1;
+	return SUCCESS;
+}
+
+/**
+ * Run a command line, with the time prefix and accounting around it.
+ */
+int process_command(struct command_t *command) {
+	struct stage_usage stages[MAX_STAGES];
+	struct rusage before, after;
+	int waited = 0;
+	bool timed = false;
+
+	if (strcmp(command->name, "time") == 0) {
+		timed = true;
+		command->args++;
+		command->arg_count--;
+		command->name = command->args[0] != NULL ? command->args[0] : (char *)"";
+		if (command->name[0] == '\0') {
+			printf("Usage: time command [| command ...]\n");
+			return UNKNOWN;
+		}
+	}
+
+	double start = now_seconds();
+	getrusage(RUSAGE_SELF, &before);
+	int code = execute_command(command, stages, &waited);
+	if (command->name[0] == '\0')
+		return code;
+	if (command->background) {
+		last_status = code == SUCCESS ? 0 : code;
+		return code;
+	}
+
+	double wall = now_seconds() - start;
+	if (waited == 0) {
+		// ran in the shell, charge it what the shell used meanwhile
+		getrusage(RUSAGE_SELF, &after);
+		timersub(&after.ru_utime, &before.ru_utime, &stages[0].usage.ru_utime);
+		timersub(&after.ru_stime, &before.ru_stime, &stages[0].usage.ru_stime);
+		stages[0].usage.ru_maxrss = after.ru_maxrss;
+		stages[0].command = command;
+		stages[0].wall = wall;
+		stages[0].status = code == SUCCESS || code == EXIT ? 0 : code << 8;
+		waited = 1;
+	}
+	account_command(command, stages, waited, wall, timed);
+
+	// a pipeline exits with its last stage, exit has set the status itself
+	int status = stages[waited - 1].status;
+	if (code != EXIT)
+		last_status = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+	return code;
+}
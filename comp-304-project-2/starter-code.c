@@ -1,349 +1,1403 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <ctype.h>
-#include <string.h>
-
-typedef struct MemoryBlock {
-    int start;        // start address
-    int size;         // block size
-    int is_free;      // 1 for free, 0 for allocated
-    char PID[10];     // process ID (empty if free)
-    struct MemoryBlock *next; // pointer to the next block as a linkedlist
-    struct MemoryBlock *prev; // pointer to the previous block as a linkedlist
-} MemoryBlock;
-
-MemoryBlock *head = NULL; 
-
-void initializeMemory(int size) {
-    head = (MemoryBlock *)malloc(sizeof(MemoryBlock));
-    head->start = 0;
-    head->size = size;
-    head->is_free = 1;
-    strcpy(head->PID, "");
-    head->next = NULL;
-    head->prev = NULL;
-}
-
-void printError(char *error){
-
-    fprintf(stderr, "%s\n", error);
-}
-
-
-void Allocate(char *PID, int size, char *type) {
-    MemoryBlock *current = head;
-    MemoryBlock *best_block = NULL;
-    
-
-    // find a block according to input
-    while (current != NULL) {
-        if (current->is_free && current->size >= size) {
-            if (type[0] == 'F') { // first Fit
-                best_block = current;
-                break;
-            } else if (type[0] == 'B') { // best Fit
-                if (best_block == NULL || current->size < best_block->size) {
-                    best_block = current;
-                }
-            } else if (type[0] == 'W') { // worst Fit
-                if (best_block == NULL || current->size > best_block->size) {
-                    best_block = current;
-                }
-            }
-        }
-
-        current = current->next;
-    }
-
-    if (best_block == NULL) {
-        printError("ERROR: Not enough memory available.");
-        return;
-    }
-
-    if (best_block->size == size) {
-        
-        best_block->is_free = 0;
-        strcpy(best_block->PID, PID);
-    } else {
-        // split the block
-        MemoryBlock *new_block = (MemoryBlock *)malloc(sizeof(MemoryBlock));
-        new_block->start = best_block->start; //0
-        new_block->size = size;             
-        new_block->is_free = 0;
-        strcpy(new_block->PID, PID);
-
-        // update the remaining free block
-        best_block->start += size;
-        best_block->size -= size;
-
-        // insert the new block into the linked list
-        new_block->next = best_block;
-        new_block->prev = best_block->prev;
-        if(new_block->prev == NULL){
-            head = new_block;
-        }else{
-            new_block->prev->next = new_block;
-        }
-        
-        best_block->prev = new_block;
-
-    }
-
-    printf("Allocated %d bytes to process %s.\n", size, PID);
-}
-
-
-
-
-void Deallocate(char *PID) {
-    MemoryBlock *current = head;
-    
-    
-    
-    while (current != NULL) {
-        if (!current->is_free && strcmp(current->PID, PID) == 0) {
-            // mark the block as free
-            current->is_free = 1;
-            strcpy(current->PID, "");
-            
-
-            // merge with the previous block if it is free
-            if (current->prev != NULL && current->prev->is_free) {
-                MemoryBlock *prev = current->prev;
-                prev->size += current->size;
-                prev->next = current->next;
-                if (current->next != NULL) {
-                    current->next->prev = prev;
-                }
-
-                free(current); // Free the current block as it is merged
-                current = prev;
-            }
-
-            // merge with the next block if it is free
-            if (current->next != NULL && current->next->is_free) {
-                MemoryBlock *next = current->next;
-                current->size += next->size;
-                current->next = next->next;
-                if (next->next != NULL) {
-                    next->next->prev = current;
-                }
-                free(next); // free the next block (it is merged)
-            }
-
-            printf("Deallocated memory from process %s.\n", PID);
-            return;
-        }
-
-        current = current->next;
-    }
-
-    
-    printError("ERROR: Process ID not found.");
-}
-
-
-void Status() {
-    MemoryBlock *current = head;
-    int total_free = 0;
-    int total_allocated = 0;
-
-    printf("Memory Status:\n");
-
-    // while loop to traverse through memory blocks
-    while (current != NULL) {
-        int end_address = current->start + current->size - 1;
-        if (current->is_free) {
-            printf("Addresses [%d:%d] Unused\n", current->start, end_address);
-            total_free += current->size;
-        } else {
-            printf("Addresses [%d:%d] Process %s\n", current->start, end_address, current->PID);
-            total_allocated += current->size;
-        }
-        current = current->next;
-        //printf("%d ,%d", current->start, current->size);
-    }
-
-    printf("Total free memory: %d bytes\n", total_free);
-    printf("Total allocated memory: %d bytes\n", total_allocated);
-}
-
-
-
-void Compact() {
-    MemoryBlock *current = head;
-    int hole_size = 0;
-    int count = 0;
-    
-
-    printf("Compacting memory...\n");
-
-    // traverse the list and move all allocated blocks to the beginning
-    while (current != NULL) {
-        if (current->is_free) {
-
-            hole_size += current->size;
-            MemoryBlock *prev = NULL;
-            MemoryBlock *next = NULL;
-
-            if(current->prev != NULL){
-                current->prev->next = current->next;
-                prev = current->prev; // setting previous
-            }
-
-            else head = current->next;
-
-            if(current->next != NULL){
-                current->next->prev = current->prev;
-                next = current->next; // setting next
-            }
-            free(current); // removing the hole
-            
-            current = next;
-            
-        }
-
-        else{
-            current->start -= hole_size; // updating the address
-            current = current->next;
-        }        
-    }
-
-    // adding the compact hole at the end
-
-    MemoryBlock *compact_hole = (MemoryBlock *)malloc(sizeof(MemoryBlock));
-    compact_hole->size = hole_size;
-    compact_hole->is_free = 1;
-    compact_hole->next = NULL;
-    strcpy(compact_hole->PID, "");
-
-    current = head;
-    while(current->next != NULL){
-        current = current->next;
-    }
-
-    compact_hole->start = current->start + current->size;
-    compact_hole->prev = current;
-    current->next = compact_hole;
-
-    printf("Compacting is successful\n");
-
-}
-
-
-
-
-
-
-
-
-int main(int argc, char *argv[]) {
-	
-	/* TODO: fill the line below with your names and ids */
-	printf(" Group Name: ahmet-yusuf  \n Student(s) Name: Ahmet Koca, Yusuf Çağan Çelik \n Student(s) ID: 76779, 79730");
-    
-    // initialize first hole
-    if(argc == 2) {
-        
-		/* TODO */
-        int memorySize = atoi(argv[1]);
-        initializeMemory(memorySize);
-
-        
-		printf("HOLE INITIALIZED AT ADDRESS %d WITH %d BYTES\n",/* TODO*/ head->start, /* TODO*/ head->size);
-    }
-    else {
-        printError("ERROR Invalid number of arguments.\n");
-        return 1;
-    }
-    
-    while(1){
-        char *input = malloc(sizeof(char) * 100);
-        printf("allocator>");
-        fgets(input, 100, stdin);
-        input[strcspn(input, "\n")] = '\0'; // remove newline from input
-
-        if(input[0] == '\0') { // empty input = do nothing 
-            continue;
-        }
-
-
-        char* arguments[3];
-        char* token = strtok(input, " ");
-        int tokenCount = 0;
-
-        // get all arguments from input
-        while(token != NULL){
-            arguments[tokenCount] = token;
-            token = strtok(NULL, " ");
-            tokenCount++;
-        }
-        
-         // Handle RQ (Request)
-        if (strcmp(arguments[0], "rq") == 0) {
-            if (tokenCount == 4) {
-                char *pid = arguments[1];
-                int size = atoi(arguments[2]);
-                char *type = arguments[3];
-
-                // Validate size and type
-                if (size <= 0) {
-                    printError("ERROR: Memory size must be a positive integer.");
-                } else if (strcmp(type, "F") != 0 && strcmp(type, "B") != 0 && strcmp(type, "W") != 0) {
-                    printError("ERROR: Invalid allocation strategy. Use 'F', 'B', or 'W'.");
-                } else {
-                    Allocate(pid, size, type);
-                }
-            } 
-
-            else {
-                printError("ERROR Expected expression: RQ \"PID\" \"Bytes\" \"Algorithm\".");
-            }
-            
-        }
-        // RL (Release Memory / Deallocate): Needs 2 arguments and must check if they are valid arguments
-        else if(strcmp(arguments[0], "rl") == 0){
-            if(tokenCount == 2){
-                char *pid = arguments[1];
-                Deallocate(pid);
-            }
-            else{
-                printError("ERROR Expected expression: RL \"PID\".");
-            }
-        }
-        // STATUS: Needs 1 argument
-        else if(strcmp(arguments[0], "status") == 0){
-            if(tokenCount==1){
-                Status();
-            }
-            else{
-                printError("ERROR Expected expression: STATUS.");
-            }
-        }
-        // C (Compact): Needs 1 argument
-        else if(strcmp(arguments[0], "c") == 0){
-            if(tokenCount == 1){
-				
-                Compact();
-            
-			}
-            else{
-                printError("ERROR Expected expression: C.");
-            }
-        }
-        // EXIT: Needs 1 argument
-        else if(strcmp(arguments[0], "exit") == 0){
-            if(tokenCount == 1){
-                printf("Exiting program.\n");
-                exit(0);
-            }
-            else{
-                printError("ERROR Expected expression: EXIT.");
-            }
-        }
-        // If command is not recognized, print error message and continue
-        else{
-            printError("ERROR Invalid command.");
-        }
-    }
-}
\ No newline at end of file
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+
+typedef struct MemoryBlock {
+    int start;        // start address
+    int size;         // block size
+    int is_free;      // 1 for free, 0 for allocated
+    char PID[10];     // process ID (empty if free)
+    struct MemoryBlock *next; // pointer to the next block as a linkedlist
+    struct MemoryBlock *prev; // pointer to the previous block as a linkedlist
+} MemoryBlock;
+
+#define MAX_POOLS 8
+
+// a memory pool models one NUMA-like node with its own address range and block list
+typedef struct MemoryPool {
+    char name[16];     // pool name used by rq and in the reports
+    int base;          // first address of the pool
+    int size;          // pool size
+    int free_bytes;    // total size of the free blocks of the pool
+    MemoryBlock *head; // block list of the pool, sorted by address
+    int requests;      // requests placed in this pool
+    int local_hits;    // requests placed in the pool they asked for first
+    int fallback_in;   // requests placed here after their first choice was full
+    int spilled_out;   // requests that asked for this pool first but went elsewhere
+    int failures;      // requests that asked for this pool first and fit nowhere
+    int indexed;       // 1 if fits are found through free_index instead of the list walk
+    MemoryBlock **free_index; // free blocks sorted by (size, start)
+    MemoryBlock **lowest_from; // lowest_from[i]: free block with the lowest start in free_index[i..]
+    int free_count;
+    int free_capacity;
+} MemoryPool;
+
+MemoryPool pools[MAX_POOLS];
+int pool_count = 0;
+int interleave_next = 0; // next pool for the interleave policy
+int use_index = 0;       // engine of the pools created next, set by --index
+int verbose = 1;         // 0 silences the per request messages (fuzzer and benchmarks)
+
+// free block index of the accelerated engine, kept in sync with the list by the
+// functions that free, split, merge or compact blocks
+
+// position of the first entry not smaller than (size, start)
+int indexLowerBound(MemoryPool *pool, int size, int start) {
+    int low = 0;
+    int high = pool->free_count;
+
+    while (low < high) {
+        int mid = (low + high) / 2;
+        MemoryBlock *block = pool->free_index[mid];
+        if (block->size < size || (block->size == size && block->start < start)) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// recompute lowest_from below an insert or removal at pos, the entries before pos
+// still hold their old values, so the walk stops as soon as one comes out unchanged
+void indexUpdateLowest(MemoryPool *pool, int pos) {
+    for (int i = pos; i >= 0; i--) {
+        if (i >= pool->free_count) {
+            continue;
+        }
+        MemoryBlock *lowest = pool->free_index[i];
+        if (i + 1 < pool->free_count && pool->lowest_from[i + 1]->start < lowest->start) {
+            lowest = pool->lowest_from[i + 1];
+        }
+        if (i < pos && pool->lowest_from[i] == lowest) {
+            return;
+        }
+        pool->lowest_from[i] = lowest;
+    }
+}
+
+void indexInsert(MemoryPool *pool, MemoryBlock *block) {
+    if (!pool->indexed) {
+        return;
+    }
+    if (pool->free_count == pool->free_capacity) {
+        pool->free_capacity = pool->free_capacity ? pool->free_capacity * 2 : 16;
+        pool->free_index = realloc(pool->free_index, sizeof(MemoryBlock *) * pool->free_capacity);
+        pool->lowest_from = realloc(pool->lowest_from, sizeof(MemoryBlock *) * pool->free_capacity);
+    }
+
+    int pos = indexLowerBound(pool, block->size, block->start);
+    memmove(&pool->free_index[pos + 1], &pool->free_index[pos],
+            sizeof(MemoryBlock *) * (pool->free_count - pos));
+    memmove(&pool->lowest_from[pos + 1], &pool->lowest_from[pos],
+            sizeof(MemoryBlock *) * (pool->free_count - pos));
+    pool->free_index[pos] = block;
+    pool->free_count++;
+    indexUpdateLowest(pool, pos);
+}
+
+// must be called before the size or start of the block changes
+void indexRemove(MemoryPool *pool, MemoryBlock *block) {
+    if (!pool->indexed) {
+        return;
+    }
+
+    int pos = indexLowerBound(pool, block->size, block->start);
+    memmove(&pool->free_index[pos], &pool->free_index[pos + 1],
+            sizeof(MemoryBlock *) * (pool->free_count - pos - 1));
+    memmove(&pool->lowest_from[pos], &pool->lowest_from[pos + 1],
+            sizeof(MemoryBlock *) * (pool->free_count - pos - 1));
+    pool->free_count--;
+    indexUpdateLowest(pool, pos - 1);
+}
+
+void indexRebuild(MemoryPool *pool) {
+    pool->free_count = 0;
+    for (MemoryBlock *current = pool->head; current != NULL; current = current->next) {
+        if (current->is_free) {
+            indexInsert(pool, current);
+        }
+    }
+}
+
+// returns 0 if the pool would not fit in the int address space after the previous pools
+int initializeMemory(char *name, int size) {
+    MemoryPool *pool = &pools[pool_count];
+    int base = 0;
+
+    if (pool_count > 0) {
+        if (pools[pool_count - 1].size > INT_MAX - pools[pool_count - 1].base) {
+            return 0;
+        }
+        base = pools[pool_count - 1].base + pools[pool_count - 1].size;
+    }
+    if (size > INT_MAX - base) {
+        return 0;
+    }
+
+    strncpy(pool->name, name, sizeof(pool->name) - 1);
+    pool->name[sizeof(pool->name) - 1] = '\0';
+    pool->base = base;
+    pool->size = size;
+    pool->free_bytes = size;
+    pool->requests = 0;
+    pool->local_hits = 0;
+    pool->fallback_in = 0;
+    pool->spilled_out = 0;
+    pool->failures = 0;
+    pool->indexed = use_index;
+    pool->free_index = NULL;
+    pool->lowest_from = NULL;
+    pool->free_count = 0;
+    pool->free_capacity = 0;
+
+    pool->head = (MemoryBlock *)malloc(sizeof(MemoryBlock));
+    pool->head->start = base;
+    pool->head->size = size;
+    pool->head->is_free = 1;
+    strcpy(pool->head->PID, "");
+    pool->head->next = NULL;
+    pool->head->prev = NULL;
+
+    pool_count++;
+    indexInsert(pool, pool->head);
+    return 1;
+}
+
+MemoryPool *findPool(char *name) {
+    for (int i = 0; i < pool_count; i++) {
+        if (strcmp(pools[i].name, name) == 0) {
+            return &pools[i];
+        }
+    }
+    return NULL;
+}
+
+void printError(const char *error){
+
+    if (!verbose) {
+        return;
+    }
+    fprintf(stderr, "%s\n", error);
+}
+
+
+// reference list walk: find a free block of the pool according to the fit type
+MemoryBlock *findBlock(MemoryPool *pool, int size, char *type) {
+    MemoryBlock *current = pool->head;
+    MemoryBlock *best_block = NULL;
+    
+
+    // find a block according to input
+    while (current != NULL) {
+        if (current->is_free && current->size >= size) {
+            if (type[0] == 'F') { // first Fit
+                best_block = current;
+                break;
+            } else if (type[0] == 'B') { // best Fit
+                if (best_block == NULL || current->size < best_block->size) {
+                    best_block = current;
+                }
+            } else if (type[0] == 'W') { // worst Fit
+                if (best_block == NULL || current->size > best_block->size) {
+                    best_block = current;
+                }
+            }
+        }
+
+        current = current->next;
+    }
+
+    return best_block;
+}
+
+
+// same decisions as the list walk in findBlock: among equal sizes the lowest address wins
+MemoryBlock *findBlockIndexed(MemoryPool *pool, int size, char *type) {
+    int pos = indexLowerBound(pool, size, INT_MIN);
+
+    if (pos == pool->free_count) {
+        return NULL;
+    }
+
+    if (type[0] == 'F') { // first Fit, lowest address among the blocks from pos on
+        return pool->lowest_from[pos];
+    } else if (type[0] == 'B') { // best Fit, smallest large enough block
+        return pool->free_index[pos];
+    } else { // worst Fit, lowest address among the largest blocks
+        int largest = pool->free_index[pool->free_count - 1]->size;
+        return pool->free_index[indexLowerBound(pool, largest, INT_MIN)];
+    }
+}
+
+
+void placeBlock(MemoryPool *pool, MemoryBlock *best_block, char *PID, int size) {
+    indexRemove(pool, best_block);
+
+    if (best_block->size == size) {
+        
+        best_block->is_free = 0;
+        strcpy(best_block->PID, PID);
+    } else {
+        // split the block
+        MemoryBlock *new_block = (MemoryBlock *)malloc(sizeof(MemoryBlock));
+        new_block->start = best_block->start; //0
+        new_block->size = size;             
+        new_block->is_free = 0;
+        strcpy(new_block->PID, PID);
+
+        // update the remaining free block
+        best_block->start += size;
+        best_block->size -= size;
+
+        // insert the new block into the linked list
+        new_block->next = best_block;
+        new_block->prev = best_block->prev;
+        if(new_block->prev == NULL){
+            pool->head = new_block;
+        }else{
+            new_block->prev->next = new_block;
+        }
+        
+        best_block->prev = new_block;
+
+        indexInsert(pool, best_block);
+    }
+
+    pool->free_bytes -= size;
+}
+
+
+// fill order with the pools to try, first choice first, according to the placement policy
+void placementOrder(char policy, MemoryPool *local, MemoryPool **order) {
+    int first = 0;
+
+    if (policy == 'L') { // local first, then the following pools
+        first = (int)(local - pools);
+    } else if (policy == 'I') { // interleave, round robin over the pools
+        first = interleave_next;
+        interleave_next = (interleave_next + 1) % pool_count;
+    }
+
+    for (int i = 0; i < pool_count; i++) {
+        order[i] = &pools[(first + i) % pool_count];
+    }
+
+    if (policy == 'M') { // most free, sort by free bytes (stable so ties keep pool order)
+        for (int i = 1; i < pool_count; i++) {
+            MemoryPool *key = order[i];
+            int j = i - 1;
+            while (j >= 0 && order[j]->free_bytes < key->free_bytes) {
+                order[j + 1] = order[j];
+                j--;
+            }
+            order[j + 1] = key;
+        }
+    }
+}
+
+
+// returns 1 if the request was placed
+int Allocate(char *PID, int size, char *type, char policy, MemoryPool *local) {
+    MemoryPool *order[MAX_POOLS];
+    MemoryPool *pool = NULL;
+    MemoryBlock *best_block = NULL;
+
+    placementOrder(policy, local, order);
+
+    // try the pools in order, falling back to the next one when a pool has no fitting block
+    for (int i = 0; i < pool_count && best_block == NULL; i++) {
+        if (order[i]->free_bytes >= size) {
+            pool = order[i];
+            best_block = pool->indexed ? findBlockIndexed(pool, size, type)
+                                       : findBlock(pool, size, type);
+        }
+    }
+
+    if (best_block == NULL) {
+        order[0]->failures++;
+        printError("ERROR: Not enough memory available.");
+        return 0;
+    }
+
+    placeBlock(pool, best_block, PID, size);
+
+    pool->requests++;
+    if (pool == order[0]) {
+        pool->local_hits++;
+    } else {
+        pool->fallback_in++;
+        order[0]->spilled_out++;
+    }
+
+    if (!verbose) {
+        return 1;
+    }
+
+    if (pool_count == 1) {
+        printf("Allocated %d bytes to process %s.\n", size, PID);
+    } else if (pool == order[0]) {
+        printf("Allocated %d bytes to process %s in pool %s.\n", size, PID, pool->name);
+    } else {
+        printf("Allocated %d bytes to process %s in pool %s (fallback from %s).\n",
+               size, PID, pool->name, order[0]->name);
+    }
+    return 1;
+}
+
+
+
+
+// release the first block of the pool owned by PID, returns 0 if the pool has none
+int deallocateFromPool(MemoryPool *pool, char *PID) {
+    MemoryBlock *current = pool->head;
+    
+    
+    
+    while (current != NULL) {
+        if (!current->is_free && strcmp(current->PID, PID) == 0) {
+            // mark the block as free
+            current->is_free = 1;
+            strcpy(current->PID, "");
+            pool->free_bytes += current->size;
+            
+
+            // merge with the previous block if it is free
+            if (current->prev != NULL && current->prev->is_free) {
+                MemoryBlock *prev = current->prev;
+                indexRemove(pool, prev);
+                prev->size += current->size;
+                prev->next = current->next;
+                if (current->next != NULL) {
+                    current->next->prev = prev;
+                }
+
+                free(current); // Free the current block as it is merged
+                current = prev;
+            }
+
+            // merge with the next block if it is free
+            if (current->next != NULL && current->next->is_free) {
+                MemoryBlock *next = current->next;
+                indexRemove(pool, next);
+                current->size += next->size;
+                current->next = next->next;
+                if (next->next != NULL) {
+                    next->next->prev = current;
+                }
+                free(next); // free the next block (it is merged)
+            }
+
+            indexInsert(pool, current);
+            return 1;
+        }
+
+        current = current->next;
+    }
+
+    return 0;
+}
+
+
+// returns 1 if a block of PID was released
+int Deallocate(char *PID) {
+    for (int i = 0; i < pool_count; i++) {
+        if (deallocateFromPool(&pools[i], PID)) {
+            if (verbose) {
+                printf("Deallocated memory from process %s.\n", PID);
+            }
+            return 1;
+        }
+    }
+
+    
+    printError("ERROR: Process ID not found.");
+    return 0;
+}
+
+
+void Status() {
+    int total_free = 0;
+    int total_allocated = 0;
+
+    printf("Memory Status:\n");
+
+    for (int i = 0; i < pool_count; i++) {
+        MemoryBlock *current = pools[i].head;
+
+        if (pool_count > 1) {
+            printf("Pool %s [%d:%d]:\n", pools[i].name, pools[i].base,
+                   pools[i].base + pools[i].size - 1);
+        }
+
+        // while loop to traverse through memory blocks
+        while (current != NULL) {
+            int end_address = current->start + current->size - 1;
+            if (current->is_free) {
+                printf("Addresses [%d:%d] Unused\n", current->start, end_address);
+                total_free += current->size;
+            } else {
+                printf("Addresses [%d:%d] Process %s\n", current->start, end_address, current->PID);
+                total_allocated += current->size;
+            }
+            current = current->next;
+            //printf("%d ,%d", current->start, current->size);
+        }
+    }
+
+    printf("Total free memory: %d bytes\n", total_free);
+    printf("Total allocated memory: %d bytes\n", total_allocated);
+}
+
+
+
+// per pool statistics of the placement policies
+void Stats() {
+    printf("Pool Statistics:\n");
+    printf("%-15s %10s %10s %10s %8s %8s %8s %8s %8s\n", "Pool", "Size", "Free",
+           "Allocated", "Requests", "Local", "Fallback", "Spilled", "Failed");
+
+    for (int i = 0; i < pool_count; i++) {
+        MemoryPool *pool = &pools[i];
+        printf("%-15s %10d %10d %10d %8d %8d %8d %8d %8d\n", pool->name, pool->size,
+               pool->free_bytes, pool->size - pool->free_bytes, pool->requests,
+               pool->local_hits, pool->fallback_in, pool->spilled_out, pool->failures);
+    }
+}
+
+
+
+void compactPool(MemoryPool *pool) {
+    MemoryBlock *current = pool->head;
+    int hole_size = 0;
+    
+
+    while (current != NULL) {
+        if (current->is_free) {
+
+            hole_size += current->size;
+            MemoryBlock *prev = NULL;
+            MemoryBlock *next = NULL;
+
+            if(current->prev != NULL){
+                current->prev->next = current->next;
+                prev = current->prev; // setting previous
+            }
+
+            else pool->head = current->next;
+
+            if(current->next != NULL){
+                current->next->prev = current->prev;
+                next = current->next; // setting next
+            }
+            free(current); // removing the hole
+            
+            current = next;
+            
+        }
+
+        else{
+            current->start -= hole_size; // updating the address
+            current = current->next;
+        }        
+    }
+
+    // adding the compact hole at the end
+    if (hole_size == 0) {
+        indexRebuild(pool);
+        return;
+    }
+
+    MemoryBlock *compact_hole = (MemoryBlock *)malloc(sizeof(MemoryBlock));
+    compact_hole->size = hole_size;
+    compact_hole->is_free = 1;
+    compact_hole->next = NULL;
+    strcpy(compact_hole->PID, "");
+
+    // the pool may have been completely free
+    if (pool->head == NULL) {
+        compact_hole->start = pool->base;
+        compact_hole->prev = NULL;
+        pool->head = compact_hole;
+        indexRebuild(pool);
+        return;
+    }
+
+    current = pool->head;
+    while(current->next != NULL){
+        current = current->next;
+    }
+
+    compact_hole->start = current->start + current->size;
+    compact_hole->prev = current;
+    current->next = compact_hole;
+    indexRebuild(pool);
+}
+
+
+void Compact() {
+    if (verbose) {
+        printf("Compacting memory...\n");
+    }
+
+    // traverse the list and move all allocated blocks to the beginning of their pool
+    for (int i = 0; i < pool_count; i++) {
+        compactPool(&pools[i]);
+    }
+
+    if (verbose) {
+        printf("Compacting is successful\n");
+    }
+
+}
+
+
+
+
+
+
+
+
+// table driven command parser: lines are split in place, nothing is allocated per line
+
+#define MAX_TOKENS 6    // longest command: RQ PID Bytes Algorithm Policy Pool
+#define INPUT_SIZE 256
+
+// split the line in place at blanks, returns the number of tokens
+// tokens after the first MAX_TOKENS are counted but not stored
+int tokenize(char *line, char **arguments) {
+    int tokenCount = 0;
+    char *p = line;
+
+    while (1) {
+        while (*p == ' ' || *p == '\t' || *p == '\r') {
+            p++;
+        }
+        if (*p == '\0' || *p == '\n') {
+            *p = '\0';
+            return tokenCount;
+        }
+
+        if (tokenCount < MAX_TOKENS) {
+            arguments[tokenCount] = p;
+        }
+        tokenCount++;
+
+        while (*p != ' ' && *p != '\t' && *p != '\r' && *p != '\n' && *p != '\0') {
+            p++;
+        }
+        if (*p == '\0') {
+            return tokenCount;
+        }
+        if (*p == '\n') {
+            *p = '\0';
+            return tokenCount;
+        }
+        *p++ = '\0';
+    }
+}
+
+// strict decimal parser, returns -1 unless the whole token is a positive int
+int parseSize(const char *text) {
+    long value = 0;
+
+    if (*text == '\0') {
+        return -1;
+    }
+    for (; *text != '\0'; text++) {
+        if (*text < '0' || *text > '9') {
+            return -1;
+        }
+        value = value * 10 + (*text - '0');
+        if (value > INT_MAX) {
+            return -1;
+        }
+    }
+    return value > 0 ? (int)value : -1;
+}
+
+
+// RQ (Request): Needs 4 arguments, policy and pool are optional
+void runRequest(char **arguments, int tokenCount) {
+    char *pid = arguments[1];
+    int size = parseSize(arguments[2]);
+    char *type = arguments[3];
+    char *policy = tokenCount >= 5 ? arguments[4] : "L";
+    MemoryPool *local = tokenCount == 6 ? findPool(arguments[5]) : &pools[0];
+
+    // Validate pid, size, type, policy and pool
+    if (strlen(pid) >= sizeof(((MemoryBlock *)0)->PID)) {
+        printError("ERROR: Process ID must be at most 9 characters.");
+    } else if (size <= 0) {
+        printError("ERROR: Memory size must be a positive integer.");
+    } else if (strcmp(type, "F") != 0 && strcmp(type, "B") != 0 && strcmp(type, "W") != 0) {
+        printError("ERROR: Invalid allocation strategy. Use 'F', 'B', or 'W'.");
+    } else if (strcmp(policy, "L") != 0 && strcmp(policy, "I") != 0 && strcmp(policy, "M") != 0) {
+        printError("ERROR: Invalid placement policy. Use 'L', 'I', or 'M'.");
+    } else if (local == NULL) {
+        printError("ERROR: Pool not found.");
+    } else {
+        Allocate(pid, size, type, policy[0], local);
+    }
+}
+
+// RL (Release Memory / Deallocate): Needs 2 arguments
+void runRelease(char **arguments, int tokenCount) {
+    (void)tokenCount;
+    Deallocate(arguments[1]);
+}
+
+void runStatus(char **arguments, int tokenCount) {
+    (void)arguments;
+    (void)tokenCount;
+    Status();
+}
+
+void runStats(char **arguments, int tokenCount) {
+    (void)arguments;
+    (void)tokenCount;
+    Stats();
+}
+
+void runCompact(char **arguments, int tokenCount) {
+    (void)arguments;
+    (void)tokenCount;
+    Compact();
+}
+
+void runExit(char **arguments, int tokenCount) {
+    (void)arguments;
+    (void)tokenCount;
+    printf("Exiting program.\n");
+    exit(0);
+}
+
+typedef struct CommandEntry {
+    const char *name;  // command in lower case, matched case-insensitively
+    int min_tokens;    // token counts including the command itself
+    int max_tokens;
+    void (*run)(char **arguments, int tokenCount);
+    const char *usage; // printed when the token count is wrong
+} CommandEntry;
+
+const CommandEntry commands[] = {
+    {"rq", 4, 6, runRequest, "ERROR Expected expression: RQ \"PID\" \"Bytes\" \"Algorithm\" [\"Policy\" [\"Pool\"]]."},
+    {"rl", 2, 2, runRelease, "ERROR Expected expression: RL \"PID\"."},
+    {"status", 1, 1, runStatus, "ERROR Expected expression: STATUS."},
+    {"stats", 1, 1, runStats, "ERROR Expected expression: STATS."},
+    {"c", 1, 1, runCompact, "ERROR Expected expression: C."},
+    {"exit", 1, 1, runExit, "ERROR Expected expression: EXIT."},
+};
+
+const CommandEntry *findCommand(const char *name) {
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+        const char *a = commands[i].name;
+        const char *b = name;
+
+        while (*a != '\0' && *a == tolower((unsigned char)*b)) {
+            a++;
+            b++;
+        }
+        if (*a == '\0' && *b == '\0') {
+            return &commands[i];
+        }
+    }
+    return NULL;
+}
+
+
+double elapsedSeconds(struct timespec *from) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - from->tv_sec) + (now.tv_nsec - from->tv_nsec) / 1e9;
+}
+
+// differential fuzzer: random command streams run in lockstep through the reference
+// list walk and every accelerated engine, the block maps are compared after every step
+
+typedef struct FuzzOp {
+    char kind;     // 'q' request, 'l' release, 'c' compact
+    char pid[10];
+    int size;
+    char type[2];  // "F", "B" or "W"
+    char policy;   // 'L', 'I' or 'M'
+    int pool;      // local pool of the request
+} FuzzOp;
+
+typedef struct FuzzConfig {
+    int pool_count;
+    int pool_sizes[MAX_POOLS];
+    int pid_count; // distinct PIDs used by the stream
+} FuzzConfig;
+
+// saved globals of one allocator, so several can run side by side
+typedef struct FuzzState {
+    MemoryPool pools[MAX_POOLS];
+    int pool_count;
+    int interleave_next;
+} FuzzState;
+
+typedef struct Engine {
+    const char *name;
+    int indexed;
+} Engine;
+
+// the first engine is the reference
+const Engine engines[] = {
+    {"list", 0},
+    {"index", 1},
+};
+#define ENGINE_COUNT ((int)(sizeof(engines) / sizeof(engines[0])))
+
+unsigned long long fuzzRandom(unsigned long long *seed) {
+    // xorshift64*, so streams are the same on every platform
+    *seed ^= *seed >> 12;
+    *seed ^= *seed << 25;
+    *seed ^= *seed >> 27;
+    return *seed * 2685821657736338717ULL;
+}
+
+void fuzzGenerate(FuzzConfig *config, FuzzOp *ops, int count, unsigned long long seed) {
+    int largest = 0;
+
+    for (int i = 0; i < config->pool_count; i++) {
+        if (config->pool_sizes[i] > largest) {
+            largest = config->pool_sizes[i];
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        FuzzOp *op = &ops[i];
+        int dice = fuzzRandom(&seed) % 100;
+
+        snprintf(op->pid, sizeof(op->pid), "P%d", (int)(fuzzRandom(&seed) % config->pid_count));
+        op->type[0] = "FBW"[fuzzRandom(&seed) % 3];
+        op->type[1] = '\0';
+        op->policy = "LIM"[fuzzRandom(&seed) % 3];
+        op->pool = fuzzRandom(&seed) % config->pool_count;
+
+        // mostly small requests, sometimes one that only fits in a large hole
+        if (fuzzRandom(&seed) % 8 == 0) {
+            op->size = 1 + fuzzRandom(&seed) % (largest / 2 + 1);
+        } else {
+            op->size = 1 + fuzzRandom(&seed) % (largest / 32 + 1);
+        }
+
+        if (dice < 55) {
+            op->kind = 'q';
+        } else if (dice < 97) {
+            op->kind = 'l';
+        } else {
+            op->kind = 'c';
+        }
+    }
+}
+
+void fuzzStart(FuzzState *state, FuzzConfig *config, int indexed) {
+    pool_count = 0;
+    interleave_next = 0;
+    use_index = indexed;
+    for (int i = 0; i < config->pool_count; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "node%d", i);
+        initializeMemory(name, config->pool_sizes[i]);
+    }
+    use_index = 0;
+
+    memcpy(state->pools, pools, sizeof(pools));
+    state->pool_count = pool_count;
+    state->interleave_next = interleave_next;
+}
+
+void fuzzLoad(FuzzState *state) {
+    memcpy(pools, state->pools, sizeof(pools));
+    pool_count = state->pool_count;
+    interleave_next = state->interleave_next;
+}
+
+void fuzzSave(FuzzState *state) {
+    memcpy(state->pools, pools, sizeof(pools));
+    state->interleave_next = interleave_next;
+}
+
+void fuzzFree(FuzzState *state) {
+    for (int i = 0; i < state->pool_count; i++) {
+        MemoryBlock *current = state->pools[i].head;
+        while (current != NULL) {
+            MemoryBlock *next = current->next;
+            free(current);
+            current = next;
+        }
+        free(state->pools[i].free_index);
+        free(state->pools[i].lowest_from);
+    }
+}
+
+// run one op on the loaded allocator, returns 1 if it succeeded
+int fuzzApply(FuzzOp *op) {
+    if (op->kind == 'q') {
+        return Allocate(op->pid, op->size, op->type, op->policy, &pools[op->pool]);
+    } else if (op->kind == 'l') {
+        return Deallocate(op->pid);
+    }
+    Compact();
+    return 1;
+}
+
+void fuzzPrintOp(FILE *out, FuzzOp *op) {
+    if (op->kind == 'q') {
+        fprintf(out, "rq %s %d %s %c node%d\n", op->pid, op->size, op->type, op->policy, op->pool);
+    } else if (op->kind == 'l') {
+        fprintf(out, "rl %s\n", op->pid);
+    } else {
+        fprintf(out, "c\n");
+    }
+}
+
+// returns 0 if both allocators have the same block maps and statistics
+int fuzzCompare(FuzzState *a, FuzzState *b, char *why, size_t whySize) {
+    if (a->interleave_next != b->interleave_next) {
+        snprintf(why, whySize, "interleave cursor %d != %d", a->interleave_next, b->interleave_next);
+        return 1;
+    }
+
+    for (int i = 0; i < a->pool_count; i++) {
+        MemoryPool *pa = &a->pools[i];
+        MemoryPool *pb = &b->pools[i];
+        MemoryBlock *x = pa->head;
+        MemoryBlock *y = pb->head;
+
+        if (pa->free_bytes != pb->free_bytes || pa->requests != pb->requests ||
+            pa->local_hits != pb->local_hits || pa->fallback_in != pb->fallback_in ||
+            pa->spilled_out != pb->spilled_out || pa->failures != pb->failures) {
+            snprintf(why, whySize, "pool %s statistics differ", pa->name);
+            return 1;
+        }
+
+        while (x != NULL && y != NULL) {
+            if (x->start != y->start || x->size != y->size || x->is_free != y->is_free ||
+                strcmp(x->PID, y->PID) != 0) {
+                snprintf(why, whySize, "pool %s: block [%d:%d] %s != [%d:%d] %s", pa->name,
+                         x->start, x->start + x->size - 1, x->is_free ? "Unused" : x->PID,
+                         y->start, y->start + y->size - 1, y->is_free ? "Unused" : y->PID);
+                return 1;
+            }
+            x = x->next;
+            y = y->next;
+        }
+        if (x != NULL || y != NULL) {
+            snprintf(why, whySize, "pool %s: block lists have different lengths", pa->name);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// returns 0 if the free index of every indexed pool holds exactly its free blocks, in order
+int fuzzCheckIndex(FuzzState *state, char *why, size_t whySize) {
+    for (int i = 0; i < state->pool_count; i++) {
+        MemoryPool *pool = &state->pools[i];
+        int free_blocks = 0;
+
+        if (!pool->indexed) {
+            continue;
+        }
+
+        for (MemoryBlock *current = pool->head; current != NULL; current = current->next) {
+            if (current->is_free) {
+                int pos = indexLowerBound(pool, current->size, current->start);
+                if (pos == pool->free_count || pool->free_index[pos] != current) {
+                    snprintf(why, whySize, "pool %s: free block at %d missing from the index",
+                             pool->name, current->start);
+                    return 1;
+                }
+                free_blocks++;
+            }
+        }
+        if (free_blocks != pool->free_count) {
+            snprintf(why, whySize, "pool %s: index holds %d blocks, list has %d free",
+                     pool->name, pool->free_count, free_blocks);
+            return 1;
+        }
+
+        // first fit answers must match a scan of the index suffix
+        for (int pos = pool->free_count - 1; pos >= 0; pos--) {
+            MemoryBlock *lowest = pool->free_index[pos];
+            for (int j = pos + 1; j < pool->free_count; j++) {
+                if (pool->free_index[j]->start < lowest->start) {
+                    lowest = pool->free_index[j];
+                }
+            }
+            if (pool->lowest_from[pos] != lowest) {
+                snprintf(why, whySize, "pool %s: lowest block from index %d is at %d, not %d",
+                         pool->name, pos, pool->lowest_from[pos]->start, lowest->start);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// replay the kept ops through all engines in lockstep
+// returns the position of the first diverging op, or -1 if all engines agree
+int fuzzReplay(FuzzConfig *config, FuzzOp *ops, char *keep, int count, char *why, size_t whySize) {
+    FuzzState states[ENGINE_COUNT];
+    int failed_at = -1;
+
+    for (int e = 0; e < ENGINE_COUNT; e++) {
+        fuzzStart(&states[e], config, engines[e].indexed);
+    }
+
+    for (int i = 0; i < count && failed_at < 0; i++) {
+        int expected = 0;
+
+        if (!keep[i]) {
+            continue;
+        }
+
+        for (int e = 0; e < ENGINE_COUNT && failed_at < 0; e++) {
+            fuzzLoad(&states[e]);
+            int result = fuzzApply(&ops[i]);
+            fuzzSave(&states[e]);
+
+            if (e == 0) {
+                expected = result;
+            } else if (result != expected) {
+                snprintf(why, whySize, "engine %s returned %d, %s returned %d",
+                         engines[0].name, expected, engines[e].name, result);
+                failed_at = i;
+            } else if (fuzzCompare(&states[0], &states[e], why, whySize) != 0 ||
+                       fuzzCheckIndex(&states[e], why, whySize) != 0) {
+                failed_at = i;
+            }
+        }
+    }
+
+    for (int e = 0; e < ENGINE_COUNT; e++) {
+        fuzzFree(&states[e]);
+    }
+    return failed_at;
+}
+
+// drop chunks of ops, then single ops, as long as the stream still diverges
+int fuzzShrink(FuzzConfig *config, FuzzOp *ops, char *keep, int count) {
+    char why[256];
+    int kept = 0;
+
+    for (int i = 0; i < count; i++) {
+        kept += keep[i];
+    }
+
+    for (int chunk = kept / 2 > 0 ? kept / 2 : 1; chunk >= 1; chunk /= 2) {
+        int progress = 1;
+        while (progress) {
+            progress = 0;
+            for (int from = 0; from < count; from += chunk) {
+                char saved[chunk];
+                int removed = 0;
+
+                for (int i = 0; i < chunk && from + i < count; i++) {
+                    saved[i] = keep[from + i];
+                    removed += keep[from + i];
+                    keep[from + i] = 0;
+                }
+                if (removed > 0 && fuzzReplay(config, ops, keep, count, why, sizeof(why)) >= 0) {
+                    kept -= removed;
+                    progress = 1;
+                } else {
+                    for (int i = 0; i < chunk && from + i < count; i++) {
+                        keep[from + i] = saved[i];
+                    }
+                }
+            }
+        }
+    }
+    return kept;
+}
+
+// ops per second of one engine over the whole stream, best of a few rounds
+double fuzzThroughput(FuzzConfig *config, FuzzOp *ops, int count, int indexed) {
+    double best = 0;
+
+    for (int round = 0; round < 3; round++) {
+        FuzzState state;
+        struct timespec start;
+
+        fuzzStart(&state, config, indexed);
+        fuzzLoad(&state);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < count; i++) {
+            fuzzApply(&ops[i]);
+        }
+        double seconds = elapsedSeconds(&start);
+        fuzzSave(&state);
+        fuzzFree(&state);
+
+        if (count / seconds > best) {
+            best = count / seconds;
+        }
+    }
+    return best;
+}
+
+// measure every engine on a long stream with many live blocks
+void engineThroughput(double *opsPerSecond) {
+    FuzzConfig config = {2, {1 << 22, 1 << 22}, 8192};
+    int count = 200000;
+    FuzzOp *ops = malloc(sizeof(FuzzOp) * count);
+
+    fuzzGenerate(&config, ops, count, 304);
+    verbose = 0;
+    for (int e = 0; e < ENGINE_COUNT; e++) {
+        opsPerSecond[e] = fuzzThroughput(&config, ops, count, engines[e].indexed);
+    }
+    verbose = 1;
+    pool_count = 0;
+    free(ops);
+}
+
+// run with --fuzz SEED STREAMS [BASELINE [THRESHOLD]]
+// returns 1 if the engines disagree or an engine got slower than the baseline allows
+int runFuzzer(unsigned long long seed, int streams, const char *baseline, double threshold) {
+    int maxSteps = 400;
+    FuzzOp *ops = malloc(sizeof(FuzzOp) * maxSteps);
+    char keep[maxSteps];
+    char why[256];
+
+    verbose = 0;
+    for (int s = 0; s < streams; s++) {
+        unsigned long long streamSeed = seed * 1000003ULL + s + 1;
+        FuzzConfig config;
+
+        // small pools so holes, fallbacks and failures are common
+        config.pool_count = 1 + fuzzRandom(&streamSeed) % 3;
+        for (int i = 0; i < config.pool_count; i++) {
+            config.pool_sizes[i] = 16 + fuzzRandom(&streamSeed) % 1024;
+        }
+        config.pid_count = 2 + fuzzRandom(&streamSeed) % 24;
+        int count = 1 + fuzzRandom(&streamSeed) % maxSteps;
+
+        fuzzGenerate(&config, ops, count, streamSeed);
+        memset(keep, 1, count);
+
+        int failed_at = fuzzReplay(&config, ops, keep, count, why, sizeof(why));
+        if (failed_at < 0) {
+            continue;
+        }
+
+        // everything after the first divergence is irrelevant
+        memset(keep + failed_at + 1, 0, count - failed_at - 1);
+        int kept = fuzzShrink(&config, ops, keep, count);
+        fuzzReplay(&config, ops, keep, count, why, sizeof(why));
+        verbose = 1;
+
+        printf("fuzz: engines diverge on stream %d (%s), minimal case of %d commands:\n", s, why, kept);
+        printf("pools:");
+        for (int i = 0; i < config.pool_count; i++) {
+            printf(" node%d=%d", i, config.pool_sizes[i]);
+        }
+        printf("\n");
+        for (int i = 0; i < count; i++) {
+            if (keep[i]) {
+                fuzzPrintOp(stdout, &ops[i]);
+            }
+        }
+        free(ops);
+        return 1;
+    }
+    verbose = 1;
+    free(ops);
+    printf("fuzz: seed %llu, %d streams, all %d engines agree\n", seed, streams, ENGINE_COUNT);
+
+    // throughput gate, the baseline holds lines printed by an earlier run
+    double opsPerSecond[ENGINE_COUNT];
+    int regressed = 0;
+
+    engineThroughput(opsPerSecond);
+    for (int e = 0; e < ENGINE_COUNT; e++) {
+        printf("throughput %s %.0f\n", engines[e].name, opsPerSecond[e]);
+    }
+
+    if (baseline != NULL) {
+        FILE *file = fopen(baseline, "r");
+        char line[INPUT_SIZE], name[16];
+        int compared[ENGINE_COUNT] = {0};
+        double expected;
+
+        if (file == NULL) {
+            perror("ERROR Cannot open baseline");
+            return 1;
+        }
+        // a saved --fuzz run also holds the fuzz line, only throughput lines count
+        while (fgets(line, sizeof(line), file) != NULL) {
+            if (sscanf(line, " throughput %15s %lf", name, &expected) != 2) {
+                continue;
+            }
+            for (int e = 0; e < ENGINE_COUNT; e++) {
+                double limit = expected * (1 - threshold / 100);
+                if (strcmp(engines[e].name, name) != 0) {
+                    continue;
+                }
+                compared[e] = 1;
+                if (opsPerSecond[e] < limit) {
+                    printf("REGRESSION: engine %s at %.0f ops/s, baseline %.0f ops/s (%.1f%%, threshold %.1f%%)\n",
+                           name, opsPerSecond[e], expected,
+                           100 * (opsPerSecond[e] - expected) / expected, threshold);
+                    regressed = 1;
+                }
+            }
+        }
+        fclose(file);
+        for (int e = 0; e < ENGINE_COUNT; e++) {
+            if (!compared[e]) {
+                printf("REGRESSION: engine %s has no throughput line in %s\n", engines[e].name, baseline);
+                regressed = 1;
+            }
+        }
+    }
+    return regressed;
+}
+
+
+// the parser this file had before the command table, kept as the baseline of --bench:
+// a fresh buffer per line, strtok, and one strcmp after another
+long parseBaseline(const char *replay) {
+    const char *names[] = {"rq", "rl", "status", "c", "exit"};
+    long checksum = 0;
+    const char *line = replay;
+
+    while (*line != '\0') {
+        const char *end = strchr(line, '\n');
+        if (end == NULL) {
+            end = line + strlen(line);
+        }
+        char *input = malloc(sizeof(char) * 100);
+        size_t len = end - line < 99 ? (size_t)(end - line) : 99;
+        memcpy(input, line, len);
+        input[len] = '\0';
+
+        char *arguments[MAX_TOKENS];
+        char *token = strtok(input, " ");
+        int tokenCount = 0;
+        while (token != NULL) {
+            if (tokenCount < MAX_TOKENS) {
+                arguments[tokenCount] = token;
+            }
+            token = strtok(NULL, " ");
+            tokenCount++;
+        }
+
+        int command = -1;
+        for (int i = 0; tokenCount > 0 && i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+            if (strcmp(arguments[0], names[i]) == 0) {
+                command = i;
+                break;
+            }
+        }
+        if (command == 0 && tokenCount >= 4) {
+            checksum += atoi(arguments[2]);
+        }
+        checksum += tokenCount + (command != -1);
+        free(input);
+        line = *end != '\0' ? end + 1 : end;
+    }
+    return checksum;
+}
+
+// the table driven parser on the same replay, it splits the lines in place
+long parseTable(char *replay) {
+    char *arguments[MAX_TOKENS];
+    long checksum = 0;
+    char *line = replay;
+
+    while (*line != '\0') {
+        char *end = strchr(line, '\n');
+        int tokenCount = tokenize(line, arguments);
+        const CommandEntry *command = tokenCount > 0 ? findCommand(arguments[0]) : NULL;
+
+        if (command == commands && tokenCount >= 4) {
+            checksum += parseSize(arguments[2]);
+        }
+        checksum += tokenCount + (command != NULL);
+        if (end == NULL) {
+            break;
+        }
+        line = end + 1;
+    }
+    return checksum;
+}
+
+void printParse(const char *name, int lines, size_t bytes, double seconds, long checksum) {
+    printf("parse %s: %d lines, %.1f MB in %.3f s, %.2f Mlines/s, %.1f MB/s (checksum %ld)\n",
+           name, lines, bytes / 1e6, seconds, lines / seconds / 1e6, bytes / seconds / 1e6,
+           checksum);
+}
+
+// benchmark suite, run with --bench [lines]
+void runBenchmarks(int lines) {
+    const char *samples[] = {
+        "rq P1 4096 F\n", "RQ P22 128 B I\n", "rl P1\n", "Rq P333 65536 W M node1\n",
+        "RL P22\n", "status\n", "c\n", "rq P4 12 f\n",
+    };
+    int sampleCount = sizeof(samples) / sizeof(samples[0]);
+    size_t bytes = 0;
+
+    for (int i = 0; i < lines; i++) {
+        bytes += strlen(samples[i % sampleCount]);
+    }
+
+    // build the whole replay up front so only the parser is measured
+    char *replay = malloc(bytes + 1);
+    char *p = replay;
+    for (int i = 0; i < lines; i++) {
+        size_t len = strlen(samples[i % sampleCount]);
+        memcpy(p, samples[i % sampleCount], len);
+        p += len;
+    }
+    *p = '\0';
+
+    // the baseline goes first because the table parser splits the replay in place
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long checksum = parseBaseline(replay);
+    double baseline = elapsedSeconds(&start);
+    printParse("strtok", lines, bytes, baseline, checksum);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    checksum = parseTable(replay);
+    double seconds = elapsedSeconds(&start);
+    printParse("table", lines, bytes, seconds, checksum);
+    printf("parse speedup: %.2fx over strtok\n", baseline / seconds);
+    free(replay);
+
+    double opsPerSecond[ENGINE_COUNT];
+    engineThroughput(opsPerSecond);
+    for (int e = 0; e < ENGINE_COUNT; e++) {
+        printf("engine %s: %.0f ops/s\n", engines[e].name, opsPerSecond[e]);
+    }
+}
+
+
+int main(int argc, char *argv[]) {
+	
+    if (argc >= 2 && strcmp(argv[1], "--bench") == 0) {
+        int lines = argc == 3 ? parseSize(argv[2]) : 1000000;
+        if (argc > 3 || lines <= 0) {
+            printError("ERROR Expected expression: --bench [lines].");
+            return 1;
+        }
+        runBenchmarks(lines);
+        return 0;
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "--fuzz") == 0) {
+        unsigned long long seed = 0;
+        int streams = argc >= 4 ? parseSize(argv[3]) : -1;
+        double threshold = 10;
+        char *end = NULL;
+        int valid = argc >= 4 && argc <= 6 && streams > 0 && isdigit((unsigned char)argv[2][0]);
+
+        if (valid) {
+            errno = 0;
+            seed = strtoull(argv[2], &end, 10);
+            valid = *end == '\0' && errno != ERANGE;
+        }
+        if (valid && argc == 6) {
+            threshold = strtod(argv[5], &end);
+            valid = end != argv[5] && *end == '\0' && threshold >= 0 && threshold < 100;
+        }
+        if (!valid) {
+            printError("ERROR Expected expression: --fuzz SEED STREAMS [BASELINE [THRESHOLD]].");
+            return 1;
+        }
+        return runFuzzer(seed, streams, argc >= 5 ? argv[4] : NULL, threshold);
+    }
+
+    // pools created from the command line use the indexed engine
+    if (argc >= 2 && strcmp(argv[1], "--index") == 0) {
+        use_index = 1;
+        argv++;
+        argc--;
+    }
+
+	/* TODO: fill the line below with your names and ids */
+	printf(" Group Name: ahmet-yusuf  \n Student(s) Name: Ahmet Koca, Yusuf Çağan Çelik \n Student(s) ID: 76779, 79730");
+    
+    // initialize first hole of every pool, given as "SIZE" or "NAME=SIZE"
+    if(argc >= 2 && argc <= MAX_POOLS + 1) {
+        
+		/* TODO */
+        for (int i = 1; i < argc; i++) {
+            char name[16];
+            char *sizeArg = strchr(argv[i], '=');
+
+            if (sizeArg != NULL) {
+                *sizeArg++ = '\0';
+                snprintf(name, sizeof(name), "%s", argv[i]);
+            } else {
+                sizeArg = argv[i];
+                snprintf(name, sizeof(name), "node%d", i - 1);
+            }
+
+            int memorySize = parseSize(sizeArg);
+            if (memorySize <= 0 || name[0] == '\0' || findPool(name) != NULL) {
+                printError("ERROR Invalid pool, expected \"SIZE\" or \"NAME=SIZE\".");
+                return 1;
+            }
+            if (!initializeMemory(name, memorySize)) {
+                printError("ERROR The pools do not fit in the address range.");
+                return 1;
+            }
+
+            MemoryPool *pool = &pools[pool_count - 1];
+            if (argc > 2) {
+                printf("POOL %s: ", pool->name);
+            }
+		printf("HOLE INITIALIZED AT ADDRESS %d WITH %d BYTES\n",/* TODO*/ pool->head->start, /* TODO*/ pool->head->size);
+        }
+    }
+    else {
+        printError("ERROR Invalid number of arguments.\n");
+        return 1;
+    }
+    
+    char input[INPUT_SIZE];
+    char *arguments[MAX_TOKENS];
+
+    while(1){
+        printf("allocator>");
+        if (fgets(input, sizeof(input), stdin) == NULL) { // end of a batch replay
+            printf("\n");
+            break;
+        }
+
+        // a line longer than the buffer is dropped as a whole
+        if (strchr(input, '\n') == NULL && !feof(stdin)) {
+            int c;
+            while ((c = getchar()) != '\n' && c != EOF);
+            printError("ERROR Input line is too long.");
+            continue;
+        }
+
+        int tokenCount = tokenize(input, arguments);
+        if(tokenCount == 0) { // empty input = do nothing 
+            continue;
+        }
+
+        const CommandEntry *command = findCommand(arguments[0]);
+        // If command is not recognized, print error message and continue
+        if (command == NULL) {
+            printError("ERROR Invalid command.");
+        } else if (tokenCount < command->min_tokens || tokenCount > command->max_tokens) {
+            printError(command->usage);
+        } else {
+            command->run(arguments, tokenCount);
+        }
+    }
+
+    return 0;
+}